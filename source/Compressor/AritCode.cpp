@@ -1,6 +1,24 @@
 #include "AritCode.h"
 
 #include <cstdint>
+#include <cmath>
+
+extern "C"
+{
+	int LogTable[TABLE_BIT_PRECISION * 2];
+}
+
+// LogTable[i] = log2(i / TABLE_BIT_PRECISION) in units of 1/TABLE_BIT_PRECISION bits.
+// Entries below TABLE_BIT_PRECISION are biased by one, as in the original assembly table.
+void InitLogTable()
+{
+	LogTable[0] = 0;
+	for(int i = 1; i < TABLE_BIT_PRECISION * 2; i++)
+	{
+		int v = (int)floor((log2((double)i) - TABLE_BIT_PRECISION_BITS) * TABLE_BIT_PRECISION + 0.5);
+		LogTable[i] = i < TABLE_BIT_PRECISION ? v + 1 : v;
+	}
+}
 
 void AritCodeInit(struct AritState *state, void *dest_ptr)
 {
@@ -16,19 +34,33 @@ unsigned int AritCodePos(struct AritState *state)
 	return (state->dest_bit << 12) + AritSize2(right_prob, 0x20000000 - right_prob) + 1;
 }
 
+// Adds one to the output at the bit before dest_bit. Bits are stored from the least significant bit
+// of each byte, so the carry ripples toward lower bits and bytes, and is propagated a byte at a time.
 __forceinline void PutBit(unsigned char* dest_ptr, int dest_bit)
 {
-	unsigned int msk, v;
-	do
+	int pos = dest_bit - 1;
+	if(pos < 0)
+		return;
+
+	int index = pos >> 3;
+	unsigned int bits = (2u << (pos & 7)) - 1;	// The bit and the bits before it in its byte
+	while(true)
 	{
-		--dest_bit;
-		if(dest_bit < 0)
+		unsigned int v = dest_ptr[index];
+		unsigned int zeros = ~v & bits;
+		if(zeros)
+		{
+			// Flip the ones after the last zero, and the zero
+			unsigned long last;
+			_BitScanReverse(&last, zeros);
+			dest_ptr[index] = (unsigned char)(v ^ (bits & ~((1u << last) - 1)));
+			return;
+		}
+		dest_ptr[index] = (unsigned char)(v ^ bits);
+		if(--index < 0)
 			return;
-		msk = 1u << (dest_bit & 7);
-		
-		v = dest_ptr[dest_bit >> 3];
-		dest_ptr[dest_bit >> 3] = v ^ msk;
-	} while(v & msk);
+		bits = 0xFF;
+	}
 }
 
 void AritCode(struct AritState *state, unsigned int zero_prob, unsigned int one_prob, int bit)
@@ -55,14 +87,28 @@ void AritCode(struct AritState *state, unsigned int zero_prob, unsigned int one_
 		interval_size = threshold;
 	}
 
-	while(interval_size < 0x80000000)
+	// Renormalize, shifting out the leading bits of the interval at once. Bits after dest_bit
+	// are still zero in the cleared output, so they are set without carrying. The interval is never
+	// empty while both probabilities are positive.
+	unsigned long top;
+	bool nonEmpty = _BitScanReverse(&top, interval_size) != 0;
+	assert(nonEmpty);
+	int shift = nonEmpty ? 31 - (int)top : 0;
+	if(shift > 0)
 	{
-		dest_bit++;
-		
-		if(interval_min & 0x80000000)
-			PutBit(dest_ptr, dest_bit);
-		interval_min <<= 1;
-		interval_size <<= 1;
+		unsigned int bits = interval_min >> (32 - shift);
+		while(bits)
+		{
+			unsigned long b;
+			_BitScanReverse(&b, bits);
+			bits ^= 1u << b;
+			int pos = (int)dest_bit + (shift - 1 - (int)b);
+			if(pos >= 0)
+				dest_ptr[pos >> 3] |= (unsigned char)(1u << (pos & 7));
+		}
+		dest_bit += shift;
+		interval_min <<= shift;
+		interval_size <<= shift;
 	}
 
 	state->dest_bit = dest_bit;
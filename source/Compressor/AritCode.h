@@ -3,7 +3,8 @@
 #define _ARITCODE_H_
 
 #include <cassert>
-#include <intrin.h>
+
+#include "Platform.h"
 
 static const int TABLE_BIT_PRECISION_BITS = 12;
 static const int TABLE_BIT_PRECISION = 1 << TABLE_BIT_PRECISION_BITS;
@@ -20,6 +21,8 @@ void			AritCode(struct AritState *state, unsigned int zero_prob, unsigned int on
 unsigned int	AritCodePos(struct AritState *state);
 int __cdecl		AritCodeEnd(struct AritState *state);
 
+void			InitLogTable();
+
 extern "C"
 {
 	extern int LogTable[];
@@ -29,15 +32,15 @@ inline int AritSize2(int right_prob, int wrong_prob) {
 	assert(right_prob > 0);
 	assert(wrong_prob > 0);
 
-	int right_len, total_len;
+	unsigned long right_bit = 0, total_bit = 0;
 	int total_prob = right_prob + wrong_prob;
 	if(total_prob < TABLE_BIT_PRECISION) {
 		return LogTable[total_prob] - LogTable[right_prob];
 	}
-	_BitScanReverse((unsigned long*)&right_len, right_prob);
-	_BitScanReverse((unsigned long*)&total_len, total_prob);
-	right_len = right_len > 12 ? (right_len - 12) : 0;
-	total_len = total_len > 12 ? (total_len - 12) : 0;
+	_BitScanReverse(&right_bit, right_prob);
+	_BitScanReverse(&total_bit, total_prob);
+	int right_len = right_bit > 12 ? (right_bit - 12) : 0;
+	int total_len = total_bit > 12 ? (total_bit - 12) : 0;
 	return LogTable[total_prob >> total_len] - LogTable[right_prob >> right_len] + ((total_len - right_len) << 12);
 }
 
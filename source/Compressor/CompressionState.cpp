@@ -1,50 +1,53 @@
 #include "CompressionState.h"
+#include <atomic>
+#include <condition_variable>
 #include <memory>
-#include <ppl.h>
+#include <mutex>
+#include <vector>
+#include <cstring>
 
 #include "ModelList.h"
 #include "AritCode.h"
 #include "Model.h"
 #include "Compressor.h"
+#include "ThreadPool.h"
 
 struct HashEntry {
-	unsigned char mask;
-	unsigned char bitnum;
+	int bitpos;		// Position of the first occurrence of the context, or -1 for an empty slot
 	Weights w;
-	const unsigned char* datapos;
 };
 
-static int PreviousPrime(int n) {
-in:
-	n = (n-2)|1;
-	for (int i = 3 ; i*i < n ; i += 2) {
-		if (n/i*i == n) goto in;
-	}
-	return n;
+static int NextPowerOf2(int v) {
+	v--;
+	v |= v >> 1;
+	v |= v >> 2;
+	v |= v >> 4;
+	v |= v >> 8;
+	v |= v >> 16;
+	return v+1;
+}
+
+// Context window of a bit: the 8 preceding bytes selected by the model mask,
+// followed by the already coded bits of the current byte.
+static __forceinline __m128i MaskedContext(const unsigned char* data, int bitpos, const __m128i* masks) {
+	return _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + (bitpos >> 3) - MAX_CONTEXT_LENGTH)), masks[bitpos & 7]);
 }
 
-static HashEntry *FindEntry(HashEntry *table, unsigned int hashsize, unsigned char mask, const unsigned char *data, int bitpos) {
-	const unsigned char *datapos = &data[bitpos/8];
-	unsigned char bitnum = (unsigned char)(bitpos & 7);
-	for (unsigned int hash = ModelHash(data, bitpos, mask, HASH_MULTIPLIER) ;; hash = hash+1) {
-		HashEntry *e = &table[hash % hashsize];
-		if (e->datapos == 0) {
-			e->mask = mask;
-			e->bitnum = bitnum;
-			e->datapos = datapos;
+// The bit number goes into the unused top lanes, so contexts of different bit numbers hash apart
+static __forceinline unsigned int MaskedContextHash(__m128i masked_contextdata, int bitpos) {
+	return ContextHash(_mm_insert_epi16(masked_contextdata, bitpos & 7, 7));
+}
+
+static HashEntry *FindEntry(HashEntry *table, unsigned int hashmask, const __m128i* masks, const unsigned char *data, int bitpos, __m128i masked_contextdata, unsigned int hash) {
+	for (;; hash = hash+1) {
+		HashEntry *e = &table[hash & hashmask];
+		if (e->bitpos < 0) {
+			e->bitpos = bitpos;
 			return e;
 		}
-		if (e->mask == mask && e->bitnum == bitnum &&
-			(datapos[0] & (0xFF00 >> bitnum)) == (e->datapos[0] & (0xFF00 >> bitnum))) {
-				int all = 1;
-				for (int i = 0 ; i < 8 ; i++) {
-					if (((mask >> i) & 1) && datapos[i-8] != e->datapos[i-8]) {
-						all = 0;
-						break;
-					}
-				}
-				if (all) return e;
-			}
+		if (((e->bitpos ^ bitpos) & 7) == 0 &&
+			_mm_movemask_epi8(_mm_cmpeq_epi8(MaskedContext(data, e->bitpos, masks), masked_contextdata)) == 0xFFFF)
+			return e;
 	}
 }
 
@@ -53,8 +56,19 @@ void UpdateWeights(Weights *w, int bit, bool saturate) {
 	if (w->prob[!bit] > 1) w->prob[!bit] >>= 1;
 }
 
-ModelPredictions CompressionState::ApplyModel(const unsigned char* data, int bitlength, unsigned char mask) {
-	int hashsize = PreviousPrime(bitlength*2);
+static ModelPredictions ApplyModel(const unsigned char* data, int bitlength, unsigned char mask, bool saturate) {
+	unsigned int hashsize = NextPowerOf2(bitlength*3/2);
+	unsigned int hashmask = hashsize - 1u;
+
+	__m128i masks[8];
+	for (int bitnum = 0; bitnum < 8; bitnum++) {
+		unsigned char maskbytes[16] = {};
+		for (int i = 0; i < 8; i++) {
+			maskbytes[i] = ((mask >> i) & 1) * 0xff;
+		}
+		maskbytes[8] = (unsigned char)(0xff00 >> bitnum);
+		masks[bitnum] = _mm_loadu_si128((__m128i*)maskbytes);
+	}
 	
 	int maxPackages = (bitlength + PACKAGE_SIZE - 1) / PACKAGE_SIZE;
 	int numPackages = 0;
@@ -63,35 +77,45 @@ ModelPredictions CompressionState::ApplyModel(const unsigned char* data, int bit
 	int* packageOffsets = new int[maxPackages];
 	HashEntry* hashtable = new HashEntry[hashsize];
 	memset(hashtable, 0, hashsize*sizeof(HashEntry));
+	for (unsigned int i = 0; i < hashsize; i++) {
+		hashtable[i].bitpos = -1;
+	}
+
+	// The context of the next bit is hashed and its slot prefetched while the current bit is looked up
+	__m128i next_masked_contextdata = MaskedContext(data, 0, masks);
+	unsigned int next_hash = MaskedContextHash(next_masked_contextdata, 0);
 	
-	__m128 logScale = _mm_set1_ps(m_logScale);
 	for (int idx = 0 ; idx < maxPackages; idx++) {
 		int bitpos_base = idx * PACKAGE_SIZE;
 		
+		CompactPackage* package = &packages[numPackages];
 		bool package_needs_commit = false;
 		for(int bitpos_offset = 0; bitpos_offset < PACKAGE_SIZE; bitpos_offset++)
 		{
-			float p_right = 0;
-			float p_total = 0;
+			unsigned char* counters = package->counters[bitpos_offset >> 2];
+			int lane = bitpos_offset & 3;
+			counters[lane] = 0;
+			counters[4 + lane] = 0;
 			if(bitpos_base + bitpos_offset < bitlength)
 			{
-				int bit = GetBit(data, bitpos_base + bitpos_offset);
-				HashEntry *e = FindEntry(hashtable, hashsize, mask, data, bitpos_base + bitpos_offset);
-				int boost = (e->w.prob[0] == 0 || e->w.prob[1] == 0) ? 2 : 0;
+				int bitpos = bitpos_base + bitpos_offset;
+				int bit = GetBit(data, bitpos);
+				__m128i masked_contextdata = next_masked_contextdata;
+				unsigned int hash = next_hash;
+				next_masked_contextdata = MaskedContext(data, bitpos + 1, masks);
+				next_hash = MaskedContextHash(next_masked_contextdata, bitpos + 1);
+				_mm_prefetch((const char*)&hashtable[next_hash & hashmask], _MM_HINT_T0);
+
+				HashEntry *e = FindEntry(hashtable, hashmask, masks, data, bitpos, masked_contextdata, hash);
 				if(e->w.prob[0] || e->w.prob[1])
 					package_needs_commit = true;
 
-				p_right = (float)(e->w.prob[bit] << boost);
-				p_total = (float)((e->w.prob[0] + e->w.prob[1]) << boost);
-				UpdateWeights(&e->w, bit, m_saturate);
+				counters[lane] = e->w.prob[bit];
+				counters[4 + lane] = e->w.prob[!bit];
+				UpdateWeights(&e->w, bit, saturate);
 			}
-
-			assert((*(int*)&p_right & 0xFFFF) == 0);
-			assert((*(int*)&p_total & 0xFFFF) == 0);
-
-			packages[numPackages].prob[bitpos_offset >> 2].m128i_u16[(bitpos_offset & 3)] = *(int*)&p_right >> 16;
-			packages[numPackages].prob[bitpos_offset >> 2].m128i_u16[4 + (bitpos_offset & 3)] = *(int*)&p_total >> 16;
 		}
+
 		packageOffsets[numPackages] = idx;
 		if(package_needs_commit)
 			numPackages++;	// Actually commit the package if 
@@ -106,43 +130,135 @@ ModelPredictions CompressionState::ApplyModel(const unsigned char* data, int bit
 	return mp;
 }
 
+enum PredictionsState {PREDICTIONS_MISSING, PREDICTIONS_COMPUTING, PREDICTIONS_READY};
+
+// Model predictions are computed the first time a model is used, unless a prefetch task on the
+// thread pool got to them first. Released predictions are computed again if needed.
+struct CompressionState::Predictions : std::enable_shared_from_this<CompressionState::Predictions> {
+	std::vector<unsigned char>	data;			// Context followed by the data and 16 bytes of padding for 128-bit loads
+	int							bitlength;
+	bool						saturate;
+	ModelPredictions			models[256];
+	std::atomic<int>			states[256];
+	std::atomic<bool>			prefetched[256];
+	std::mutex					mutex;
+	std::condition_variable		computed;
+
+	Predictions(const unsigned char* inputData, int size, const unsigned char* context, bool saturate) :
+		data(size + MAX_CONTEXT_LENGTH + 16), bitlength(size * 8), saturate(saturate)
+	{
+		memcpy(data.data(), context, MAX_CONTEXT_LENGTH);
+		memcpy(data.data() + MAX_CONTEXT_LENGTH, inputData, size);
+		for(int mask = 0; mask < 256; mask++) {
+			models[mask].numPackages = 0;
+			models[mask].packages = NULL;
+			models[mask].packageOffsets = NULL;
+			states[mask] = PREDICTIONS_MISSING;
+			prefetched[mask] = false;
+		}
+	}
+
+	~Predictions() {
+		for(int mask = 0; mask < 256; mask++) {
+			_aligned_free(models[mask].packages);
+			delete[] models[mask].packageOffsets;
+		}
+	}
+
+	// Computes the predictions of a model unless another thread already does
+	bool TryCompute(int mask) {
+		int expected = PREDICTIONS_MISSING;
+		if(!states[mask].compare_exchange_strong(expected, PREDICTIONS_COMPUTING))
+			return false;
+
+		models[mask] = ApplyModel(data.data() + MAX_CONTEXT_LENGTH, bitlength, (unsigned char)mask, saturate);
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			states[mask] = PREDICTIONS_READY;
+		}
+		computed.notify_all();
+		return true;
+	}
+
+	void Require(int mask) {
+		if(states[mask] == PREDICTIONS_READY || TryCompute(mask))
+			return;
+		std::unique_lock<std::mutex> lock(mutex);
+		computed.wait(lock, [&]() { return states[mask] == PREDICTIONS_READY; });
+	}
+
+	// Queues the computation of a model on the thread pool. The task does nothing once the predictions are gone.
+	void Prefetch(int mask) {
+		if(states[mask] != PREDICTIONS_MISSING || prefetched[mask].exchange(true))
+			return;
+		std::weak_ptr<Predictions> weak = shared_from_this();
+		ThreadPool::Instance().Spawn([weak, mask]() {
+			if(std::shared_ptr<Predictions> predictions = weak.lock())
+				predictions->TryCompute(mask);
+		});
+	}
+
+	// Frees the predictions of a model. Must not run concurrently with any evaluation of the model.
+	void Release(int mask) {
+		int expected = PREDICTIONS_READY;
+		if(!states[mask].compare_exchange_strong(expected, PREDICTIONS_COMPUTING))
+			return;
+
+		_aligned_free(models[mask].packages);
+		delete[] models[mask].packageOffsets;
+		models[mask].numPackages = 0;
+		models[mask].packages = NULL;
+		models[mask].packageOffsets = NULL;
+		// Allow prefetching the model again before it can be seen missing
+		prefetched[mask] = false;
+		states[mask] = PREDICTIONS_MISSING;
+	}
+};
+
 CompressionState::CompressionState(const unsigned char* data, int size, int baseprob, bool saturate, CompressionStateEvaluator* evaluator, const unsigned char* context) :
-	m_size(size*8), m_saturate(saturate), m_stateEvaluator(evaluator)
+	m_size(size*8), m_saturate(saturate), m_baseprob(baseprob), m_stateEvaluator(evaluator)
 {
-	// Create temporary data buffer with leading zeros
-	unsigned char* data2 = new unsigned char[size+MAX_CONTEXT_LENGTH];
-	memcpy(data2, context, MAX_CONTEXT_LENGTH);
-	memcpy(data2+MAX_CONTEXT_LENGTH, data, size);
-
 	assert(baseprob >= 9);
 	m_logScale = 1.0f / 2048.0f;	// baseprob * logScale^16 >= FLT_MIN
 
-	// Apply models
-#if USE_OPENMP
-	#pragma omp parallel for
-	for(int mask = 0; mask <= 0xff; mask++) {
-		m_models[mask] = ApplyModel(data2+MAX_CONTEXT_LENGTH, m_size, (unsigned char)mask);
-	}
-#else
-	concurrency::parallel_for(0, 0x100, [&](int mask)
-	{
-		m_models[mask] = ApplyModel(data2+MAX_CONTEXT_LENGTH, m_size, (unsigned char)mask);
-	});
-#endif
-	delete[] data2;
+	m_predictions = std::make_shared<Predictions>(data, size, context, saturate);
 
-	m_stateEvaluator->Init(m_models, size*8, baseprob, m_logScale);
+	m_stateEvaluator->Init(m_predictions->models, size*8, baseprob, m_logScale);
 	m_compressedsize = TABLE_BIT_PRECISION*(long long)m_size;
 }
 
+CompressionState::CompressionState(const CompressionState& source, CompressionStateEvaluator* evaluator) :
+	m_size(source.m_size), m_saturate(source.m_saturate), m_baseprob(source.m_baseprob), m_predictions(source.m_predictions),
+	m_stateEvaluator(evaluator), m_logScale(source.m_logScale)
+{
+	m_stateEvaluator->Init(m_predictions->models, m_size, m_baseprob, m_logScale);
+	CopyState(source);
+}
+
 CompressionState::~CompressionState() {
-	for(int i = 0; i < 256; i++) {
-		_aligned_free(m_models[i].packages);
-		delete[] m_models[i].packageOffsets;
-	}
 }
 
 int CompressionState::SetModels(const ModelList4k& models) {
+	for(int i = 0; i < models.nmodels; i++)
+		m_predictions->Require(models[i].mask);
 	m_compressedsize = m_stateEvaluator->Evaluate(models);
 	return (int) (m_compressedsize / (TABLE_BIT_PRECISION / BIT_PRECISION));
 }
+
+void CompressionState::PrefetchModels(const unsigned char* masks, int count) {
+	for(int i = 0; i < count; i++)
+		m_predictions->Prefetch(masks[i]);
+}
+
+void CompressionState::ReleaseModel(unsigned char mask) {
+	m_predictions->Release(mask);
+}
+
+bool CompressionState::HasPredictions(unsigned char mask) const {
+	return m_predictions->states[mask] == PREDICTIONS_READY;
+}
+
+void CompressionState::CopyState(const CompressionState& source) {
+	m_stateEvaluator->CopyState(*source.m_stateEvaluator);
+	m_compressedsize = source.m_compressedsize;
+}
@@ -4,20 +4,38 @@
 
 #include "CompressionStateEvaluator.h"
 
+#include <memory>
+
 class CompressionState {
+	struct Predictions;
+
 	int							m_size;
 	bool						m_saturate;
-	ModelPredictions			m_models[256];
+	int							m_baseprob;
+	std::shared_ptr<Predictions>	m_predictions;		// Shared with replicas
 	long long					m_compressedsize;
 	CompressionStateEvaluator*	m_stateEvaluator;
 	float						m_logScale;
-
-	ModelPredictions			ApplyModel(const unsigned char* data, int bitlength, unsigned char mask);
 public:
 	CompressionState(const unsigned char* data, int size, int baseprob, bool saturate, CompressionStateEvaluator* evaluator, const unsigned char* context);
+	CompressionState(const CompressionState& source, CompressionStateEvaluator* evaluator);	// Replica sharing the model predictions of source
 	~CompressionState();
 	
 	int SetModels(const ModelList4k& models);
+	bool UsesModel(unsigned char mask) const	{ return m_stateEvaluator->GetWeight(mask) != 0; }
+
+	// Starts computing the predictions of upcoming models on the thread pool
+	void PrefetchModels(const unsigned char* masks, int count);
+	// Frees the predictions of a model no state uses. They are computed again if it is used after all.
+	void ReleaseModel(unsigned char mask);
+	bool HasPredictions(unsigned char mask) const;	// The predictions of the model are computed
+	void CopyState(const CompressionState& source);
+	void Reset()		{ m_stateEvaluator->Reset(); m_compressedsize = m_stateEvaluator->GetCompressedSize(); }
+
+	// Makes the following SetModels calls undoable by Rollback until Commit
+	void Checkpoint()	{ m_stateEvaluator->Checkpoint(); }
+	void Rollback()		{ m_stateEvaluator->Rollback(); m_compressedsize = m_stateEvaluator->GetCompressedSize(); }
+	void Commit()		{ m_stateEvaluator->Commit(); }
 
 	int GetCompressedSize() const	{ return (int)(m_compressedsize / (TABLE_BIT_PRECISION / BIT_PRECISION)); }
 	int GetSize() const				{ return m_size;}
@@ -1,9 +1,13 @@
 #include "CompressionStateEvaluator.h"
 #include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 #include <memory>
-#include <ppl.h>
+#include <vector>
 
 #include "AritCode.h"
+#include "ThreadPool.h"
 
 #define IACA_VC64_START __writegsbyte(111, 111);
 #define IACA_VC64_END   __writegsbyte(222, 222);
@@ -13,8 +17,33 @@
 
 #define EXTRA_BITS 0
 
-CompressionStateEvaluator::CompressionStateEvaluator() :
-	m_models(NULL), m_packages(NULL), m_packageSizes(NULL)
+static const int PACKAGES_PER_JOB = 64;
+
+static InstructionSet DetectInstructionSet() {
+	int info[4];
+	CpuId(info, 0, 0);
+	int maxLeaf = info[0];
+	CpuId(info, 1, 0);
+	bool osxsave = (info[2] >> 27) & 1;
+	bool avx = (info[2] >> 28) & 1;
+	if(maxLeaf < 7 || !osxsave || !avx)
+		return INSTRUCTION_SET_SSE;
+
+	// The OS must save the YMM (and ZMM) registers on context switches
+	unsigned long long xcr0 = XGetBV(0);
+	CpuId(info, 7, 0);
+	bool avx2 = ((info[1] >> 5) & 1) && (xcr0 & 0x06) == 0x06;
+	bool avx512 = ((info[1] >> 16) & 1) && (xcr0 & 0xE6) == 0xE6;
+	if(avx2 && avx512)
+		return INSTRUCTION_SET_AVX512;
+	if(avx2)
+		return INSTRUCTION_SET_AVX2;
+	return INSTRUCTION_SET_SSE;
+}
+
+CompressionStateEvaluator::CompressionStateEvaluator(InstructionSet instructionSet) :
+	m_models(NULL), m_packages(NULL), m_packageSizes(NULL), m_instructionSet(instructionSet),
+	m_checkpointed(false), m_epoch(0), m_savedEpochs(NULL), m_savedPackages(NULL), m_savedPackageSizes(NULL)
 {
 	memset(m_weights, 0, sizeof(m_weights));
 }
@@ -22,6 +51,9 @@ CompressionStateEvaluator::CompressionStateEvaluator() :
 CompressionStateEvaluator::~CompressionStateEvaluator() {
 	_aligned_free(m_packages);
 	delete[] m_packageSizes;
+	_aligned_free(m_savedPackages);
+	delete[] m_savedPackageSizes;
+	delete[] m_savedEpochs;
 }
 
 bool CompressionStateEvaluator::Init(ModelPredictions* models, int length, int baseprob, float logScale)
@@ -30,156 +62,485 @@ bool CompressionStateEvaluator::Init(ModelPredictions* models, int length, int b
 	m_models = models;
 	m_baseprob = baseprob;
 
+	// Use the requested instruction set, or the best one supported by the CPU if that is lower
+	InstructionSet supported = DetectInstructionSet();
+	if(m_instructionSet == INSTRUCTION_SET_AUTO || m_instructionSet > supported)
+		m_instructionSet = supported;
+
 	int numPackages = (length + PACKAGE_SIZE - 1) / PACKAGE_SIZE;
+	m_numPackages = numPackages;
 	m_logScale = logScale;
-	m_packages = (Package*)_aligned_malloc(numPackages * sizeof(Package), alignof(Package));
+	m_packages = (Package*)_aligned_malloc(numPackages * sizeof(Package), 64);
 	m_packageSizes = new unsigned int[numPackages];
-	for(int i = 0; i < numPackages; i++) {
+	Reset();
+
+	return true;
+}
+
+void CompressionStateEvaluator::Reset() {
+	for(int i = 0; i < m_numPackages; i++) {
 		for(int j = 0; j < NUM_PACKAGE_VECTORS; j++)
 		{
-			m_packages[i].prob[j][0] = _mm_set1_ps(baseprob * logScale);
-			if(i * PACKAGE_SIZE + j * 4 < length)
-				m_packages[i].prob[j][1] = _mm_set1_ps(baseprob * 2 * logScale);
+			m_packages[i].prob[j][0] = _mm_set1_ps(m_baseprob * m_logScale);
+			if(i * PACKAGE_SIZE + j * 4 < m_length)
+				m_packages[i].prob[j][1] = _mm_set1_ps(m_baseprob * 2 * m_logScale);
 			else
-				m_packages[i].prob[j][1] = _mm_set1_ps(baseprob * logScale);	// right / total = 1.0
+				m_packages[i].prob[j][1] = _mm_set1_ps(m_baseprob * m_logScale);	// right / total = 1.0
 		}
-		m_packageSizes[i] = std::min(length - i * PACKAGE_SIZE, PACKAGE_SIZE) * (TABLE_BIT_PRECISION << EXTRA_BITS);
+		m_packageSizes[i] = std::min(m_length - i * PACKAGE_SIZE, PACKAGE_SIZE) * (TABLE_BIT_PRECISION << EXTRA_BITS);
 	}
-	m_compressedSize = (long long)length << TABLE_BIT_PRECISION_BITS;
-
-	return true;
+	memset(m_weights, 0, sizeof(m_weights));
+	m_compressedSize = (long long)m_length << TABLE_BIT_PRECISION_BITS;
+	m_checkpointed = false;
 }
 
-long long CompressionStateEvaluator::ChangeWeight(int modelIndex, int diffw) {
-	concurrency::combinable<long long> diffsize;
+struct ChangeWeightArgs {
+	Package*				sumPackages;
+	unsigned int*			packageSizes;
+	const CompactPackage*	modelPackages;
+	const int*				packageOffsets;
+	float					diffw;			// Weight difference scaled by logScale
+	float					logScale;
+};
+
+// Estimated size of a package from the lane-wise products of its right and total probabilities.
+// Shared by all kernel variants so they produce bit-identical sizes.
+static __forceinline int PackageSize(__m128 vprod_right, __m128 vprod_total) {
+	__m128i vmantissa_mask = _mm_set1_epi32(0x7fffff);
+	__m128 vone = _mm_set1_ps(1.0f);
+#if defined(USE_POLY4)
+	// -0.08213064886366, 0.32118884789690, -0.67778393289462, 
+	__m128 vc0 = _mm_set1_ps(1.43872573386137f);
+	__m128 vc1 = _mm_set1_ps(-0.67778393289462f);
+	__m128 vc2 = _mm_set1_ps(0.32118884789690f);
+	__m128 vc3 = _mm_set1_ps(-0.08213064886366f);
+#elif defined(USE_POLY3)
+	__m128 vc0 = _mm_set1_ps(1.42286530448213f);
+	__m128 vc1 = _mm_set1_ps(-0.58208536795165f);
+	__m128 vc2 = _mm_set1_ps(0.15922006346951f);
+#endif
+	__m128 vbitprec_scale = _mm_set1_ps(TABLE_BIT_PRECISION << EXTRA_BITS);
 
-	int numPackages = m_models[modelIndex].numPackages;
-	const int PACKAGES_PER_JOB = 64;
-	int num_jobs = (numPackages + PACKAGES_PER_JOB - 1) / PACKAGES_PER_JOB;
+	__m128i viprod_right = _mm_castps_si128(vprod_right);
+	__m128i viprod_total = _mm_castps_si128(vprod_total);
+	__m128i viprod_right_exponent = _mm_srli_epi32(viprod_right, 23);
+	__m128i viprod_total_exponent = _mm_srli_epi32(viprod_total, 23);
+	__m128 vright_log = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(viprod_right, vmantissa_mask), _mm_castps_si128(vone)));
+	__m128 vtotal_log = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(viprod_total, vmantissa_mask), _mm_castps_si128(vone)));
 
-	concurrency::parallel_for(0, num_jobs, [&](int job)
-	{
-		int package_idx_base = job * PACKAGES_PER_JOB;
-		int* packageOffsets = m_models[modelIndex].packageOffsets;
-		
-		__m128 vlogScale = _mm_set1_ps(m_logScale);
-		__m128 vdiffw = _mm_set1_ps(diffw * m_logScale);
-		__m128i vzero = _mm_setzero_si128();
-		__m128i vmantissa_mask = _mm_set1_epi32(0x7fffff);
-		__m128i vffff0000 = _mm_set1_epi32(0xFFFF0000);
+#if defined(USE_POLY4)
+	// log2(x) approximation (a*(x-1)^2 + b*(x-1) + (1-a-b))*x
+	// Exact at the endpoints x=1 and x=2
+	vright_log = _mm_sub_ps(vright_log, vone);
+	vright_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc3, vright_log), vc2), vright_log), vc1), vright_log), vc0), vright_log);
 
-		__m128 vone = _mm_set1_ps(1.0f);
-		__m128 vhalf = _mm_set1_ps(0.5f);
+	vtotal_log = _mm_sub_ps(vtotal_log, vone);
+	vtotal_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc3, vtotal_log), vc2), vtotal_log), vc1), vtotal_log), vc0), vtotal_log);
 
-#if defined(USE_POLY4)
-		// -0.08213064886366, 0.32118884789690, -0.67778393289462, 
-		__m128 vc0 = _mm_set1_ps(1.43872573386137f);
-		__m128 vc1 = _mm_set1_ps(-0.67778393289462f);
-		__m128 vc2 = _mm_set1_ps(0.32118884789690f);
-		__m128 vc3 = _mm_set1_ps(-0.08213064886366f);
+	__m128i vifrac_bits = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(vtotal_log, vright_log), vbitprec_scale));
+	__m128i vnewsize = _mm_add_epi32(_mm_slli_epi32(_mm_sub_epi32(viprod_total_exponent, viprod_right_exponent), TABLE_BIT_PRECISION_BITS + EXTRA_BITS), vifrac_bits);
 #elif defined(USE_POLY3)
-		__m128 vc0 = _mm_set1_ps(1.42286530448213f);
-		__m128 vc1 = _mm_set1_ps(-0.58208536795165f);
-		__m128 vc2 = _mm_set1_ps(0.15922006346951f);
+	// log2(x) approximation (a*(x-1)^2 + b*(x-1) + (1-a-b))*x
+	// Exact at the endpoints x=1 and x=2
+	vright_log = _mm_sub_ps(vright_log, vone);
+	vright_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc2, vright_log), vc1), vright_log), vc0), vright_log);
+
+	vtotal_log = _mm_sub_ps(vtotal_log, vone);
+	vtotal_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc2, vtotal_log), vc1), vtotal_log), vc0), vtotal_log);
+
+	__m128i vifrac_bits = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(vtotal_log, vright_log), vbitprec_scale));
+	__m128i vnewsize = _mm_add_epi32(_mm_slli_epi32(_mm_sub_epi32(viprod_total_exponent, viprod_right_exponent), TABLE_BIT_PRECISION_BITS + EXTRA_BITS), vifrac_bits);
+#else
+	vright_log = _mm_mul_ps(vright_log, vright_log);	vright_log = _mm_mul_ps(vright_log, vright_log);	vright_log = _mm_mul_ps(vright_log, vright_log);	vright_log = _mm_mul_ps(vright_log, vright_log);
+	vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);	vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);	vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);	vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);
+	
+	__m128i vnewsize = _mm_sub_epi32(_mm_castps_si128(vtotal_log), _mm_castps_si128(vright_log));
+	vnewsize = _mm_srai_epi32(vnewsize, 23 - TABLE_BIT_PRECISION_BITS + 4);
+	vnewsize = _mm_add_epi32(vnewsize, _mm_slli_epi32(_mm_sub_epi32(viprod_total_exponent, viprod_right_exponent), TABLE_BIT_PRECISION_BITS));
 #endif
-		__m128 vbitprec_scale = _mm_set1_ps(TABLE_BIT_PRECISION << EXTRA_BITS);
 
+	vnewsize = _mm_add_epi32(vnewsize, _mm_shuffle_epi32(vnewsize, _MM_SHUFFLE(1, 0, 3, 2)));
+	vnewsize = _mm_add_epi32(vnewsize, _mm_shuffle_epi32(vnewsize, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(vnewsize);
+}
+
+static __forceinline int64_t StorePackageSize(const ChangeWeightArgs& args, int packageOffset, int newsize) {
+	int oldsize = args.packageSizes[packageOffset];
+	args.packageSizes[packageOffset] = newsize;
+	return newsize - oldsize;
+}
+
+// Expands the counters of 4 bits into the right and total probabilities: the counter of the
+// coded bit and the sum of both counters, boosted by 4 when one of the counters is zero.
+// The integers are small enough to convert exactly, so all kernels see the same floats.
+static __forceinline void ExpandCounters(const unsigned char* counters, __m128& right, __m128& total) {
+	__m128i vzero = _mm_setzero_si128();
+	__m128i vcounters = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)counters), vzero);
+	__m128i vbit = _mm_unpacklo_epi16(vcounters, vzero);
+	__m128i vother = _mm_unpackhi_epi16(vcounters, vzero);
+	__m128i vboost = _mm_or_si128(_mm_cmpeq_epi32(vbit, vzero), _mm_cmpeq_epi32(vother, vzero));
+	__m128i vsum = _mm_add_epi32(vbit, vother);
+	vbit = _mm_or_si128(_mm_andnot_si128(vboost, vbit), _mm_and_si128(vboost, _mm_slli_epi32(vbit, 2)));
+	vsum = _mm_or_si128(_mm_andnot_si128(vboost, vsum), _mm_and_si128(vboost, _mm_slli_epi32(vsum, 2)));
+	right = _mm_cvtepi32_ps(vbit);
+	total = _mm_cvtepi32_ps(vsum);
+}
+
+// 256-bit version of ExpandCounters: right in the low half, total in the high half.
+TARGET_AVX2 static __forceinline __m256 ExpandCountersAVX2(const unsigned char* counters) {
+	__m256i vcounters = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)counters));
+	__m256i vswapped = _mm256_permute2x128_si256(vcounters, vcounters, 0x01);
+	__m256i vzero = _mm256_setzero_si256();
+	__m256i vboost = _mm256_or_si256(_mm256_cmpeq_epi32(vcounters, vzero), _mm256_cmpeq_epi32(vswapped, vzero));
+	__m256i vexpanded = _mm256_blend_epi32(vcounters, _mm256_add_epi32(vcounters, vswapped), 0xF0);
+	vexpanded = _mm256_sllv_epi32(vexpanded, _mm256_and_si256(vboost, _mm256_set1_epi32(2)));
+	return _mm256_cvtepi32_ps(vexpanded);
+}
+
+// 512-bit version of ExpandCounters for two packages, each half laid out as in ExpandCountersAVX2.
+TARGET_AVX512 static __forceinline __m512 ExpandCountersAVX512(const unsigned char* counters0, const unsigned char* counters1) {
+	__m128i vpacked = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)counters0), _mm_loadl_epi64((const __m128i*)counters1));
+	__m512i vcounters = _mm512_cvtepu8_epi32(vpacked);
+	__m512i vswapped = _mm512_shuffle_i32x4(vcounters, vcounters, _MM_SHUFFLE(2, 3, 0, 1));
+	__m512i vzero = _mm512_setzero_si512();
+	__mmask16 boost = _mm512_cmpeq_epi32_mask(vcounters, vzero) | _mm512_cmpeq_epi32_mask(vswapped, vzero);
+	__m512i vexpanded = _mm512_mask_add_epi32(vcounters, 0xF0F0, vcounters, vswapped);
+	vexpanded = _mm512_mask_slli_epi32(vexpanded, boost, vexpanded, 2);
+	return _mm512_cvtepi32_ps(vexpanded);
+}
+
+// 128-bit kernel: right and total of 4 bits per vector
+static int64_t ChangeWeightSSE(const ChangeWeightArgs& args, int begin, int end) {
+	__m128 vdiffw = _mm_set1_ps(args.diffw);
+	__m128 vone = _mm_set1_ps(1.0f);
+
+	int64_t diffsize = 0;
+	for(int package_idx = begin; package_idx < end; package_idx++)
+	{
+		int packageOffset = args.packageOffsets[package_idx];
+		
+		Package* sum_package = &args.sumPackages[packageOffset];
+		const CompactPackage* model_package = &args.modelPackages[package_idx];
 		
-		Package* sum_packages = m_packages;
-		CompactPackage* model_packages = m_models[modelIndex].packages;
-		unsigned int* packageSizes = m_packageSizes;
+		__m128 vprod_right = vone;
+		__m128 vprod_total  = vone;
+		__m128 vsum_p_right, vsum_p_total;
+		__m128 vp_right, vp_total;
 
-		int64_t diffsize2 = 0;
-		for(int i = 0; i < PACKAGES_PER_JOB && package_idx_base + i < numPackages; i++)
-		{
-			int package_idx = package_idx_base + i;
-			
-			int packageOffset = packageOffsets[package_idx];
-			
-			Package* sum_package = &sum_packages[packageOffset];
-			CompactPackage* model_package = &model_packages[package_idx];
-			
-			__m128 vprod_right = vone;
-			__m128 vprod_total  = vone;
-			__m128 vsum_p_right, vsum_p_total;
-			__m128i packed;
+#define DO(_IDX) \
+		vsum_p_right = sum_package->prob[_IDX][0]; \
+		vsum_p_total = sum_package->prob[_IDX][1]; \
+		ExpandCounters(model_package->counters[_IDX], vp_right, vp_total); \
+		vsum_p_right = _mm_add_ps(vsum_p_right, _mm_mul_ps(vp_right, vdiffw)); \
+		vsum_p_total = _mm_add_ps(vsum_p_total, _mm_mul_ps(vp_total, vdiffw)); \
+		assert(_mm_movemask_ps(_mm_cmplt_ps(vsum_p_total, _mm_set1_ps(16777216 * args.logScale))) == 0xF); \
+		sum_package->prob[_IDX][0] = vsum_p_right; \
+		sum_package->prob[_IDX][1] = vsum_p_total; \
+		vprod_right = _mm_mul_ps(vprod_right, vsum_p_right); \
+		vprod_total = _mm_mul_ps(vprod_total, vsum_p_total);
+
+		DO(0) DO(1) DO(2) DO(3);
+		DO(4) DO(5) DO(6) DO(7);
+		DO(8) DO(9) DO(10) DO(11);
+		DO(12) DO(13) DO(14) DO(15);
+#undef DO
+
+		diffsize += StorePackageSize(args, packageOffset, PackageSize(vprod_right, vprod_total));
+	}
+	return diffsize;
+}
+
+// 256-bit kernel: right and total of the same 4 bits share a vector, so every lane
+// performs exactly the same operations in the same order as in the 128-bit kernel.
+TARGET_AVX2 static int64_t ChangeWeightAVX2(const ChangeWeightArgs& args, int begin, int end) {
+	__m256 vdiffw = _mm256_set1_ps(args.diffw);
+	__m256 vone = _mm256_set1_ps(1.0f);
+
+	int64_t diffsize = 0;
+	for(int package_idx = begin; package_idx < end; package_idx++)
+	{
+		int packageOffset = args.packageOffsets[package_idx];
 
+		float* sum_package = (float*)&args.sumPackages[packageOffset];
+		const CompactPackage* model_package = &args.modelPackages[package_idx];
+
+		__m256 vprod = vone;
+		__m256 vsum;
 
 #define DO(_IDX) \
-			vsum_p_right = sum_package->prob[_IDX][0]; \
-			vsum_p_total = sum_package->prob[_IDX][1]; \
-			packed = model_package->prob[_IDX]; \
-			vsum_p_right = _mm_add_ps(vsum_p_right, _mm_mul_ps(_mm_castsi128_ps(_mm_unpacklo_epi16(vzero, packed)), vdiffw)); \
-			vsum_p_total = _mm_add_ps(vsum_p_total, _mm_mul_ps(_mm_castsi128_ps(_mm_unpackhi_epi16(vzero, packed)), vdiffw)); \
-			assert(vsum_p_total.m128_f32[0] < 16777216 * m_logScale); \
-			assert(vsum_p_total.m128_f32[1] < 16777216 * m_logScale); \
-			assert(vsum_p_total.m128_f32[2] < 16777216 * m_logScale); \
-			assert(vsum_p_total.m128_f32[3] < 16777216 * m_logScale); \
-			sum_package->prob[_IDX][0] = vsum_p_right; \
-			sum_package->prob[_IDX][1] = vsum_p_total; \
-			vprod_right = _mm_mul_ps(vprod_right, vsum_p_right); \
-			vprod_total = _mm_mul_ps(vprod_total, vsum_p_total);
-	
-			DO(0) DO(1) DO(2) DO(3);
-			DO(4) DO(5) DO(6) DO(7);
-			DO(8) DO(9) DO(10) DO(11);
-			DO(12) DO(13) DO(14) DO(15);
+		vsum = _mm256_load_ps(sum_package + _IDX * 8); \
+		vsum = _mm256_add_ps(vsum, _mm256_mul_ps(ExpandCountersAVX2(model_package->counters[_IDX]), vdiffw)); \
+		assert((_mm256_movemask_ps(_mm256_cmp_ps(vsum, _mm256_set1_ps(16777216 * args.logScale), _CMP_LT_OQ)) & 0xF0) == 0xF0); \
+		_mm256_store_ps(sum_package + _IDX * 8, vsum); \
+		vprod = _mm256_mul_ps(vprod, vsum);
+
+		DO(0) DO(1) DO(2) DO(3);
+		DO(4) DO(5) DO(6) DO(7);
+		DO(8) DO(9) DO(10) DO(11);
+		DO(12) DO(13) DO(14) DO(15);
 #undef DO
 
-			__m128i viprod_right = _mm_castps_si128(vprod_right);
-			__m128i viprod_total = _mm_castps_si128(vprod_total);
-			__m128i viprod_right_exponent = _mm_srli_epi32(viprod_right, 23);
-			__m128i viprod_total_exponent = _mm_srli_epi32(viprod_total, 23);
-			__m128 vright_log = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(viprod_right, vmantissa_mask), _mm_castps_si128(vone)));
-			__m128 vtotal_log = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(viprod_total, vmantissa_mask), _mm_castps_si128(vone)));
+		diffsize += StorePackageSize(args, packageOffset, PackageSize(_mm256_castps256_ps128(vprod), _mm256_extractf128_ps(vprod, 1)));
+	}
+	return diffsize;
+}
 
+// 512-bit kernel: two packages side by side, each half laid out as in the 256-bit kernel.
+TARGET_AVX512 static int64_t ChangeWeightAVX512(const ChangeWeightArgs& args, int begin, int end) {
+	__m512 vdiffw = _mm512_set1_ps(args.diffw);
+	__m512 vone = _mm512_set1_ps(1.0f);
 
-			
-#if defined(USE_POLY4)
-			// log2(x) approximation (a*(x-1)^2 + b*(x-1) + (1-a-b))*x
-			// Exact at the endpoints x=1 and x=2
-			vright_log = _mm_sub_ps(vright_log, vone);
-			vright_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc3, vright_log), vc2), vright_log), vc1), vright_log), vc0), vright_log);
+	int64_t diffsize = 0;
+	int package_idx = begin;
+	for(; package_idx + 1 < end; package_idx += 2)
+	{
+		int packageOffset0 = args.packageOffsets[package_idx];
+		int packageOffset1 = args.packageOffsets[package_idx + 1];
 
-			vtotal_log = _mm_sub_ps(vtotal_log, vone);
-			vtotal_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc3, vtotal_log), vc2), vtotal_log), vc1), vtotal_log), vc0), vtotal_log);
+		float* sum_package0 = (float*)&args.sumPackages[packageOffset0];
+		float* sum_package1 = (float*)&args.sumPackages[packageOffset1];
+		const CompactPackage* model_package0 = &args.modelPackages[package_idx];
+		const CompactPackage* model_package1 = &args.modelPackages[package_idx + 1];
 
-			__m128i vifrac_bits = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(vtotal_log, vright_log), vbitprec_scale));
-			__m128i vnewsize = _mm_add_epi32(_mm_slli_epi32(_mm_sub_epi32(viprod_total_exponent, viprod_right_exponent), TABLE_BIT_PRECISION_BITS + EXTRA_BITS), vifrac_bits);
-#elif defined(USE_POLY3)
-			// log2(x) approximation (a*(x-1)^2 + b*(x-1) + (1-a-b))*x
-			// Exact at the endpoints x=1 and x=2
-			vright_log = _mm_sub_ps(vright_log, vone);
-			vright_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc2, vright_log), vc1), vright_log), vc0), vright_log);
+		__m512 vprod = vone;
+		__m512 vsum;
 
-			vtotal_log = _mm_sub_ps(vtotal_log, vone);
-			vtotal_log = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(vc2, vtotal_log), vc1), vtotal_log), vc0), vtotal_log);
+#define DO(_IDX) \
+		vsum = _mm512_castpd_ps(_mm512_insertf64x4(_mm512_castps_pd(_mm512_castps256_ps512(_mm256_load_ps(sum_package0 + _IDX * 8))), _mm256_castps_pd(_mm256_load_ps(sum_package1 + _IDX * 8)), 1)); \
+		vsum = _mm512_add_ps(vsum, _mm512_mul_ps(ExpandCountersAVX512(model_package0->counters[_IDX], model_package1->counters[_IDX]), vdiffw)); \
+		assert((_mm512_cmp_ps_mask(vsum, _mm512_set1_ps(16777216 * args.logScale), _CMP_LT_OQ) & 0xF0F0) == 0xF0F0); \
+		_mm256_store_ps(sum_package0 + _IDX * 8, _mm512_castps512_ps256(vsum)); \
+		_mm256_store_ps(sum_package1 + _IDX * 8, _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(vsum), 1))); \
+		vprod = _mm512_mul_ps(vprod, vsum);
+
+		DO(0) DO(1) DO(2) DO(3);
+		DO(4) DO(5) DO(6) DO(7);
+		DO(8) DO(9) DO(10) DO(11);
+		DO(12) DO(13) DO(14) DO(15);
+#undef DO
 
-			__m128i vifrac_bits = _mm_cvtps_epi32(_mm_mul_ps(_mm_sub_ps(vtotal_log, vright_log), vbitprec_scale));
-			__m128i vnewsize = _mm_add_epi32(_mm_slli_epi32(_mm_sub_epi32(viprod_total_exponent, viprod_right_exponent), TABLE_BIT_PRECISION_BITS + EXTRA_BITS), vifrac_bits);
-#else
-			vright_log = _mm_mul_ps(vright_log, vright_log);	vright_log = _mm_mul_ps(vright_log, vright_log);	vright_log = _mm_mul_ps(vright_log, vright_log);	vright_log = _mm_mul_ps(vright_log, vright_log);
-			vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);	vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);	vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);	vtotal_log = _mm_mul_ps(vtotal_log, vtotal_log);
-			
-			__m128i vnewsize = _mm_sub_epi32(_mm_castps_si128(vtotal_log), _mm_castps_si128(vright_log));
-			vnewsize = _mm_srai_epi32(vnewsize, 23 - TABLE_BIT_PRECISION_BITS + 4);
-			vnewsize = _mm_add_epi32(vnewsize, _mm_slli_epi32(_mm_sub_epi32(viprod_total_exponent, viprod_right_exponent), TABLE_BIT_PRECISION_BITS));
-#endif
+		__m256 vprod0 = _mm512_castps512_ps256(vprod);
+		__m256 vprod1 = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(vprod), 1));
+		diffsize += StorePackageSize(args, packageOffset0, PackageSize(_mm256_castps256_ps128(vprod0), _mm256_extractf128_ps(vprod0, 1)));
+		diffsize += StorePackageSize(args, packageOffset1, PackageSize(_mm256_castps256_ps128(vprod1), _mm256_extractf128_ps(vprod1, 1)));
+	}
 
-			vnewsize = _mm_add_epi32(vnewsize, _mm_shuffle_epi32(vnewsize, _MM_SHUFFLE(1, 0, 3, 2)));
-			vnewsize = _mm_add_epi32(vnewsize, _mm_shuffle_epi32(vnewsize, _MM_SHUFFLE(2, 3, 0, 1)));
-			int newsize = _mm_cvtsi128_si32(vnewsize);
+	if(package_idx < end)
+		diffsize += ChangeWeightAVX2(args, package_idx, end);
+	return diffsize;
+}
 
+struct ModelDelta {
+	const CompactPackage*	packages;
+	const int*				packageOffsets;
+	int						numPackages;
+	float					diffw;			// Weight difference scaled by logScale
+};
+
+struct ChangeWeightsArgs {
+	Package*				sumPackages;
+	unsigned int*			packageSizes;
+	const ModelDelta*		models;			// In increasing model index order
+	int						numModels;
+	float					logScale;
+};
+
+// Position of a job in the packages of every changed model. The package offsets of all
+// changed models are visited as one merged, increasing sequence.
+struct MergeCursor {
+	int						cursors[MAX_MODELS];
+	const CompactPackage*	modelPackages[MAX_MODELS];	// Packages touching the current offset, in model order
+	float					diffws[MAX_MODELS];
+	int						numTouching;
+};
+
+static void InitMergeCursor(const ChangeWeightsArgs& args, int offsetBegin, MergeCursor& cursor) {
+	for(int m = 0; m < args.numModels; m++) {
+		const ModelDelta& model = args.models[m];
+		cursor.cursors[m] = int(std::lower_bound(model.packageOffsets, model.packageOffsets + model.numPackages, offsetBegin) - model.packageOffsets);
+	}
+}
+
+// Returns the next package offset below offsetEnd touched by any changed model, or -1 when done.
+static __forceinline int NextMergedPackage(const ChangeWeightsArgs& args, int offsetEnd, MergeCursor& cursor) {
+	int packageOffset = offsetEnd;
+	for(int m = 0; m < args.numModels; m++) {
+		const ModelDelta& model = args.models[m];
+		if(cursor.cursors[m] < model.numPackages)
+			packageOffset = std::min(packageOffset, model.packageOffsets[cursor.cursors[m]]);
+	}
+	if(packageOffset >= offsetEnd)
+		return -1;
+
+	cursor.numTouching = 0;
+	for(int m = 0; m < args.numModels; m++) {
+		const ModelDelta& model = args.models[m];
+		int c = cursor.cursors[m];
+		if(c < model.numPackages && model.packageOffsets[c] == packageOffset) {
+			cursor.modelPackages[cursor.numTouching] = &model.packages[c];
+			cursor.diffws[cursor.numTouching] = model.diffw;
+			cursor.numTouching++;
+			cursor.cursors[m] = c + 1;
+		}
+	}
+	return packageOffset;
+}
+
+// Applies the weight changes of several models to each package in one pass. The additions are
+// done in the same order as successive ChangeWeight calls would, so the resulting sums are identical.
+static int64_t ChangeWeightsSSE(const ChangeWeightsArgs& args, int offsetBegin, int offsetEnd) {
+	MergeCursor cursor;
+	InitMergeCursor(args, offsetBegin, cursor);
+
+	int64_t diffsize = 0;
+	int packageOffset;
+	while((packageOffset = NextMergedPackage(args, offsetEnd, cursor)) >= 0) {
+		Package* sum_package = &args.sumPackages[packageOffset];
+		__m128 vprod_right = _mm_set1_ps(1.0f);
+		__m128 vprod_total = _mm_set1_ps(1.0f);
+		for(int j = 0; j < NUM_PACKAGE_VECTORS; j++) {
+			__m128 vsum_p_right = sum_package->prob[j][0];
+			__m128 vsum_p_total = sum_package->prob[j][1];
+			for(int m = 0; m < cursor.numTouching; m++) {
+				__m128 vdiffw = _mm_set1_ps(cursor.diffws[m]);
+				__m128 vp_right, vp_total;
+				ExpandCounters(cursor.modelPackages[m]->counters[j], vp_right, vp_total);
+				vsum_p_right = _mm_add_ps(vsum_p_right, _mm_mul_ps(vp_right, vdiffw));
+				vsum_p_total = _mm_add_ps(vsum_p_total, _mm_mul_ps(vp_total, vdiffw));
+			}
+			assert(_mm_movemask_ps(_mm_cmplt_ps(vsum_p_total, _mm_set1_ps(16777216 * args.logScale))) == 0xF);
+			sum_package->prob[j][0] = vsum_p_right;
+			sum_package->prob[j][1] = vsum_p_total;
+			vprod_right = _mm_mul_ps(vprod_right, vsum_p_right);
+			vprod_total = _mm_mul_ps(vprod_total, vsum_p_total);
+		}
+
+		int newsize = PackageSize(vprod_right, vprod_total);
+		diffsize += newsize - (int)args.packageSizes[packageOffset];
+		args.packageSizes[packageOffset] = newsize;
+	}
+	return diffsize;
+}
+
+// 256-bit version of ChangeWeightsSSE. Also used for AVX-512, as the merged packages are visited one at a time.
+TARGET_AVX2 static int64_t ChangeWeightsAVX2(const ChangeWeightsArgs& args, int offsetBegin, int offsetEnd) {
+	MergeCursor cursor;
+	InitMergeCursor(args, offsetBegin, cursor);
+
+	int64_t diffsize = 0;
+	int packageOffset;
+	while((packageOffset = NextMergedPackage(args, offsetEnd, cursor)) >= 0) {
+		float* sum_package = (float*)&args.sumPackages[packageOffset];
+		__m256 vprod = _mm256_set1_ps(1.0f);
+		for(int j = 0; j < NUM_PACKAGE_VECTORS; j++) {
+			__m256 vsum = _mm256_load_ps(sum_package + j * 8);
+			for(int m = 0; m < cursor.numTouching; m++) {
+				vsum = _mm256_add_ps(vsum, _mm256_mul_ps(ExpandCountersAVX2(cursor.modelPackages[m]->counters[j]), _mm256_set1_ps(cursor.diffws[m])));
+			}
+			_mm256_store_ps(sum_package + j * 8, vsum);
+			vprod = _mm256_mul_ps(vprod, vsum);
+		}
+
+		int newsize = PackageSize(_mm256_castps256_ps128(vprod), _mm256_extractf128_ps(vprod, 1));
+		diffsize += newsize - (int)args.packageSizes[packageOffset];
+		args.packageSizes[packageOffset] = newsize;
+	}
+	return diffsize;
+}
+
+long long CompressionStateEvaluator::ChangeWeight(int modelIndex, int diffw) {
+	int numPackages = m_models[modelIndex].numPackages;
+	int num_jobs = (numPackages + PACKAGES_PER_JOB - 1) / PACKAGES_PER_JOB;
+	std::vector<long long> diffsizes(num_jobs);
+
+	ChangeWeightArgs args;
+	args.sumPackages = m_packages;
+	args.packageSizes = m_packageSizes;
+	args.modelPackages = m_models[modelIndex].packages;
+	args.packageOffsets = m_models[modelIndex].packageOffsets;
+	args.diffw = diffw * m_logScale;
+	args.logScale = m_logScale;
+
+	InstructionSet instructionSet = m_instructionSet;
+	ParallelFor(0, num_jobs, [&](int job)
+	{
+		int begin = job * PACKAGES_PER_JOB;
+		int end = std::min(begin + PACKAGES_PER_JOB, numPackages);
+
+		if(m_checkpointed) {
+			for(int i = begin; i < end; i++)
+				SavePackage(args.packageOffsets[i]);
+		}
+
+		int64_t diffsize2;
+		switch(instructionSet) {
+			case INSTRUCTION_SET_AVX512:
+				diffsize2 = ChangeWeightAVX512(args, begin, end);
+				break;
+			case INSTRUCTION_SET_AVX2:
+				diffsize2 = ChangeWeightAVX2(args, begin, end);
+				break;
+			default:
+				diffsize2 = ChangeWeightSSE(args, begin, end);
+				break;
+		}
+		diffsizes[job] = diffsize2 / (1 << EXTRA_BITS);
+	});
+
+	long long diffsize = 0;
+	for(long long d : diffsizes)
+		diffsize += d;
+	return diffsize;
+}
+
+long long CompressionStateEvaluator::ChangeWeights(const int* modelIndices, const int* diffws, int numModels) {
+	ModelDelta models[MAX_MODELS];
+	for(int m = 0; m < numModels; m++) {
+		const ModelPredictions& mp = m_models[modelIndices[m]];
+		models[m].packages = mp.packages;
+		models[m].packageOffsets = mp.packageOffsets;
+		models[m].numPackages = mp.numPackages;
+		models[m].diffw = diffws[m] * m_logScale;
+	}
+
+	ChangeWeightsArgs args;
+	args.sumPackages = m_packages;
+	args.packageSizes = m_packageSizes;
+	args.models = models;
+	args.numModels = numModels;
+	args.logScale = m_logScale;
 
-			int oldsize = packageSizes[packageOffset];
-			packageSizes[packageOffset] = newsize;
-			diffsize2 += newsize - oldsize;
+	// Jobs cover fixed ranges of package offsets, as the merged package list is not known up front
+	int num_jobs = (m_numPackages + PACKAGES_PER_JOB - 1) / PACKAGES_PER_JOB;
+	std::vector<long long> diffsizes(num_jobs);
+
+	InstructionSet instructionSet = m_instructionSet;
+	ParallelFor(0, num_jobs, [&](int job)
+	{
+		int offsetBegin = job * PACKAGES_PER_JOB;
+		int offsetEnd = std::min(offsetBegin + PACKAGES_PER_JOB, m_numPackages);
+
+		if(m_checkpointed) {
+			for(int m = 0; m < numModels; m++) {
+				const ModelDelta& model = models[m];
+				for(int i = int(std::lower_bound(model.packageOffsets, model.packageOffsets + model.numPackages, offsetBegin) - model.packageOffsets);
+					i < model.numPackages && model.packageOffsets[i] < offsetEnd; i++)
+					SavePackage(model.packageOffsets[i]);
+			}
 		}
 
-		diffsize.local() += diffsize2 / (1 << EXTRA_BITS);
+		int64_t diffsize2;
+		if(instructionSet >= INSTRUCTION_SET_AVX2)
+			diffsize2 = ChangeWeightsAVX2(args, offsetBegin, offsetEnd);
+		else
+			diffsize2 = ChangeWeightsSSE(args, offsetBegin, offsetEnd);
+		diffsizes[job] = diffsize2 / (1 << EXTRA_BITS);
 	});
 
-	return diffsize.combine(std::plus<long long>());
+	long long diffsize = 0;
+	for(long long d : diffsizes)
+		diffsize += d;
+	return diffsize;
 }
 
 long long CompressionStateEvaluator::Evaluate(const ModelList4k& ml) {
@@ -188,17 +549,105 @@ long long CompressionStateEvaluator::Evaluate(const ModelList4k& ml) {
 		newWeights[ml[i].mask] = 1<<ml[i].weight;
 	}
 
+	int changedModels[MAX_MODELS];
+	int diffws[MAX_MODELS];
+	int numChanged = 0;
 	for(int i = 0; i < MAX_MODELS; i++) {
 		if(newWeights[i] != m_weights[i]) {
-			long long diffsize = ChangeWeight(i, newWeights[i] - m_weights[i]);
+			changedModels[numChanged] = i;
+			m_touchedModels[i] = true;
+			diffws[numChanged] = newWeights[i] - m_weights[i];
+			numChanged++;
 			if(m_weights[i] == 0)
 				m_compressedSize += 8 * TABLE_BIT_PRECISION;
 			else if(newWeights[i] == 0)
 				m_compressedSize -= 8 * TABLE_BIT_PRECISION;
 			m_weights[i] = newWeights[i];
-			m_compressedSize += diffsize;
 		}
-	
 	}
+
+	// Several changed models are applied in a single pass over their packages
+	if(numChanged == 1)
+		m_compressedSize += ChangeWeight(changedModels[0], diffws[0]);
+	else if(numChanged > 1)
+		m_compressedSize += ChangeWeights(changedModels, diffws, numChanged);
+
 	return m_compressedSize;	// Compressed size including model cost
 }
+
+void CompressionStateEvaluator::SavePackage(int packageOffset) {
+	if(m_savedEpochs[packageOffset] != m_epoch) {
+		m_savedEpochs[packageOffset] = m_epoch;
+		m_savedPackages[packageOffset] = m_packages[packageOffset];
+		m_savedPackageSizes[packageOffset] = m_packageSizes[packageOffset];
+	}
+}
+
+void CompressionStateEvaluator::NextEpoch() {
+	// Starting a new epoch invalidates all saved packages at once
+	if(++m_epoch == 0) {
+		memset(m_savedEpochs, 0, m_numPackages * sizeof(unsigned int));
+		m_epoch = 1;
+	}
+	memset(m_touchedModels, 0, sizeof(m_touchedModels));
+	memcpy(m_savedWeights, m_weights, sizeof(m_weights));
+	m_savedCompressedSize = m_compressedSize;
+}
+
+void CompressionStateEvaluator::Checkpoint() {
+	if(m_savedPackages == NULL) {
+		m_savedPackages = (Package*)_aligned_malloc(m_numPackages * sizeof(Package), 64);
+		m_savedPackageSizes = new unsigned int[m_numPackages];
+		m_savedEpochs = new unsigned int[m_numPackages];
+		memset(m_savedEpochs, 0, m_numPackages * sizeof(unsigned int));
+	}
+	m_checkpointed = true;
+	NextEpoch();
+}
+
+void CompressionStateEvaluator::Rollback() {
+	assert(m_checkpointed);
+
+	// Only packages of models changed since the checkpoint can have been saved
+	int touchedModels[MAX_MODELS];
+	int numTouched = 0;
+	for(int i = 0; i < MAX_MODELS; i++) {
+		if(m_touchedModels[i])
+			touchedModels[numTouched++] = i;
+	}
+
+	int num_jobs = (m_numPackages + PACKAGES_PER_JOB - 1) / PACKAGES_PER_JOB;
+	ParallelFor(0, numTouched > 0 ? num_jobs : 0, [&](int job)
+	{
+		int offsetBegin = job * PACKAGES_PER_JOB;
+		int offsetEnd = std::min(offsetBegin + PACKAGES_PER_JOB, m_numPackages);
+		for(int m = 0; m < numTouched; m++) {
+			const ModelPredictions& model = m_models[touchedModels[m]];
+			for(int i = int(std::lower_bound(model.packageOffsets, model.packageOffsets + model.numPackages, offsetBegin) - model.packageOffsets);
+				i < model.numPackages && model.packageOffsets[i] < offsetEnd; i++) {
+				int packageOffset = model.packageOffsets[i];
+				if(m_savedEpochs[packageOffset] == m_epoch) {
+					m_packages[packageOffset] = m_savedPackages[packageOffset];
+					m_packageSizes[packageOffset] = m_savedPackageSizes[packageOffset];
+				}
+			}
+		}
+	});
+
+	memcpy(m_weights, m_savedWeights, sizeof(m_weights));
+	m_compressedSize = m_savedCompressedSize;
+	NextEpoch();
+}
+
+void CompressionStateEvaluator::Commit() {
+	m_checkpointed = false;
+}
+
+void CompressionStateEvaluator::CopyState(const CompressionStateEvaluator& source) {
+	assert(source.m_numPackages == m_numPackages);
+	memcpy(m_packages, source.m_packages, m_numPackages * sizeof(Package));
+	memcpy(m_packageSizes, source.m_packageSizes, m_numPackages * sizeof(unsigned int));
+	memcpy(m_weights, source.m_weights, sizeof(m_weights));
+	m_compressedSize = source.m_compressedSize;
+	m_checkpointed = false;		// The journal does not apply to the copied state
+}
@@ -21,9 +21,11 @@ struct Weights {
 	unsigned int pos;
 };
 
+// Model counters of the bits of a package: per 4 bits, the counters of the coded bit
+// followed by the counters of the other bit. Expanded to right and total when applied.
 struct CompactPackage
 {
-	__m128i prob[NUM_PACKAGE_VECTORS];	// 0..63: right, 64..127: total
+	unsigned char counters[NUM_PACKAGE_VECTORS][8];
 };
 
 struct Package
@@ -31,6 +33,8 @@ struct Package
 	__m128 prob[NUM_PACKAGE_VECTORS][2];	// right, total
 };
 
+enum InstructionSet {INSTRUCTION_SET_AUTO, INSTRUCTION_SET_SSE, INSTRUCTION_SET_AVX2, INSTRUCTION_SET_AVX512};
+
 struct ModelPredictions {
 	int numPackages;
 	CompactPackage* packages;
@@ -49,14 +53,39 @@ class CompressionStateEvaluator {
 	long long			m_compressedSize;
 	int					m_baseprob;
 	float				m_logScale;
+	InstructionSet		m_instructionSet;
+
+	// Checkpoint journal: packages are copied the first time they change after a checkpoint
+	bool				m_checkpointed;
+	unsigned int		m_epoch;
+	unsigned int*		m_savedEpochs;		// Epoch in which each package was last saved
+	Package*			m_savedPackages;
+	unsigned int*		m_savedPackageSizes;
+	int					m_savedWeights[256];
+	long long			m_savedCompressedSize;
+	bool				m_touchedModels[256];
 
+	void				SavePackage(int packageOffset);
+	void				NextEpoch();
 	long long			ChangeWeight(int modelIndex, int diffw);
+	long long			ChangeWeights(const int* modelIndices, const int* diffws, int numModels);
 public:
-	CompressionStateEvaluator();
+	CompressionStateEvaluator(InstructionSet instructionSet = INSTRUCTION_SET_AUTO);
 	~CompressionStateEvaluator();
 
+	InstructionSet	GetInstructionSet() const	{ return m_instructionSet; }
+	long long		GetCompressedSize() const	{ return m_compressedSize; }
+	int				GetWeight(int mask) const	{ return m_weights[mask]; }
+
 	bool		Init(ModelPredictions* models, int length, int baseprob, float logScale);
 	long long	Evaluate(const ModelList4k& models);
+	void		Reset();	// Back to the state without any models
+	void		CopyState(const CompressionStateEvaluator& source);
+
+	// Rejected evaluations can be undone by restoring only the packages changed since the checkpoint
+	void		Checkpoint();
+	void		Rollback();
+	void		Commit();
 };
 
 #endif
@@ -2,10 +2,11 @@
 #include "Compressor.h"
 #include <memory>
 #include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 #include <vector>
 #include <xmmintrin.h>
-#include <intrin.h>
-#include <ppl.h>
 
 #include "Model.h"
 #include "AritCode.h"
@@ -14,9 +15,13 @@
 using namespace std;
 
 const int MAX_N_MODELS = 32;
+const int PROBE_PREFETCH_DISTANCE = 16;	// Contexts ahead whose probe is prefetched
 
-struct Weights;
-void UpdateWeights(Weights *w, int bit, bool saturate);
+// As UpdateWeights
+static inline void UpdateCounters(TinyHashEntry* he, int bit, bool saturate) {
+	if (!saturate || he->prob[bit] < 255) he->prob[bit] += 1;
+	if (he->prob[!bit] > 1) he->prob[!bit] >>= 1;
+}
 
 static int NextPowerOf2(int v) {
 	v--;
@@ -28,15 +33,99 @@ static int NextPowerOf2(int v) {
 	return v+1;
 }
 
+// Distinct context hashes, numbered in order of first use, with their indices packed as they come.
+// The indices are as wide as the number of distinct hashes so far needs, and the ones already
+// packed are widened when a new hash needs another bit. The packed buffer is reserved for the
+// widest indices the number of contexts allows, so it is never copied while growing.
+class ContextPacker {
+	HashBits&				m_out;
+	vector<unsigned int>	m_slots;	// Open addressing table of indices into contextHashes, plus 1
+	int						m_slotBits;
+	uint64_t				m_count;
+
+	static void Store(unsigned char* packed, uint64_t i, int bits, unsigned int value) {
+		uint64_t bitpos = i * bits;
+		uint64_t mask = ((1ull << bits) - 1) << (bitpos & 7);
+		uint64_t word;
+		memcpy(&word, &packed[bitpos >> 3], sizeof(word));
+		word = (word & ~mask) | ((uint64_t)value << (bitpos & 7));
+		memcpy(&packed[bitpos >> 3], &word, sizeof(word));
+	}
+
+	unsigned int& FindSlot(unsigned int hash) {
+		unsigned int slotMask = (1u << m_slotBits) - 1;
+		unsigned int s = (hash * 0x9E3779B1u) >> (32 - m_slotBits);
+		while (m_slots[s] != 0 && m_out.contextHashes[m_slots[s] - 1] != hash)
+			s = (s + 1) & slotMask;
+		return m_slots[s];
+	}
+
+	void GrowSlots() {
+		m_slotBits++;
+		m_slots.assign((size_t)1 << m_slotBits, 0);
+		for (unsigned int c = 0; c < (unsigned int)m_out.contextHashes.size(); c++)
+			FindSlot(m_out.contextHashes[c]) = c + 1;
+	}
+
+	void Reach(uint64_t count, int bits) {
+		size_t size = (size_t)((count * bits + 7) / 8 + sizeof(uint64_t));
+		if (size > m_out.contexts.size())
+			m_out.contexts.resize(min(max(size, m_out.contexts.size() * 3 / 2), m_out.contexts.capacity()));
+	}
+
+	void Widen() {
+		int bits = m_out.contextBits;
+		Reach(m_count, bits + 1);
+		// From the end, so no index is overwritten before it has been moved
+		for (uint64_t i = m_count; i-- > 0;)
+			Store(m_out.contexts.data(), i, bits + 1, m_out.GetContext((int)i));
+		m_out.contextBits = bits + 1;
+	}
+
+public:
+	ContextPacker(HashBits& out, int length) : m_out(out), m_slotBits(10), m_count(0) {
+		int maxBits = 0;
+		while ((1ull << maxBits) < (uint64_t)length)
+			maxBits++;
+		m_out.contextBits = 0;
+		m_out.contexts.reserve(((uint64_t)length * maxBits + 7) / 8 + sizeof(uint64_t));
+		m_out.contexts.assign(sizeof(uint64_t), 0);
+		m_slots.assign((size_t)1 << m_slotBits, 0);
+	}
+
+	void Add(unsigned int hash) {
+		unsigned int& slot = FindSlot(hash);
+		unsigned int index;
+		if (slot != 0) {
+			index = slot - 1;
+		} else {
+			index = (unsigned int)m_out.contextHashes.size();
+			m_out.contextHashes.push_back(hash);
+			slot = index + 1;
+			if (m_out.contextHashes.size() * 2 > m_slots.size())
+				GrowSlots();
+			if ((1ull << m_out.contextBits) < m_out.contextHashes.size())
+				Widen();
+		}
+
+		Reach(m_count + 1, m_out.contextBits);
+		Store(m_out.contexts.data(), m_count++, m_out.contextBits, index);
+	}
+
+	void Finish() {
+		m_out.contexts.resize((m_count * m_out.contextBits + 7) / 8 + sizeof(uint64_t));
+	}
+};
+
 HashBits ComputeHashBits(const unsigned char* d, int size, unsigned char* context, const ModelList4k& models, bool first, bool finish) {
 	int bitlength = first + size * 8;
 	int length = bitlength * models.nmodels;
 	HashBits out;
-	out.hashes.reserve(length);
+	out.length = length;
 	out.bits.reserve(bitlength);
 	out.weights.resize(models.nmodels);
 
-	out.tinyhashsize = NextPowerOf2(length);
+	ContextPacker packer(out, length);
 
 	unsigned char* databuf = new unsigned char[size + MAX_CONTEXT_LENGTH];
 	unsigned char* data = databuf + MAX_CONTEXT_LENGTH;
@@ -65,7 +154,7 @@ HashBits ComputeHashBits(const unsigned char* d, int size, unsigned char* contex
 		// Query models
 		for (int m = 0; m < nmodels; m++) {
 			unsigned int hash = ModelHashStart(weightmasks[m], HASH_MULTIPLIER);
-			out.hashes.push_back(hash);
+			packer.Add(hash);
 		}
 		out.bits.push_back(bit);
 	}
@@ -76,7 +165,7 @@ HashBits ComputeHashBits(const unsigned char* d, int size, unsigned char* contex
 		// Query models
 		for (int m = 0; m < nmodels; m++) {
 			unsigned int hash = ModelHash(data, bitpos, weightmasks[m], HASH_MULTIPLIER);
-			out.hashes.push_back(hash);
+			packer.Add(hash);
 		}
 		out.bits.push_back(bit);
 	}
@@ -89,29 +178,67 @@ HashBits ComputeHashBits(const unsigned char* d, int size, unsigned char* contex
 
 	delete[] databuf;
 
+	packer.Finish();
 	return out;
 }
 
-void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashEntry* hashtable, int baseprob, int hashsize) {
-	int length = (int)hashbits.hashes.size();
+bool CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashTable& hashtable, int baseprob, int hashsize, int sizeLimit) {
+	int length = hashbits.length;
 	int nmodels = (int)hashbits.weights.size();
 	int bitlength = length / nmodels;
 	assert(bitlength * nmodels == length);
 
-	hashsize /= 2;
-	uint32_t hashshift = 0;
-	while (hashsize > (1ull << hashshift))
-		hashshift++;
-	uint32_t rcp_hashsize = (((1ull << (hashshift + 31)) + hashsize - 1) / hashsize);
-	uint32_t rcp_shift = hashshift - 1u + 32u;
-
-	unsigned int tinyhashsize = hashbits.tinyhashsize;
-	memset(hashtable, 0, tinyhashsize * sizeof(TinyHashEntry));
+	const HashReduction reduce(hashsize);
+
+	// Number the distinct reduced hashes of the contexts once, so coding the bits needs no probing
+	int numContexts = (int)hashbits.contextHashes.size();
+	unsigned int tinyhashsize = NextPowerOf2(numContexts) * 2;
+	hashtable.probes.assign(tinyhashsize, 0);
+	hashtable.contextEntries.resize(numContexts);
+	unsigned int numEntries = 0;
+	for (int c = 0; c < numContexts; c++) {
+		if (c + PROBE_PREFETCH_DISTANCE < numContexts) {
+			unsigned int aheadHash = reduce(hashbits.contextHashes[c + PROBE_PREFETCH_DISTANCE]);
+			_mm_prefetch((const char*)&hashtable.probes[aheadHash & (tinyhashsize - 1)], _MM_HINT_T0);
+		}
+		unsigned int hash = reduce(hashbits.contextHashes[c]);
+		unsigned int tinyHash = hash & (tinyhashsize - 1);
+		uint64_t* probe = &hashtable.probes[tinyHash];
+		while (*probe != 0 && (unsigned int)(*probe >> 32) != hash) {
+			tinyHash = (tinyHash + 1) & (tinyhashsize - 1);
+			probe = &hashtable.probes[tinyHash];
+		}
+		if (*probe == 0)
+			*probe = ((uint64_t)hash << 32) | ++numEntries;
+		hashtable.contextEntries[c] = (unsigned int)*probe - 1;
+	}
+	hashtable.entries.assign(numEntries, TinyHashEntry());
+	TinyHashEntry* entries = hashtable.entries.data();
+	const unsigned int* contextEntries = hashtable.contextEntries.data();
 	TinyHashEntry* hashEntries[MAX_N_MODELS];
 
-	int hashpos = 0;
+	// The lookups are pipelined to overlap their cache misses: the entry indices of the contexts
+	// two bits ahead and the counters of the next bit are prefetched while coding a bit.
+	unsigned int aheadContexts[MAX_N_MODELS];
+	TinyHashEntry* nextEntries[MAX_N_MODELS];
+	for (int m = 0; m < nmodels && bitlength > 0; m++) {
+		nextEntries[m] = &entries[contextEntries[hashbits.GetContext(m)]];
+		if (bitlength > 1) {
+			aheadContexts[m] = hashbits.GetContext(nmodels + m);
+			_mm_prefetch((const char*)&contextEntries[aheadContexts[m]], _MM_HINT_T0);
+		}
+	}
+
 	for (int bitpos = 0; bitpos < bitlength; bitpos++) {
 		int bit = hashbits.bits[bitpos];
+		bool hasNext = bitpos + 1 < bitlength;
+		bool hasAhead = bitpos + 2 < bitlength;
+		int aheadpos = (bitpos + 2) * nmodels;
+
+		// Coding more bits never makes the output shorter
+		if ((bitpos & 255) == 0 && GetSizeLowerBound() > sizeLimit) {
+			return false;
+		}
 
 		if (m_sizefillptr && ((bitpos - bitlength) & 7) == 0) {
 			*m_sizefillptr++ = AritCodePos(&m_aritstate) / (TABLE_BIT_PRECISION / BIT_PRECISION);
@@ -120,36 +247,23 @@ void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashE
 		// Query models
 		unsigned int probs[2] = { (unsigned int)baseprob, (unsigned int)baseprob };
 		for (int m = 0; m < nmodels; m++) {
-			uint32_t h = hashbits.hashes[hashpos++];
-			unsigned int hash = h - uint32_t(((uint64_t)h * rcp_hashsize) >> rcp_shift) * hashsize;
-
-			unsigned int tinyHash = hash & (tinyhashsize - 1);
-			TinyHashEntry *he = &hashtable[tinyHash];
-
-			while(true)
-			{
-				if(he->used == 0) {
-					he->hash = hash;
-					he->used = 1;
-					hashEntries[m] = he;
-					break;
-				} else if(he->hash == hash) {
-					hashEntries[m] = he;
+			// A context seen for the first time has zero counts, which add nothing
+			TinyHashEntry *he = nextEntries[m];
+			hashEntries[m] = he;
 
-					int fac = hashbits.weights[m];
-					unsigned int shift = (1 - (((he->prob[0] + 255)&(he->prob[1] + 255)) >> 8)) * 2 + fac;
-					probs[0] += ((unsigned int)he->prob[0] << shift);
-					probs[1] += ((unsigned int)he->prob[1] << shift);
-					break;
-				} else {
-					tinyHash++;
-					if(tinyHash >= tinyhashsize)
-						tinyHash = 0;
-					he = &hashtable[tinyHash];
-				}
+			if (hasNext) {
+				nextEntries[m] = &entries[contextEntries[aheadContexts[m]]];
+				_mm_prefetch((const char*)nextEntries[m], _MM_HINT_T0);
 			}
-			
-			
+			if (hasAhead) {
+				aheadContexts[m] = hashbits.GetContext(aheadpos + m);
+				_mm_prefetch((const char*)&contextEntries[aheadContexts[m]], _MM_HINT_T0);
+			}
+
+			int fac = hashbits.weights[m];
+			unsigned int shift = (1 - (((he->prob[0] + 255)&(he->prob[1] + 255)) >> 8)) * 2 + fac;
+			probs[0] += ((unsigned int)he->prob[0] << shift);
+			probs[1] += ((unsigned int)he->prob[1] << shift);
 		}
 
 		// Encode bit
@@ -157,28 +271,22 @@ void CompressionStream::CompressFromHashBits(const HashBits& hashbits, TinyHashE
 
 		// Update models
 		for (int m = 0; m < nmodels; m++) {
-			UpdateWeights((Weights*)hashEntries[m]->prob, bit, m_saturate);
+			UpdateCounters(hashEntries[m], bit, m_saturate);
 		}
 	}
 
 	if (m_sizefillptr) {
 		*m_sizefillptr = AritCodePos(&m_aritstate) / (TABLE_BIT_PRECISION / BIT_PRECISION);
 	}
+	return true;
 }
 
-__forceinline uint32_t Hash(__m128i& masked_contextdata)
-{
-	__m128i scrambler = _mm_set_epi8(113, 23, 5, 17, 13, 11, 7, 19, 3, 23, 29, 31, 37, 41, 43, 47);
-	
-	__m128i sample = _mm_madd_epi16(masked_contextdata, scrambler);
-	sample = _mm_add_epi32(_mm_add_epi32(sample, _mm_shuffle_epi32(sample, _MM_SHUFFLE(1, 1, 1, 1))), _mm_shuffle_epi32(sample, _MM_SHUFFLE(2, 2, 2, 2)));
-	uint32_t hash = _mm_cvtsi128_si32(sample);
-
-	uint64_t tmp = (uint64_t)hash * 0xd451151b;
-	return (uint32_t)tmp ^ uint32_t(tmp >> 32);
+int CompressionStream::GetSizeLowerBound() const {
+	// Bits output so far, as AritCodeEnd adds at most one
+	return ((int)m_aritstate.dest_bit + 7) / 8;
 }
 
-int CompressionStream::EvaluateSize(const unsigned char* d, int size, const ModelList4k& models, int baseprob, char* context, int bitpos) {
+long long CompressionStream::EvaluateSize(const unsigned char* d, int size, const ModelList4k& models, int baseprob, char* context, int bitpos) {
 	unsigned char* data = new unsigned char[size + MAX_CONTEXT_LENGTH + 16];	// Ensure 128bit operations are safe
 	memcpy(data, context, MAX_CONTEXT_LENGTH);
 	data += MAX_CONTEXT_LENGTH;
@@ -223,7 +331,7 @@ int CompressionStream::EvaluateSize(const unsigned char* d, int size, const Mode
 
 		next_masked_contextdata = _mm_and_si128(_mm_loadu_si128((__m128i *)(data - MAX_CONTEXT_LENGTH)), mask);
 
-		next_tinyhash = Hash(next_masked_contextdata) & tinyhashmask;
+		next_tinyhash = ContextHash(next_masked_contextdata) & tinyhashmask;
 		
 		for(int pos = 0; pos < size; pos++) {
 			int bit = (data[pos] >> inverted_bitpos) & 1;
@@ -231,7 +339,7 @@ int CompressionStream::EvaluateSize(const unsigned char* d, int size, const Mode
 			__m128i masked_contextdata = next_masked_contextdata;
 			size_t tinyhash = next_tinyhash;
 			next_masked_contextdata = _mm_and_si128(_mm_loadu_si128((__m128i *)(data + pos + 1 - MAX_CONTEXT_LENGTH)), mask);
-			next_tinyhash = Hash(next_masked_contextdata) & tinyhashmask;
+			next_tinyhash = ContextHash(next_masked_contextdata) & tinyhashmask;
 
 			while(true)
 			{
@@ -272,7 +380,7 @@ int CompressionStream::EvaluateSize(const unsigned char* d, int size, const Mode
 	delete[] data;
 	delete[] sums;
 
-	return (int) (totalsize / (TABLE_BIT_PRECISION / BIT_PRECISION));
+	return (long long) (totalsize / (TABLE_BIT_PRECISION / BIT_PRECISION));
 }
 
 CompressionStream::CompressionStream(unsigned char* data, int* sizefill, int maxCompressedSize, bool saturate) :
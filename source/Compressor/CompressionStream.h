@@ -2,22 +2,59 @@
 #ifndef _COMPRESSION_STREAM_H_
 #define _COMPRESSION_STREAM_H_
 
+#include <cstdint>
+#include <cstring>
 #include <vector>
 
 #include "AritCode.h"
 #include "ModelList.h"
 
+// The context hashes of every model for every bit of a segment, for compressing it with different hash sizes.
+// Contexts recur, so each hash is stored once, and the contexts of the bits as bit-packed indices of them.
 struct HashBits {
-	std::vector<unsigned>	hashes;
-	std::vector<bool>		bits;
-	std::vector<int>		weights;
-	unsigned int			tinyhashsize;
+	std::vector<unsigned>		contextHashes;	// Distinct hashes, in order of first use
+	std::vector<unsigned char>	contexts;		// contextBits-bit indices, model by model for each bit, padded for 64-bit loads
+	int							contextBits;
+	int							length;			// Number of contexts, bits times models
+	std::vector<bool>			bits;
+	std::vector<int>			weights;
+
+	unsigned int	GetContext(int i) const {
+		uint64_t bitpos = (uint64_t)i * contextBits;
+		uint64_t word;
+		memcpy(&word, &contexts[bitpos >> 3], sizeof(word));
+		return (unsigned int)(word >> (bitpos & 7)) & (unsigned int)((1ull << contextBits) - 1);
+	}
+	unsigned int	GetHash(int i) const	{ return contextHashes[GetContext(i)]; }
 };
 
 struct TinyHashEntry {
-	unsigned int	hash;
 	unsigned char	prob[2];
-	unsigned char	used;
+};
+
+// Working memory of CompressFromHashBits, which can be reused for any segment and hash size
+struct TinyHashTable {
+	std::vector<uint64_t>		probes;			// Reduced hash and entry index plus one by open addressing, zero if empty
+	std::vector<unsigned int>	contextEntries;	// Entry of each distinct context hash
+	std::vector<TinyHashEntry>	entries;		// Counters of each distinct reduced hash
+};
+
+// Reduces context hashes modulo half the hash size, the way the decompressor does
+struct HashReduction {
+	uint32_t	hashsize;
+	uint32_t	rcp_hashsize;
+	uint32_t	rcp_shift;
+
+	explicit HashReduction(int fullHashsize) {
+		hashsize = fullHashsize / 2;
+		uint32_t hashshift = 0;
+		while (hashsize > (1ull << hashshift))
+			hashshift++;
+		rcp_hashsize = (uint32_t)(((1ull << (hashshift + 31)) + hashsize - 1) / hashsize);
+		rcp_shift = hashshift - 1u + 32u;
+	}
+
+	uint32_t	operator()(uint32_t h) const	{ return h - uint32_t(((uint64_t)h * rcp_hashsize) >> rcp_shift) * hashsize; }
 };
 
 class CompressionStream {
@@ -30,8 +67,10 @@ class CompressionStream {
 public:
 	CompressionStream(unsigned char* data, int* sizefill, int maxsize, bool saturate);
 	
-	void	CompressFromHashBits(const HashBits& hashbits, TinyHashEntry* hashtable, int baseprob, int hashsize);
-	int		EvaluateSize(const unsigned char* data, int size, const ModelList4k& models, int baseprob, char* context, int bitpos);
+	// Returns false, leaving the stream incomplete, as soon as the compressed size is known to exceed sizeLimit bytes
+	bool	CompressFromHashBits(const HashBits& hashbits, TinyHashTable& hashtable, int baseprob, int hashsize, int sizeLimit);
+	int		GetSizeLowerBound() const;	// Compressed size in bytes, if no more bits are coded
+	long long	EvaluateSize(const unsigned char* data, int size, const ModelList4k& models, int baseprob, char* context, int bitpos);
 	int		Close();
 };
 
@@ -1,6 +1,14 @@
+#ifdef _WIN32
 #include <windows.h>
+#endif
 #include <cstdio>
-#include <ppl.h>
+#include <cstring>
+#include <climits>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <vector>
 #include "Compressor.h"
 #include "CompressionState.h"
 #include "CompressionStateEvaluator.h"
@@ -8,8 +16,9 @@
 #include "AritCode.h"
 #include "Model.h"
 #include "CounterState.h"
+#include "ThreadPool.h"
 
-static const unsigned int MAX_N_MODELS = 21;
+static const int MAX_N_MODELS = 21;
 static const unsigned int MAX_MODEL_WEIGHT = 9;
 
 static const int NUM_1K_MODELS = 33;	// 31 is always implicitly enabled. 30 to -1 are optional
@@ -17,14 +26,28 @@ static const int MIN_1K_BASEPROB = 4;
 static const int MAX_1K_BASEPROB = 8;
 static const int NUM_1K_BASEPROBS = MAX_1K_BASEPROB - MIN_1K_BASEPROB + 1;
 
+static const int DEFAULT_LARGE_SAMPLE_SIZE = 64 * 1024;
+static const int MAX_LARGE_SAMPLE_SIZE = 512 * 1024;		// Keeps the sizes of the model search within int
+static const int LARGE_SAMPLE_CHUNK_SIZE = 4 * 1024;
+static const int DEFAULT_LARGE_WINDOW_SIZE = 1024 * 1024;
+static const int MAX_LARGE_WINDOW_SIZE = 16 * 1024 * 1024;	// Keeps the hash positions of EvaluateSize within int
+
+// Default number of replicas of ApproximateModels4k. Each replica holds an evaluator and its checkpoint
+// journal, about REPLICA_BYTES_PER_INPUT_BYTE bytes per byte of input.
+static const int MAX_DEFAULT_REPLICAS = 8;
+static const long long REPLICA_MEMORY_BUDGET = 512ll * 1024 * 1024;
+static const int REPLICA_BYTES_PER_INPUT_BYTE = 2 * 8 * (int)sizeof(Package) / PACKAGE_SIZE;
+
 static const int MIN_1K_BOOST_FACTOR = 4;
 static const int MAX_1K_BOOST_FACTOR = 10;
 static const int NUM_1K_BOOST_FACTORS = MAX_1K_BOOST_FACTOR - MIN_1K_BOOST_FACTOR + 1;
 
+#ifdef _WIN32
 BOOL APIENTRY DllMain( HANDLE, DWORD, LPVOID )
 {
 	return TRUE;
 }
+#endif
 
 static int NextPowerOf2(int v) {
 	v--;
@@ -159,9 +182,65 @@ ModelList4k InstantModels4k() {
 	return models;
 }
 
-ModelList4k ApproximateModels4k(const unsigned char* data, int datasize, const unsigned char context[MAX_CONTEXT_LENGTH], CompressionType compressionType, bool saturate, int baseprob, int* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData) {
-	int width = compressionType == COMPRESSION_VERYSLOW ? 3 : 1;
-	const int ELITE_FLAG = INT_MIN;
+static const int ELITE_FLAG = INT_MIN;
+
+// Outcome of trying to add a model to one of the model sets of the search
+struct Candidate4k {
+	ModelList4k	models;		// Size is INT_MAX if the candidate is discarded
+	int			newSize;	// Size right after adding the model
+	bool		changed;	// The state was left at the new model set
+};
+
+static void TryAddModel4k(CompressionState& cs, const ModelList4k& models, unsigned char mask, CompressionType compressionType, Candidate4k& candidate) {
+	ModelList4k& new_models = candidate.models;
+	new_models.size = INT_MAX;
+	candidate.changed = false;
+	if (models.size == INT_MAX) return;
+
+	bool used = false;
+	for (int m = 0 ; m < models.nmodels ; m++) {
+		if (models[m].mask == mask) {
+			used = true;
+		}
+	}
+
+	if (!used && models.nmodels < MAX_N_MODELS) {
+		new_models = models;
+		new_models[models.nmodels].mask = mask;
+		new_models[models.nmodels].weight = 0;
+		new_models.nmodels++;
+
+		int old_size = models.size & ~ELITE_FLAG;
+		int new_size = TryWeights(cs, new_models, compressionType);
+		candidate.newSize = new_size;
+
+		if (new_size < old_size || compressionType == COMPRESSION_VERYSLOW) {
+			// Try remove
+			int bestsize = new_size;
+			for (int m = new_models.nmodels-2 ; m >= 0 ; m--) {
+				Model rmod = new_models[m];
+				new_models.nmodels -= 1;
+				new_models[m] = new_models[new_models.nmodels];
+				int size = TryWeights(cs, new_models, compressionType);
+				if (size < bestsize) {
+					bestsize = size;
+				} else {
+					new_models[m] = rmod;
+					new_models.nmodels++;
+				}
+			}
+
+			new_models.size = bestsize;
+			candidate.changed = true;
+		} else {
+			new_models.size = INT_MAX;
+		}
+	}
+}
+
+ModelList4k ApproximateModels4k(const unsigned char* data, int datasize, const unsigned char context[MAX_CONTEXT_LENGTH], CompressionType compressionType, bool saturate, int baseprob, int beamWidth, int numReplicas, int* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData) {
+	// Number of model sets searched side by side
+	int width = beamWidth > 0 ? beamWidth : compressionType == COMPRESSION_VERYSLOW ? 3 : 1;
 
 	std::vector<ModelList4k> modelsets(width * 2);
 	CompressionStateEvaluator evaluator;
@@ -182,65 +261,133 @@ ModelList4k ApproximateModels4k(const unsigned char* data, int datasize, const u
 		modelsets[s].size = INT_MAX;
 	}
 
-	for (int maski = 0 ; maski <= 255 ; maski++) {
-		int mask = masks[maski];
+	// The replicas evaluate consecutive candidates in parallel, speculating that the earlier ones
+	// do not change the model sets. Results are committed in order. For them not to depend on
+	// numReplicas, every candidate is evaluated from a well-defined state: with ApproximateWeights,
+	// the state left by the last mask that changed the model sets. OptimizeWeights changes all weights
+	// anyway, so there the candidates are evaluated from the state without any models.
+	bool resetReplicas = compressionType != COMPRESSION_FAST;
+	if (numReplicas <= 0) {
+		long long replicaSize = std::max(1ll, (long long)datasize * REPLICA_BYTES_PER_INPUT_BYTE);
+		numReplicas = std::min(ThreadPool::Instance().GetNumThreads(), MAX_DEFAULT_REPLICAS);
+		numReplicas = (int)std::max(1ll, std::min((long long)numReplicas, REPLICA_MEMORY_BUDGET / replicaSize));
+	}
+	std::vector<std::unique_ptr<CompressionStateEvaluator>> replicaEvaluators;
+	std::vector<std::unique_ptr<CompressionState>> replicas;
+	std::vector<int> replicaVersions(numReplicas, -1);
+	for (int r = 0; r < numReplicas; r++) {
+		replicaEvaluators.emplace_back(new CompressionStateEvaluator());
+		replicas.emplace_back(new CompressionState(cs, replicaEvaluators.back().get()));
+	}
+	std::vector<Candidate4k> candidates(numReplicas);
+
+	CompressionStateEvaluator nextEvaluator;
+	CompressionState nextState(cs, &nextEvaluator);
+	CompressionState* base = &cs;
+	CompressionState* next = &nextState;
+	int baseVersion = 0;
+	int changedCandidate = -1;
+	bool maskChanged = false;
+
+	// Predictions are computed on the thread pool a little ahead of the masks being tried. Once all
+	// model sets have tried a mask, its predictions are freed as soon as no model set or base state uses it.
+	int prefetchDistance = ThreadPool::Instance().GetNumThreads();
+	int numTriedMasks = 0;
+	std::vector<unsigned char> retainedMasks;
+	auto isMaskUsed = [&](unsigned char mask) {
+		if (base->UsesModel(mask))
+			return true;
+		for (const ModelList4k& models : modelsets) {
+			for (int i = 0; i < models.nmodels; i++) {
+				if (models[i].mask == mask)
+					return true;
+			}
+		}
+		return false;
+	};
+
+	int numCandidates = 256 * width;
+	for (int first = 0; first < numCandidates; ) {
+		int count = std::min(numReplicas, numCandidates - first);
+		int front = first / width;
+		cs.PrefetchModels(masks + front, std::min(256 - front, (count + width - 1) / width + prefetchDistance));
+		ParallelFor(0, count, [&](int r) {
+			int c = first + r;
+			CompressionState& replica = *replicas[r];
+			if (resetReplicas) {
+				replica.Reset();
+			} else if (replicaVersions[r] != baseVersion) {
+				replica.CopyState(*base);
+				replica.Checkpoint();
+				replicaVersions[r] = baseVersion;
+			}
+			TryAddModel4k(replica, modelsets[c % width], masks[c / width], compressionType, candidates[r]);
+		});
 
-		for (int s = 0; s < width; s++) {
+		// Commit until the model sets change. Later candidates were evaluated from stale model sets.
+		int committed = count;
+		for (int r = 0; r < count; r++) {
+			int c = first + r;
+			int s = c % width;
 			ModelList4k& models = modelsets[s];
 			ModelList4k& new_models = modelsets[width + s];
-
-			new_models.size = INT_MAX;
-			if (models.size == INT_MAX) continue;
-
-			bool used = false;
-			for (int m = 0 ; m < models.nmodels ; m++) {
-				if (models[m].mask == mask) {
-					used = true;
+			new_models = candidates[r].models;
+			if (candidates[r].changed) {
+				int old_size = models.size & ~ELITE_FLAG;
+				if ((models.size & ELITE_FLAG) != 0 && candidates[r].newSize < old_size) {
+					models.size &= ~ELITE_FLAG;
+					new_models.size |= ELITE_FLAG;
 				}
+				if (!resetReplicas) {
+					next->CopyState(*replicas[r]);
+					changedCandidate = c;
+				}
+				maskChanged = true;
 			}
 
-			if (!used && models.nmodels < MAX_N_MODELS) {
-				new_models = models;
-				new_models[models.nmodels].mask = (unsigned char)mask;
-				new_models[models.nmodels].weight = 0;
-				new_models.nmodels++;
+			if (s == width - 1) {
+				std::stable_sort(modelsets.begin(), modelsets.end(), [](const ModelList4k& a, const ModelList4k& b) {
+					return a.size < b.size;
+				});
 
-				int old_size = models.size & ~ELITE_FLAG;
-				int new_size = TryWeights(cs, new_models, compressionType);
-
-				if (new_size < old_size || compressionType == COMPRESSION_VERYSLOW) {
-					// Try remove
-					int bestsize = new_size;
-					for (int m = new_models.nmodels-2 ; m >= 0 ; m--) {
-						Model rmod = new_models[m];
-						new_models.nmodels -= 1;
-						new_models[m] = new_models[new_models.nmodels];
-						int size = TryWeights(cs, new_models, compressionType);
-						if (size < bestsize) {
-							bestsize = size;
-						} else {
-							new_models[m] = rmod;
-							new_models.nmodels++;
-						}
-					}
+				if(progressCallback)
+					progressCallback(progressUserData, c / width + 1, 256);
+
+				if (changedCandidate != -1) {
+					std::swap(base, next);
+					baseVersion++;
 
-					new_models.size = bestsize;
-					if ((models.size & ELITE_FLAG) != 0 && new_size < old_size) {
-						models.size &= ~ELITE_FLAG;
-						new_models.size |= ELITE_FLAG;
+					// Unless reused since, the replica of the candidate is already in the new base state
+					if (changedCandidate >= first) {
+						replicas[changedCandidate - first]->Checkpoint();
+						replicaVersions[changedCandidate - first] = baseVersion;
 					}
-				} else {
-					new_models.size = INT_MAX;
+					changedCandidate = -1;
+				}
+				if (maskChanged) {
+					maskChanged = false;
+					committed = r + 1;
+					break;
 				}
 			}
 		}
 
-		std::stable_sort(modelsets.begin(), modelsets.end(), [](const ModelList4k& a, const ModelList4k& b) {
-			return a.size < b.size;
-		});
+		for (int r = 0; r < count && !resetReplicas; r++) {
+			if (replicaVersions[r] == baseVersion) {
+				replicas[r]->Rollback();
+			}
+		}
+		first += committed;
 
-		if(progressCallback)
-			progressCallback(progressUserData, maski+1, 256);
+		for (; numTriedMasks < first / width; numTriedMasks++) {
+			retainedMasks.push_back(masks[numTriedMasks]);
+		}
+		retainedMasks.erase(std::remove_if(retainedMasks.begin(), retainedMasks.end(), [&](unsigned char mask) {
+			if (isMaskUsed(mask))
+				return false;
+			cs.ReleaseModel(mask);
+			return true;
+		}), retainedMasks.end());
 	}
 
 	assert((modelsets[0].size & ELITE_FLAG) != 0);
@@ -249,7 +396,7 @@ ModelList4k ApproximateModels4k(const unsigned char* data, int datasize, const u
 		return a.size < b.size;
 	});
 	ModelList4k models = modelsets[0];
-	int size = OptimizeWeights(cs, models);
+	int size = OptimizeWeights(*base, models);
 	if(outCompressedSize)
 		*outCompressedSize = size;
 
@@ -404,7 +551,7 @@ int	EvaluateSize4k(const unsigned char* inputData, int numSegments, const int* s
 		segmentOffset += segmentSizes[i];
 	}
 
-	concurrency::parallel_for(0, numSegments * 8, [&](int i)
+	ParallelFor(0, numSegments * 8, [&](int i)
 	{
 		int segment = i >> 3;
 		int bitpos = i & 7;
@@ -417,7 +564,7 @@ int	EvaluateSize4k(const unsigned char* inputData, int numSegments, const int* s
 			context[i] = srcpos >= 0 ? inputData[srcpos] : 0;
 		}
 
-		compressedSizes[i] = cs.EvaluateSize(inputData + offset, segmentSizes[segment], *modelLists[segment], baseprob, context, bitpos);
+		compressedSizes[i] = (int)cs.EvaluateSize(inputData + offset, segmentSizes[segment], *modelLists[segment], baseprob, context, bitpos);
 	});
 
 	int totalSize = 0;
@@ -435,13 +582,74 @@ int	EvaluateSize4k(const unsigned char* inputData, int numSegments, const int* s
 	return totalSize;
 }
 
+long long EvaluateSize4kLarge(const unsigned char* inputData, long long inputSize, const ModelList4k& models, int baseprob, bool saturate, int windowSize)
+{
+	if (windowSize <= 0)
+		windowSize = DEFAULT_LARGE_WINDOW_SIZE;
+	windowSize = std::min(windowSize, MAX_LARGE_WINDOW_SIZE);
+
+	CompressionStream cs(NULL, NULL, 0, saturate);
+	
+	// The windows are evaluated one after another to bound memory use, the bit positions in parallel
+	long long totalSize = models.nmodels * 8 * BIT_PRECISION;
+	for (long long offset = 0; offset < inputSize; offset += windowSize)
+	{
+		int size = (int)std::min<long long>(windowSize, inputSize - offset);
+		char context[MAX_CONTEXT_LENGTH];
+		for (int i = 0; i < MAX_CONTEXT_LENGTH; i++)
+		{
+			long long srcpos = offset - MAX_CONTEXT_LENGTH + i;
+			context[i] = srcpos >= 0 ? inputData[srcpos] : 0;
+		}
+
+		long long compressedSizes[8];
+		ParallelFor(0, 8, [&](int bitpos)
+		{
+			compressedSizes[bitpos] = cs.EvaluateSize(inputData + offset, size, models, baseprob, context, bitpos);
+		});
+		for (int bitpos = 0; bitpos < 8; bitpos++)
+			totalSize += compressedSizes[bitpos];
+	}
+	return totalSize;
+}
+
+ModelList4k ApproximateModels4kLarge(const unsigned char* inputData, long long inputSize, CompressionType compressionType, bool saturate, int baseprob, int sampleSize, long long* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData)
+{
+	if (sampleSize <= 0)
+		sampleSize = DEFAULT_LARGE_SAMPLE_SIZE;
+	sampleSize = std::min(sampleSize, MAX_LARGE_SAMPLE_SIZE);
+
+	unsigned char context[MAX_CONTEXT_LENGTH] = {};
+	ModelList4k models;
+	if (inputSize <= sampleSize)
+	{
+		models = ApproximateModels4k(inputData, (int)inputSize, context, compressionType, saturate, baseprob, 0, 0, nullptr, progressCallback, progressUserData);
+	}
+	else
+	{
+		// Chunks spread evenly over the input, the first and last chunk at its ends
+		int numChunks = std::max(1, sampleSize / LARGE_SAMPLE_CHUNK_SIZE);
+		int chunkSize = sampleSize / numChunks;
+		std::vector<unsigned char> sample((size_t)numChunks * chunkSize);
+		for (int c = 0; c < numChunks; c++)
+		{
+			long long offset = numChunks > 1 ? (inputSize - chunkSize) * c / (numChunks - 1) : 0;
+			memcpy(&sample[(size_t)c * chunkSize], inputData + offset, chunkSize);
+		}
+		models = ApproximateModels4k(sample.data(), (int)sample.size(), context, compressionType, saturate, baseprob, 0, 0, nullptr, progressCallback, progressUserData);
+	}
+
+	if (outCompressedSize)
+		*outCompressedSize = EvaluateSize4kLarge(inputData, inputSize, models, baseprob, saturate, 0);
+	return models;
+}
+
 int Compress4k(const unsigned char* inputData, int numSegments, const int* segmentSizes, unsigned char* outCompressedData, int maxCompressedSize, ModelList4k** modelLists, bool saturate, int baseprob, int hashsize, int* sizefill)
 {
 	unsigned char context[MAX_CONTEXT_LENGTH] = {};
 
 	std::vector<HashBits> hashbits(numSegments);
-	std::vector<std::vector<TinyHashEntry>> hashtables(numSegments);
-	std::vector<TinyHashEntry*> hashtablePtrs(numSegments);
+	TinyHashTable hashtable;
 
 	int segmentOffset = 0;
 	for (int i = 0; i < numSegments; i++)
@@ -449,24 +657,107 @@ int Compress4k(const unsigned char* inputData, int numSegments, const int* segme
 		int segmentSize = segmentSizes[i];
 		hashbits[i] = ComputeHashBits(inputData + segmentOffset, segmentSize, context, *modelLists[i], i == 0, (i + 1) == numSegments);
 		segmentOffset += segmentSize;
-
-		hashtables[i].resize(hashbits[i].tinyhashsize);
-		hashtablePtrs[i] = hashtables[i].data();
 	}
 
-	return CompressFromHashBits4k(hashbits.data(), hashtablePtrs.data(), numSegments, outCompressedData, maxCompressedSize, saturate, baseprob, hashsize, sizefill);
+	return CompressFromHashBits4k(hashbits.data(), hashtable, numSegments, outCompressedData, maxCompressedSize, saturate, baseprob, hashsize, sizefill, INT_MAX);
 }
 
-int CompressFromHashBits4k(const HashBits* hashbits, TinyHashEntry** hashtables, int numSegments, unsigned char* outCompressedData, int maxCompressedSize, bool saturate, int baseprob, int hashsize, int* sizefill)
+int CompressFromHashBits4k(const HashBits* hashbits, TinyHashTable& hashtable, int numSegments, unsigned char* outCompressedData, int maxCompressedSize, bool saturate, int baseprob, int hashsize, int* sizefill, int sizeLimit)
 {
 	CompressionStream cs(outCompressedData, sizefill, maxCompressedSize, saturate);
 	for (int i = 0; i < numSegments; i++)
 	{
-		cs.CompressFromHashBits(hashbits[i], hashtables[i], baseprob, hashsize);
+		if (!cs.CompressFromHashBits(hashbits[i], hashtable, baseprob, hashsize, sizeLimit))
+			return cs.GetSizeLowerBound();
 	}
 	return cs.Close();
 }
 
+// Information in bits of the bits seen in a context, coded with their frequencies
+static double ContextInformation(int count0, int count1)
+{
+	double count = count0 + count1;
+	double information = 0.0;
+	if (count0 > 0)
+		information -= count0 * log2(count0 / count);
+	if (count1 > 0)
+		information -= count1 * log2(count1 / count);
+	return information;
+}
+
+void PredictHashCollisionCosts(const HashBits* hashbits, int numSegments, const int* hashsizes, int numHashsizes, long long* outCosts)
+{
+	struct Context
+	{
+		unsigned int	hash;
+		int				counts[2];
+		double			information;
+	};
+
+	std::vector<double> costs(numHashsizes, 0.0);
+	for (int s = 0; s < numSegments; s++)
+	{
+		// The distinct contexts of the segment, with the bits seen in each
+		const HashBits& segment = hashbits[s];
+		int nmodels = (int)segment.weights.size();
+		int numContexts = (int)segment.contextHashes.size();
+		std::vector<Context> contexts(numContexts);
+		for (int i = 0; i < numContexts; i++)
+			contexts[i] = { segment.contextHashes[i], { 0, 0 }, 0.0 };
+		for (int i = 0; i < segment.length; i++)
+			contexts[segment.GetContext(i)].counts[segment.bits[i / nmodels]]++;
+		for (Context& context : contexts)
+			context.information = ContextInformation(context.counts[0], context.counts[1]);
+
+		ParallelFor(0, numHashsizes, [&](int h)
+		{
+			// Sort the contexts by reduced hash, two radix passes of 16 bits
+			HashReduction reduce(hashsizes[h]);
+			std::vector<uint64_t> keys(numContexts), sorted(numContexts);
+			for (int i = 0; i < numContexts; i++)
+				keys[i] = ((uint64_t)reduce(contexts[i].hash) << 32) | (unsigned int)i;
+			for (int shift = 32; shift < 64; shift += 16)
+			{
+				std::vector<int> offsets(65536 + 1, 0);
+				for (uint64_t key : keys)
+					offsets[((key >> shift) & 0xFFFF) + 1]++;
+				for (int d = 0; d < 65536; d++)
+					offsets[d + 1] += offsets[d];
+				for (uint64_t key : keys)
+					sorted[offsets[(key >> shift) & 0xFFFF]++] = key;
+				keys.swap(sorted);
+			}
+
+			// Colliding contexts share their counters, which costs the information lost by merging their bits
+			double cost = 0.0;
+			for (int i = 0; i < numContexts;)
+			{
+				int end = i + 1;
+				while (end < numContexts && (keys[end] >> 32) == (keys[i] >> 32))
+					end++;
+				if (end - i > 1)
+				{
+					int counts[2] = { 0, 0 };
+					double separateInformation = 0.0;
+					for (int k = i; k < end; k++)
+					{
+						const Context& context = contexts[(unsigned int)keys[k]];
+						counts[0] += context.counts[0];
+						counts[1] += context.counts[1];
+						separateInformation += context.information;
+					}
+					cost += ContextInformation(counts[0], counts[1]) - separateInformation;
+				}
+				i = end;
+			}
+			costs[h] += cost;
+		});
+	}
+
+	for (int h = 0; h < numHashsizes; h++)
+		outCosts[h] = (long long)(costs[h] * BIT_PRECISION + 0.5);
+}
+
 int Compress1k(const unsigned char* orgInputData, int inputSize, unsigned char* outCompressedData, int maxCompressedSize, ModelList1k& modelList, int* sizefill, int* outInternalSize)
 {
 	int boost_factor = modelList.boost;
@@ -497,7 +788,7 @@ int Compress1k(const unsigned char* orgInputData, int inputSize, unsigned char*
 
 	SHashEntry1* hash_table_data = new SHashEntry1[hash_table_size * 8];
 	
-	concurrency::parallel_for(0, 8, [&](int bitpos)
+	ParallelFor(0, 8, [&](int bitpos)
 	{
 		int mask = 0xFF00 >> bitpos;
 		SHashEntry1* hash_table1 = &hash_table_data[bitpos * hash_table_size];
@@ -743,8 +1034,8 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 		best_flip = -1;
 		unsigned int prev_best_modelmask = best_modelmask;
 
-		concurrency::critical_section cs;
-		concurrency::parallel_for(0, num_models, [&](int i)
+		std::mutex cs;
+		ParallelFor(0, num_models, [&](int i)
 		{
 			int model_idx = 0;
 			int bitcount = i;
@@ -774,8 +1065,9 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 				int b0, b1;
 				testsize = Evaluate1K(data, inputSize, modeldata, &b0, &b1, &boost_factor, modelmask);
 
-				Concurrency::critical_section::scoped_lock l(cs);
-				if (testsize < best_size)
+				// Break ties on the flip index, so the result does not depend on scheduling
+				std::lock_guard<std::mutex> l(cs);
+				if (testsize < best_size || (testsize == best_size && best_flip != -1 && i < best_flip))
 				{
 					best_size = testsize;
 					best_boost = boost_factor;
@@ -824,5 +1116,6 @@ ModelList1k ApproximateModels1k(const unsigned char* orgInputData, int inputSize
 
 void InitCompressor()
 {
+	InitLogTable();
 	InitCounterStates();
 }
\ No newline at end of file
@@ -10,7 +10,7 @@ static const int MAX_CONTEXT_LENGTH =	8;		// Maximum size of context window
 static const int DEFAULT_BASEPROB	=	10;		// Default weight for trivial model
 static const int BIT_PRECISION		=	256;	// Number of units per bit
 
-enum CompressionType {COMPRESSION_INSTANT, COMPRESSION_FAST, COMPRESSION_SLOW, COMPRESSION_VERYSLOW};
+enum CompressionType : int {COMPRESSION_INSTANT, COMPRESSION_FAST, COMPRESSION_SLOW, COMPRESSION_VERYSLOW};
 
 typedef void	(ProgressCallback)(void* userData, int value, int max);
 
@@ -22,9 +22,24 @@ ModelList1k		ApproximateModels1k(const unsigned char* inputData, int inputSize,
 int				Compress1k(const unsigned char* inputData, int inputSize, unsigned char* outCompressedData, int maxCompressedSize, ModelList1k& modelList, int* sizefill, int* outInternalSize);
 
 ModelList4k		InstantModels4k();
-ModelList4k		ApproximateModels4k(const unsigned char* inputData, int inputSize, const unsigned char context[MAX_CONTEXT_LENGTH], CompressionType compressionType, bool saturate, int baseprob, int* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData);
+// Candidate models are evaluated on numReplicas replicas of the compression state in parallel, each
+// taking about 128 bytes per byte of input. Pass 0 for the number of threads, but at most 8 replicas
+// and no more than fit in 512 MB.
+ModelList4k		ApproximateModels4k(const unsigned char* inputData, int inputSize, const unsigned char context[MAX_CONTEXT_LENGTH], CompressionType compressionType, bool saturate, int baseprob, int beamWidth, int numReplicas, int* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData);
 int				EvaluateSize4k(const unsigned char* inputData, int numSegments, const int* segmentSizes, int* outCompressedSegmentSizes, ModelList4k** modelLists, int baseprob, bool saturate);
+
+// Size estimation for inputs of many megabytes. Models are selected on a sample of evenly spaced
+// chunks, and sizes are evaluated in windows that each start from fresh model statistics, so memory
+// use is bounded by the sample and window sizes. Pass 0 for the default sizes.
+ModelList4k		ApproximateModels4kLarge(const unsigned char* inputData, long long inputSize, CompressionType compressionType, bool saturate, int baseprob, int sampleSize, long long* outCompressedSize, ProgressCallback* progressCallback, void* progressUserData);
+long long		EvaluateSize4kLarge(const unsigned char* inputData, long long inputSize, const ModelList4k& models, int baseprob, bool saturate, int windowSize);
 int				Compress4k(const unsigned char* inputData, int numSegments, const int* segmentSizes, unsigned char* outCompressedData, int maxCompressedSize, ModelList4k** modelLists, bool saturate, int baseprob, int hashsize, int* sizefill);
-int				CompressFromHashBits4k(const HashBits* hashbits, TinyHashEntry** hashtables, int numSegments, unsigned char* outCompressedData, int maxCompressedSize, bool saturate, int baseprob, int hashsize, int* sizefill);
+// Stops early and returns a size larger than sizeLimit once the compressed size is known to exceed sizeLimit
+int				CompressFromHashBits4k(const HashBits* hashbits, TinyHashTable& hashtable, int numSegments, unsigned char* outCompressedData, int maxCompressedSize, bool saturate, int baseprob, int hashsize, int* sizefill, int sizeLimit);
+
+// Predicts how much hash collisions cost the compression for each of the hash sizes, without compressing.
+// Contexts whose hashes collide at a hash size share statistics, costing the information lost by merging
+// the bits seen in them. Costs are in BIT_PRECISION units, and rank hash sizes roughly by compressed size.
+void			PredictHashCollisionCosts(const HashBits* hashbits, int numSegments, const int* hashsizes, int numHashsizes, long long* outCosts);
 
 #endif
@@ -1,6 +1,7 @@
 #include "CounterState.h"
 
 #include <memory>
+#include <cstring>
 #include <cassert>
 
 CounterState unsaturated_counter_states[1471];
@@ -8,8 +8,8 @@ struct CounterState
 	unsigned short next_state[2];
 };
 
-CounterState unsaturated_counter_states[];
-CounterState saturated_counter_states[];
+extern CounterState unsaturated_counter_states[];
+extern CounterState saturated_counter_states[];
 
 void InitCounterStates();
 
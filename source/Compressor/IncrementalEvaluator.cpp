@@ -0,0 +1,311 @@
+#include "IncrementalEvaluator.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "Compressor.h"
+#include "CounterState.h"
+#include "Model.h"
+#include "ThreadPool.h"
+
+static const uint16_t EMPTY_STATE = 0xFFFF;
+
+static int NextPowerOf2(int v) {
+	v--;
+	v |= v >> 1;
+	v |= v >> 2;
+	v |= v >> 4;
+	v |= v >> 8;
+	v |= v >> 16;
+	return v + 1;
+}
+
+// Evaluates one bit position of a segment like CompressionStream::EvaluateSize, but with a hash table
+// per model. Every position changes exactly one entry of every table. These changes are journaled,
+// so the tables can be moved to any position of the accepted data by undoing or replaying them.
+class IncrementalBitEvaluator {
+	struct Record {
+		unsigned int	slot;
+		uint16_t		oldState;	// EMPTY_STATE if the entry was inserted
+		uint16_t		newState;
+	};
+
+	int						m_bitpos;
+	int						m_baseprob;
+	const CounterState*		m_counterStates;
+	int						m_numModels;
+	int						m_weights[MAX_MODELS];
+	__m128i					m_masks[MAX_MODELS];
+
+	int						m_capacity;
+	unsigned int			m_hashsize;
+	std::vector<int>		m_positions;		// Per model table: position of the context, or -1 if empty
+	std::vector<uint16_t>	m_states;
+	std::vector<Record>		m_journal;			// Per model and position of the accepted data
+	std::vector<Record>		m_trialJournal;		// Per model and position of the last evaluation
+	std::vector<unsigned int>	m_sums;
+	std::vector<int>		m_trialSizes;
+	std::vector<long long>	m_prefixSizes;		// Sum of the sizes before each position of the accepted data
+
+	int						m_position;			// The tables hold the accepted data up to here
+	int						m_size;				// Size of the accepted data
+	int						m_trialFirst;
+	int						m_trialSize;
+
+	void Undo(const Record& r, int model) {
+		unsigned int slot = model * m_hashsize + r.slot;
+		if (r.oldState == EMPTY_STATE)
+			m_positions[slot] = -1;
+		else
+			m_states[slot] = r.oldState;
+	}
+
+	void Redo(const Record& r, int model, int pos) {
+		unsigned int slot = model * m_hashsize + r.slot;
+		if (r.oldState == EMPTY_STATE)
+			m_positions[slot] = pos;
+		m_states[slot] = r.newState;
+	}
+
+	void MoveTo(int position) {
+		for (int m = 0; m < m_numModels; m++) {
+			const Record* journal = &m_journal[(size_t)m * m_capacity];
+			for (int pos = m_position - 1; pos >= position; pos--)
+				Undo(journal[pos], m);
+			for (int pos = m_position; pos < position; pos++)
+				Redo(journal[pos], m, pos);
+		}
+		m_position = position;
+	}
+
+public:
+	IncrementalBitEvaluator(const ModelList4k& models, int bitpos, int baseprob, bool saturate, int capacity) :
+		m_bitpos(bitpos), m_baseprob(baseprob), m_numModels(models.nmodels), m_capacity(capacity),
+		m_position(0), m_size(0), m_trialFirst(0), m_trialSize(0)
+	{
+		m_counterStates = saturate ? saturated_counter_states : unsaturated_counter_states;
+		for (int m = 0; m < m_numModels; m++) {
+			unsigned char maskbytes[16] = {};
+			for (int i = 0; i < 8; i++) {
+				maskbytes[i] = ((models[m].mask >> i) & 1) * 0xff;
+			}
+			maskbytes[8] = (unsigned char)(0xff00 >> bitpos);
+			m_masks[m] = _mm_loadu_si128((__m128i*)maskbytes);
+			m_weights[m] = models[m].weight;
+		}
+
+		m_hashsize = NextPowerOf2(capacity * 3 / 2);
+		m_positions.resize((size_t)m_numModels * m_hashsize, -1);
+		m_states.resize((size_t)m_numModels * m_hashsize);
+		m_journal.resize((size_t)m_numModels * capacity);
+		m_trialJournal.resize((size_t)m_numModels * capacity);
+		m_sums.resize((size_t)capacity * 2);
+		m_trialSizes.resize(capacity);
+		m_prefixSizes.resize(capacity + 1);
+	}
+
+	static long long MemoryUsage(int numModels, int capacity) {
+		long long hashsize = NextPowerOf2(capacity * 3 / 2);
+		return numModels * hashsize * (sizeof(int) + sizeof(uint16_t)) + 2LL * numModels * capacity * sizeof(Record) + capacity * 20LL;
+	}
+
+	// Journaled evaluation runs forward and back over the changed part and moves the tables to its start,
+	// so it only pays off when the changed part is small. Measured relative to a position of a full
+	// evaluation, a journaled position costs about 1.6 and moving the tables by one position about 0.6.
+	bool IsCheaperThanFull(int size, int firstChanged) const {
+		int first = std::min(firstChanged, std::min(size, m_size));
+		return 8LL * (size - first) + 3LL * std::abs(first - m_position) < 5LL * size;
+	}
+
+	// Size of data in BIT_PRECISION units. Positions before firstChanged must be unchanged since the accepted data.
+	long long Evaluate(const unsigned char* data, int size, int firstChanged) {
+		int first = std::min(firstChanged, std::min(size, m_size));
+		MoveTo(first);
+
+		for (int pos = first; pos < size; pos++) {
+			m_sums[pos * 2] = m_baseprob;
+			m_sums[pos * 2 + 1] = m_baseprob;
+		}
+
+		int inverted_bitpos = 7 - m_bitpos;
+		unsigned int hashmask = m_hashsize - 1u;
+		for (int m = 0; m < m_numModels; m++) {
+			__m128i mask = m_masks[m];
+			int weight = m_weights[m];
+			int* positions = &m_positions[(size_t)m * m_hashsize];
+			uint16_t* states = &m_states[(size_t)m * m_hashsize];
+			Record* journal = &m_trialJournal[(size_t)m * m_capacity];
+
+			__m128i next_masked_contextdata = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + first - MAX_CONTEXT_LENGTH)), mask);
+			unsigned int next_tinyhash = ContextHash(next_masked_contextdata) & hashmask;
+			for (int pos = first; pos < size; pos++) {
+				int bit = (data[pos] >> inverted_bitpos) & 1;
+
+				__m128i masked_contextdata = next_masked_contextdata;
+				unsigned int tinyhash = next_tinyhash;
+				next_masked_contextdata = _mm_and_si128(_mm_loadu_si128((const __m128i*)(data + pos + 1 - MAX_CONTEXT_LENGTH)), mask);
+				next_tinyhash = ContextHash(next_masked_contextdata) & hashmask;
+				_mm_prefetch((const char*)&positions[next_tinyhash], _MM_HINT_T0);
+				_mm_prefetch((const char*)&states[next_tinyhash], _MM_HINT_T0);
+
+				while (true) {
+					int candidate_pos = positions[tinyhash];
+					if (candidate_pos < 0) {
+						positions[tinyhash] = pos;
+						states[tinyhash] = (uint16_t)bit;	// counter_states is arranged such that (1,0) is 0 and (0,1) is 1.
+						journal[pos] = { tinyhash, EMPTY_STATE, (uint16_t)bit };
+						break;
+					}
+
+					if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i*)&data[candidate_pos - MAX_CONTEXT_LENGTH]), mask), masked_contextdata)) == 0xFFFF) {
+						const CounterState& state = m_counterStates[states[tinyhash]];
+						m_sums[pos * 2] += (unsigned int)state.boosted_counters[0] << weight;
+						m_sums[pos * 2 + 1] += (unsigned int)state.boosted_counters[1] << weight;
+						journal[pos] = { tinyhash, states[tinyhash], state.next_state[bit] };
+						states[tinyhash] = state.next_state[bit];
+						break;
+					}
+
+					tinyhash = (tinyhash + 1) & hashmask;
+				}
+			}
+
+			// Leave the table at the first changed position again
+			for (int pos = size - 1; pos >= first; pos--)
+				Undo(journal[pos], m);
+		}
+
+		uint64_t totalsize = m_prefixSizes[first];
+		for (int pos = first; pos < size; pos++) {
+			int bit = (data[pos] >> inverted_bitpos) & 1;
+			m_trialSizes[pos] = AritSize2(m_sums[pos * 2 + bit], m_sums[pos * 2 + !bit]);
+			totalsize += m_trialSizes[pos];
+		}
+
+		m_trialFirst = first;
+		m_trialSize = size;
+		return (long long)(totalsize / (TABLE_BIT_PRECISION / BIT_PRECISION));
+	}
+
+	void Accept() {
+		for (int m = 0; m < m_numModels; m++) {
+			size_t base = (size_t)m * m_capacity;
+			std::copy(m_trialJournal.begin() + base + m_trialFirst, m_trialJournal.begin() + base + m_trialSize, m_journal.begin() + base + m_trialFirst);
+		}
+		for (int pos = m_trialFirst; pos < m_trialSize; pos++) {
+			m_prefixSizes[pos + 1] = m_prefixSizes[pos] + m_trialSizes[pos];
+		}
+		m_size = m_trialSize;
+	}
+};
+
+IncrementalEvaluator4k::IncrementalEvaluator4k(int numSegments, ModelList4k** modelLists, int baseprob, bool saturate, long long maxMemory) :
+	m_segments(numSegments), m_baseprob(baseprob), m_saturate(saturate), m_maxMemory(maxMemory), m_incremental(true)
+{
+	for (int i = 0; i < numSegments; i++) {
+		Segment& segment = m_segments[i];
+		segment.models = *modelLists[i];
+		segment.acceptedSize = 0;
+		segment.size = 0;
+		segment.firstChanged = 0;
+		segment.journaled = false;
+		segment.capacity = 0;
+	}
+}
+
+IncrementalEvaluator4k::~IncrementalEvaluator4k() {
+}
+
+void IncrementalEvaluator4k::Reserve(Segment& segment, int size) {
+	segment.data.resize(MAX_CONTEXT_LENGTH + size + 16);
+	if (segment.capacity > 0 && size <= segment.capacity)
+		return;
+
+	// Leave room for growth, as hunk alignment can change the segment sizes
+	segment.capacity = size + size / 4 + 64;
+	long long memory = 0;
+	for (const Segment& s : m_segments)
+		memory += 8 * IncrementalBitEvaluator::MemoryUsage(s.models.nmodels, s.capacity);
+	m_incremental = memory <= m_maxMemory;
+
+	// The journals start over, so nothing of the accepted data can be reused
+	for (int bitpos = 0; bitpos < 8; bitpos++) {
+		segment.bitEvaluators[bitpos].reset(m_incremental ? new IncrementalBitEvaluator(segment.models, bitpos, m_baseprob, m_saturate, segment.capacity) : nullptr);
+	}
+	segment.acceptedSize = 0;
+}
+
+int IncrementalEvaluator4k::Evaluate(const unsigned char* inputData, const int* segmentSizes, int* outCompressedSegmentSizes) {
+	int numSegments = (int)m_segments.size();
+	int segmentOffset = 0;
+	for (int i = 0; i < numSegments; i++) {
+		Segment& segment = m_segments[i];
+		int size = segmentSizes[i];
+		Reserve(segment, size);
+
+		unsigned char* data = segment.data.data();
+		for (int j = 0; j < MAX_CONTEXT_LENGTH; j++) {
+			int srcpos = segmentOffset - MAX_CONTEXT_LENGTH + j;
+			data[j] = srcpos >= 0 ? inputData[srcpos] : 0;
+		}
+		memcpy(data + MAX_CONTEXT_LENGTH, inputData + segmentOffset, size);
+		memset(data + MAX_CONTEXT_LENGTH + size, 0, 16);
+		segment.size = size;
+
+		// A changed byte changes the contexts of the following MAX_CONTEXT_LENGTH positions
+		int length = MAX_CONTEXT_LENGTH + std::min(size, segment.acceptedSize);
+		segment.firstChanged = 0;
+		if (segment.acceptedData.size() >= (size_t)length) {
+			int firstDifference = int(std::mismatch(data, data + length, segment.acceptedData.data()).first - data);
+			segment.firstChanged = std::max(0, firstDifference - MAX_CONTEXT_LENGTH);
+		}
+
+		segmentOffset += size;
+	}
+
+	for (Segment& segment : m_segments) {
+		segment.journaled = m_incremental && segment.bitEvaluators[0]->IsCheaperThanFull(segment.size, segment.firstChanged);
+	}
+
+	std::vector<long long> compressedSizes(numSegments * 8);
+	ParallelFor(0, numSegments * 8, [&](int i) {
+		Segment& segment = m_segments[i >> 3];
+		int bitpos = i & 7;
+		if (segment.journaled) {
+			compressedSizes[i] = segment.bitEvaluators[bitpos]->Evaluate(segment.data.data() + MAX_CONTEXT_LENGTH, segment.size, segment.firstChanged);
+		} else {
+			CompressionStream cs(NULL, NULL, 0, m_saturate);
+			compressedSizes[i] = cs.EvaluateSize(segment.data.data() + MAX_CONTEXT_LENGTH, segment.size, segment.models, m_baseprob, (char*)segment.data.data(), bitpos);
+		}
+	});
+
+	int totalSize = 0;
+	for (int i = 0; i < numSegments; i++) {
+		int segmentSize = m_segments[i].models.nmodels * 8 * BIT_PRECISION;
+		for (int j = 0; j < 8; j++)
+			segmentSize += (int)compressedSizes[i * 8 + j];
+		totalSize += segmentSize;
+
+		if (outCompressedSegmentSizes)
+			outCompressedSegmentSizes[i] = segmentSize;
+	}
+	return totalSize;
+}
+
+void IncrementalEvaluator4k::Accept() {
+	for (Segment& segment : m_segments) {
+		if (m_incremental) {
+			// Segments evaluated in full are journaled now, which is rare as most tries are rejected
+			ParallelFor(0, 8, [&](int bitpos) {
+				IncrementalBitEvaluator& bitEvaluator = *segment.bitEvaluators[bitpos];
+				if (!segment.journaled)
+					bitEvaluator.Evaluate(segment.data.data() + MAX_CONTEXT_LENGTH, segment.size, segment.firstChanged);
+				bitEvaluator.Accept();
+			});
+		}
+		segment.acceptedData.swap(segment.data);
+		segment.acceptedSize = segment.size;
+	}
+}
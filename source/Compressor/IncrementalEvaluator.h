@@ -0,0 +1,46 @@
+#pragma once
+#ifndef _INCREMENTAL_EVALUATOR_H_
+#define _INCREMENTAL_EVALUATOR_H_
+
+#include <memory>
+#include <vector>
+
+#include "ModelList.h"
+
+class IncrementalBitEvaluator;
+
+static const long long MAX_INCREMENTAL_MEMORY = 256 * 1024 * 1024;
+
+// EvaluateSize4k for data that changes a little between evaluations, such as during hunk reordering.
+// The model states of every position of the accepted data are journaled, so an evaluation can resume
+// from the first byte of each segment that differs from the accepted data. Segments changed near
+// their start are evaluated in full instead. The sizes are identical to those of EvaluateSize4k.
+class IncrementalEvaluator4k {
+	struct Segment {
+		ModelList4k				models;
+		std::vector<unsigned char>	acceptedData;	// Context, data and padding for 128-bit loads
+		std::vector<unsigned char>	data;
+		int						acceptedSize;
+		int						size;
+		int						firstChanged;
+		bool					journaled;		// Evaluated incrementally rather than in full
+		int						capacity;
+		std::unique_ptr<IncrementalBitEvaluator>	bitEvaluators[8];
+	};
+
+	std::vector<Segment>	m_segments;
+	int						m_baseprob;
+	bool					m_saturate;
+	long long				m_maxMemory;
+	bool					m_incremental;	// False if the journals would take more than m_maxMemory
+
+	void	Reserve(Segment& segment, int size);
+public:
+	IncrementalEvaluator4k(int numSegments, ModelList4k** modelLists, int baseprob, bool saturate, long long maxMemory = MAX_INCREMENTAL_MEMORY);
+	~IncrementalEvaluator4k();
+
+	int		Evaluate(const unsigned char* inputData, const int* segmentSizes, int* outCompressedSegmentSizes);
+	void	Accept();		// Makes the data of the last evaluation the base of the following ones
+};
+
+#endif
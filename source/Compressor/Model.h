@@ -0,0 +1,31 @@
+#pragma once
+#ifndef _MODEL_
+#define _MODEL_
+
+#include <cstdint>
+#include <emmintrin.h>
+#include "Platform.h"
+
+const int HASH_MULTIPLIER = 111;
+
+inline int GetBit(const unsigned char *data, int bitpos) {
+	return (data[bitpos >> 3] >> (7 - bitpos & 7)) & 1;
+}
+
+unsigned int ModelHashStart(unsigned int mask, int hashmul);
+unsigned int ModelHash(const unsigned char* data, int bitpos, unsigned int mask, int hashmul);
+
+// Hash of a masked 16-byte context window, for power-of-two tables
+__forceinline uint32_t ContextHash(const __m128i& masked_contextdata)
+{
+	__m128i scrambler = _mm_set_epi8(113, 23, 5, 17, 13, 11, 7, 19, 3, 23, 29, 31, 37, 41, 43, 47);
+	
+	__m128i sample = _mm_madd_epi16(masked_contextdata, scrambler);
+	sample = _mm_add_epi32(_mm_add_epi32(sample, _mm_shuffle_epi32(sample, _MM_SHUFFLE(1, 1, 1, 1))), _mm_shuffle_epi32(sample, _MM_SHUFFLE(2, 2, 2, 2)));
+	uint32_t hash = _mm_cvtsi128_si32(sample);
+
+	uint64_t tmp = (uint64_t)hash * 0xd451151b;
+	return (uint32_t)tmp ^ uint32_t(tmp >> 32);
+}
+
+#endif
\ No newline at end of file
@@ -1,4 +1,5 @@
 #include <memory>
+#include <cstring>
 #include <cassert>
 #include "ModelList.h"
 #include "Compressor.h"
@@ -0,0 +1,66 @@
+#pragma once
+#ifndef _PLATFORM_H_
+#define _PLATFORM_H_
+
+// Maps the handful of MSVC specific intrinsics and keywords used by the compressor
+// to their GCC/Clang equivalents, so the library builds unchanged on Linux.
+
+#include <cstdlib>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#include <malloc.h>
+
+// Functions using instruction sets beyond SSE2 are compiled for them explicitly
+#define TARGET_AVX2
+#define TARGET_AVX512
+
+inline void CpuId(int info[4], int leaf, int subleaf) {
+	__cpuidex(info, leaf, subleaf);
+}
+
+inline unsigned long long XGetBV(unsigned int index) {
+	return _xgetbv(index);
+}
+#else
+#include <x86intrin.h>
+#include <cpuid.h>
+
+#define TARGET_AVX2		__attribute__((target("avx2")))
+#define TARGET_AVX512	__attribute__((target("avx2,avx512f")))
+
+inline void CpuId(int info[4], int leaf, int subleaf) {
+	unsigned int a, b, c, d;
+	__cpuid_count(leaf, subleaf, a, b, c, d);
+	info[0] = a; info[1] = b; info[2] = c; info[3] = d;
+}
+
+inline unsigned long long XGetBV(unsigned int index) {
+	unsigned int eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(index));
+	return ((unsigned long long)edx << 32) | eax;
+}
+
+#define __forceinline	inline __attribute__((always_inline))
+#define __cdecl
+
+inline void* _aligned_malloc(size_t size, size_t alignment) {
+	void* ptr = nullptr;
+	if (posix_memalign(&ptr, alignment < sizeof(void*) ? sizeof(void*) : alignment, size) != 0)
+		return nullptr;
+	return ptr;
+}
+
+inline void _aligned_free(void* ptr) {
+	free(ptr);
+}
+
+inline unsigned char _BitScanReverse(unsigned long* index, unsigned long mask) {
+	if (mask == 0)
+		return 0;
+	*index = 63 - __builtin_clzll(mask);
+	return 1;
+}
+#endif
+
+#endif
@@ -0,0 +1,156 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <deque>
+
+struct ThreadPool::Job {
+	const std::function<void(int)>*	body;
+	std::atomic<int>				remaining;
+	std::function<void(int)>		spawnedBody;	// Owned by spawned jobs, which nobody waits for
+	bool							spawned = false;
+};
+
+struct ThreadPool::Task {
+	Job*	job;
+	int		begin;
+	int		end;
+};
+
+struct ThreadPool::Queue {
+	std::mutex			mutex;
+	std::deque<Task>	tasks;
+};
+
+static thread_local int t_workerIndex = -1;
+
+ThreadPool::ThreadPool(int numThreads) :
+	m_numQueues(numThreads), m_numQueuedTasks(0)
+{
+	// Queue numThreads-1 is shared by all threads not owned by the pool
+	m_queues.reset(new Queue[m_numQueues]);
+	for (int i = 0; i < numThreads - 1; i++) {
+		m_threads.emplace_back(&ThreadPool::WorkerLoop, this, i);
+	}
+}
+
+ThreadPool& ThreadPool::Instance() {
+	// Intentionally never destroyed: worker threads may still be parked at process exit.
+	static ThreadPool* pool = new ThreadPool(std::max(1, (int)std::thread::hardware_concurrency()));
+	return *pool;
+}
+
+void ThreadPool::WakeAll() {
+	{ std::lock_guard<std::mutex> lock(m_sleepMutex); }
+	m_wakeup.notify_all();
+}
+
+void ThreadPool::Push(int queueIndex, const Task& task) {
+	{
+		std::lock_guard<std::mutex> lock(m_queues[queueIndex].mutex);
+		m_queues[queueIndex].tasks.push_back(task);
+	}
+	m_numQueuedTasks++;
+	{ std::lock_guard<std::mutex> lock(m_sleepMutex); }
+	m_wakeup.notify_one();
+}
+
+bool ThreadPool::TryGetTask(int queueIndex, Task& task) {
+	// Newest task from own queue first, then the oldest (largest) task of the other queues
+	{
+		Queue& queue = m_queues[queueIndex];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.back();
+			queue.tasks.pop_back();
+			m_numQueuedTasks--;
+			return true;
+		}
+	}
+	for (int i = 1; i < m_numQueues; i++) {
+		Queue& queue = m_queues[(queueIndex + i) % m_numQueues];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		if (!queue.tasks.empty()) {
+			task = queue.tasks.front();
+			queue.tasks.pop_front();
+			m_numQueuedTasks--;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::Execute(Task task, int queueIndex) {
+	// Leave the upper halves for thieves and run the first index
+	while (task.end - task.begin > 1) {
+		int mid = task.begin + (task.end - task.begin) / 2;
+		Push(queueIndex, { task.job, mid, task.end });
+		task.end = mid;
+	}
+
+	// A finished ParallelFor job may be gone as soon as remaining drops to zero
+	Job* job = task.job;
+	bool spawned = job->spawned;
+	(*job->body)(task.begin);
+	if (--job->remaining == 0) {
+		if (spawned)
+			delete job;
+		else
+			WakeAll();
+	}
+}
+
+void ThreadPool::WorkerLoop(int queueIndex) {
+	t_workerIndex = queueIndex;
+	while (true) {
+		Task task;
+		if (TryGetTask(queueIndex, task)) {
+			Execute(task, queueIndex);
+		} else {
+			std::unique_lock<std::mutex> lock(m_sleepMutex);
+			m_wakeup.wait(lock, [this]() { return m_numQueuedTasks > 0; });
+		}
+	}
+}
+
+void ThreadPool::Spawn(std::function<void()> task) {
+	if (m_threads.empty()) {
+		task();
+		return;
+	}
+
+	Job* job = new Job;
+	job->spawnedBody = [task = std::move(task)](int) { task(); };
+	job->body = &job->spawnedBody;
+	job->remaining = 1;
+	job->spawned = true;
+	Push(t_workerIndex >= 0 ? t_workerIndex : m_numQueues - 1, { job, 0, 1 });
+}
+
+void ThreadPool::ParallelFor(int begin, int end, const std::function<void(int)>& body) {
+	if (end - begin <= 0)
+		return;
+
+	if (m_threads.empty() || end - begin == 1) {
+		for (int i = begin; i < end; i++)
+			body(i);
+		return;
+	}
+
+	Job job;
+	job.body = &body;
+	job.remaining = end - begin;
+
+	int queueIndex = t_workerIndex >= 0 ? t_workerIndex : m_numQueues - 1;
+	Push(queueIndex, { &job, begin, end });
+
+	// Help out until every index of this loop has been executed
+	while (job.remaining > 0) {
+		Task task;
+		if (TryGetTask(queueIndex, task)) {
+			Execute(task, queueIndex);
+		} else {
+			std::unique_lock<std::mutex> lock(m_sleepMutex);
+			m_wakeup.wait(lock, [&]() { return job.remaining == 0 || m_numQueuedTasks > 0; });
+		}
+	}
+}
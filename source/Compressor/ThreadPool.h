@@ -0,0 +1,53 @@
+#pragma once
+#ifndef _THREAD_POOL_H_
+#define _THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Portable work-stealing thread pool running the parallel loops of the compressor.
+// Every worker owns a task queue. Ranges are split lazily: the owner keeps working on
+// the lower half while idle workers steal the largest remaining ranges from the front.
+// The thread calling ParallelFor helps executing tasks until its own loop is done,
+// so parallel loops can be nested freely.
+class ThreadPool {
+	struct Job;
+	struct Task;
+	struct Queue;
+
+	std::vector<std::thread>	m_threads;
+	std::unique_ptr<Queue[]>	m_queues;			// One per worker plus a shared one for external threads
+	int							m_numQueues;
+	std::atomic<int>			m_numQueuedTasks;
+	std::mutex					m_sleepMutex;
+	std::condition_variable		m_wakeup;
+
+	void	Push(int queueIndex, const Task& task);
+	bool	TryGetTask(int queueIndex, Task& task);
+	void	Execute(Task task, int queueIndex);
+	void	WakeAll();
+	void	WorkerLoop(int queueIndex);
+
+	explicit ThreadPool(int numThreads);
+public:
+	static ThreadPool&	Instance();
+
+	int		GetNumThreads() const	{ return (int)m_threads.size() + 1; }
+	void	ParallelFor(int begin, int end, const std::function<void(int)>& body);
+
+	// Queues a task without waiting for it. Without worker threads, the task runs on the calling thread.
+	void	Spawn(std::function<void()> task);
+};
+
+// Calls body(i) for every i in [begin, end) on the shared compressor thread pool.
+template<class Body>
+inline void ParallelFor(int begin, int end, const Body& body) {
+	ThreadPool::Instance().ParallelFor(begin, end, std::function<void(int)>(body));
+}
+
+#endif
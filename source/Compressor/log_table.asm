@@ -1,520 +0,0 @@
-	global	LogTable
-	global	_LogTable
-
-	section	logtable data
-
-LogTable:
-_LogTable:
-
-dd      0,-49151,-45055,-42659,-40959,-39640,-38563,-37652,-36863,-36167,-35544,-34981,-34467,-33994,-33556,-33148
-dd -32767,-32409,-32071,-31751,-31448,-31160,-30885,-30622,-30371,-30130,-29898,-29675,-29460,-29253,-29052,-28859
-dd -28671,-28489,-28313,-28141,-27975,-27813,-27655,-27502,-27352,-27206,-27064,-26925,-26789,-26656,-26526,-26399
-dd -26275,-26153,-26034,-25917,-25802,-25689,-25579,-25471,-25364,-25259,-25157,-25056,-24956,-24859,-24763,-24668
-dd -24575,-24483,-24393,-24304,-24217,-24130,-24045,-23962,-23879,-23797,-23717,-23638,-23559,-23482,-23406,-23331
-dd -23256,-23183,-23110,-23039,-22968,-22898,-22829,-22761,-22693,-22626,-22560,-22495,-22430,-22367,-22303,-22241
-dd -22179,-22118,-22057,-21997,-21938,-21879,-21821,-21763,-21706,-21649,-21593,-21538,-21483,-21429,-21375,-21321
-dd -21268,-21216,-21163,-21112,-21061,-21010,-20960,-20910,-20860,-20811,-20763,-20714,-20667,-20619,-20572,-20525
-dd -20479,-20433,-20387,-20342,-20297,-20253,-20208,-20164,-20121,-20077,-20034,-19992,-19949,-19907,-19866,-19824
-dd -19783,-19742,-19701,-19661,-19621,-19581,-19542,-19502,-19463,-19425,-19386,-19348,-19310,-19272,-19235,-19197
-dd -19160,-19124,-19087,-19051,-19014,-18979,-18943,-18907,-18872,-18837,-18802,-18767,-18733,-18699,-18665,-18631
-dd -18597,-18564,-18530,-18497,-18464,-18432,-18399,-18367,-18334,-18302,-18271,-18239,-18207,-18176,-18145,-18114
-dd -18083,-18052,-18022,-17991,-17961,-17931,-17901,-17871,-17842,-17812,-17783,-17754,-17725,-17696,-17667,-17638
-dd -17610,-17582,-17553,-17525,-17497,-17470,-17442,-17414,-17387,-17360,-17333,-17305,-17279,-17252,-17225,-17199
-dd -17172,-17146,-17120,-17093,-17067,-17042,-17016,-16990,-16965,-16939,-16914,-16889,-16864,-16839,-16814,-16789
-dd -16764,-16740,-16715,-16691,-16667,-16643,-16618,-16594,-16571,-16547,-16523,-16500,-16476,-16453,-16429,-16406
-dd -16383,-16360,-16337,-16314,-16291,-16269,-16246,-16224,-16201,-16179,-16157,-16134,-16112,-16090,-16068,-16047
-dd -16025,-16003,-15981,-15960,-15938,-15917,-15896,-15875,-15853,-15832,-15811,-15790,-15770,-15749,-15728,-15708
-dd -15687,-15667,-15646,-15626,-15605,-15585,-15565,-15545,-15525,-15505,-15485,-15465,-15446,-15426,-15406,-15387
-dd -15367,-15348,-15329,-15309,-15290,-15271,-15252,-15233,-15214,-15195,-15176,-15157,-15139,-15120,-15101,-15083
-dd -15064,-15046,-15028,-15009,-14991,-14973,-14955,-14937,-14918,-14900,-14883,-14865,-14847,-14829,-14811,-14794
-dd -14776,-14759,-14741,-14724,-14706,-14689,-14671,-14654,-14637,-14620,-14603,-14586,-14569,-14552,-14535,-14518
-dd -14501,-14484,-14468,-14451,-14434,-14418,-14401,-14385,-14368,-14352,-14336,-14319,-14303,-14287,-14271,-14255
-dd -14238,-14222,-14206,-14191,-14175,-14159,-14143,-14127,-14111,-14096,-14080,-14064,-14049,-14033,-14018,-14002
-dd -13987,-13972,-13956,-13941,-13926,-13911,-13895,-13880,-13865,-13850,-13835,-13820,-13805,-13790,-13775,-13761
-dd -13746,-13731,-13716,-13702,-13687,-13672,-13658,-13643,-13629,-13614,-13600,-13585,-13571,-13557,-13542,-13528
-dd -13514,-13500,-13486,-13472,-13457,-13443,-13429,-13415,-13401,-13388,-13374,-13360,-13346,-13332,-13318,-13305
-dd -13291,-13277,-13264,-13250,-13237,-13223,-13209,-13196,-13183,-13169,-13156,-13142,-13129,-13116,-13103,-13089
-dd -13076,-13063,-13050,-13037,-13024,-13010,-12997,-12984,-12971,-12959,-12946,-12933,-12920,-12907,-12894,-12881
-dd -12869,-12856,-12843,-12831,-12818,-12805,-12793,-12780,-12768,-12755,-12743,-12730,-12718,-12705,-12693,-12681
-dd -12668,-12656,-12644,-12632,-12619,-12607,-12595,-12583,-12571,-12559,-12547,-12534,-12522,-12510,-12498,-12487
-dd -12475,-12463,-12451,-12439,-12427,-12415,-12404,-12392,-12380,-12368,-12357,-12345,-12333,-12322,-12310,-12299
-dd -12287,-12275,-12264,-12252,-12241,-12230,-12218,-12207,-12195,-12184,-12173,-12161,-12150,-12139,-12128,-12116
-dd -12105,-12094,-12083,-12072,-12061,-12049,-12038,-12027,-12016,-12005,-11994,-11983,-11972,-11961,-11951,-11940
-dd -11929,-11918,-11907,-11896,-11885,-11875,-11864,-11853,-11842,-11832,-11821,-11810,-11800,-11789,-11779,-11768
-dd -11757,-11747,-11736,-11726,-11715,-11705,-11694,-11684,-11674,-11663,-11653,-11643,-11632,-11622,-11612,-11601
-dd -11591,-11581,-11571,-11560,-11550,-11540,-11530,-11520,-11509,-11499,-11489,-11479,-11469,-11459,-11449,-11439
-dd -11429,-11419,-11409,-11399,-11389,-11379,-11369,-11360,-11350,-11340,-11330,-11320,-11310,-11301,-11291,-11281
-dd -11271,-11262,-11252,-11242,-11233,-11223,-11213,-11204,-11194,-11185,-11175,-11166,-11156,-11146,-11137,-11127
-dd -11118,-11109,-11099,-11090,-11080,-11071,-11061,-11052,-11043,-11033,-11024,-11015,-11005,-10996,-10987,-10978
-dd -10968,-10959,-10950,-10941,-10932,-10922,-10913,-10904,-10895,-10886,-10877,-10868,-10859,-10850,-10841,-10831
-dd -10822,-10813,-10804,-10796,-10787,-10778,-10769,-10760,-10751,-10742,-10733,-10724,-10715,-10707,-10698,-10689
-dd -10680,-10671,-10663,-10654,-10645,-10636,-10628,-10619,-10610,-10601,-10593,-10584,-10575,-10567,-10558,-10550
-dd -10541,-10532,-10524,-10515,-10507,-10498,-10490,-10481,-10473,-10464,-10456,-10447,-10439,-10430,-10422,-10414
-dd -10405,-10397,-10388,-10380,-10372,-10363,-10355,-10347,-10338,-10330,-10322,-10314,-10305,-10297,-10289,-10281
-dd -10272,-10264,-10256,-10248,-10240,-10231,-10223,-10215,-10207,-10199,-10191,-10183,-10175,-10167,-10159,-10151
-dd -10142,-10134,-10126,-10118,-10110,-10102,-10095,-10087,-10079,-10071,-10063,-10055,-10047,-10039,-10031,-10023
-dd -10015,-10008,-10000, -9992, -9984, -9976, -9968, -9961, -9953, -9945, -9937, -9930, -9922, -9914, -9906, -9899
-dd  -9891, -9883, -9876, -9868, -9860, -9853, -9845, -9837, -9830, -9822, -9815, -9807, -9799, -9792, -9784, -9777
-dd  -9769, -9762, -9754, -9747, -9739, -9732, -9724, -9717, -9709, -9702, -9694, -9687, -9679, -9672, -9665, -9657
-dd  -9650, -9642, -9635, -9628, -9620, -9613, -9606, -9598, -9591, -9584, -9576, -9569, -9562, -9555, -9547, -9540
-dd  -9533, -9526, -9518, -9511, -9504, -9497, -9489, -9482, -9475, -9468, -9461, -9454, -9446, -9439, -9432, -9425
-dd  -9418, -9411, -9404, -9397, -9390, -9383, -9376, -9368, -9361, -9354, -9347, -9340, -9333, -9326, -9319, -9312
-dd  -9305, -9298, -9292, -9285, -9278, -9271, -9264, -9257, -9250, -9243, -9236, -9229, -9222, -9216, -9209, -9202
-dd  -9195, -9188, -9181, -9174, -9168, -9161, -9154, -9147, -9141, -9134, -9127, -9120, -9113, -9107, -9100, -9093
-dd  -9087, -9080, -9073, -9066, -9060, -9053, -9046, -9040, -9033, -9026, -9020, -9013, -9007, -9000, -8993, -8987
-dd  -8980, -8973, -8967, -8960, -8954, -8947, -8941, -8934, -8928, -8921, -8914, -8908, -8901, -8895, -8888, -8882
-dd  -8875, -8869, -8863, -8856, -8850, -8843, -8837, -8830, -8824, -8817, -8811, -8805, -8798, -8792, -8785, -8779
-dd  -8773, -8766, -8760, -8754, -8747, -8741, -8735, -8728, -8722, -8716, -8709, -8703, -8697, -8691, -8684, -8678
-dd  -8672, -8665, -8659, -8653, -8647, -8640, -8634, -8628, -8622, -8616, -8609, -8603, -8597, -8591, -8585, -8579
-dd  -8572, -8566, -8560, -8554, -8548, -8542, -8536, -8529, -8523, -8517, -8511, -8505, -8499, -8493, -8487, -8481
-dd  -8475, -8469, -8463, -8457, -8451, -8445, -8438, -8432, -8426, -8420, -8414, -8408, -8402, -8397, -8391, -8385
-dd  -8379, -8373, -8367, -8361, -8355, -8349, -8343, -8337, -8331, -8325, -8319, -8313, -8308, -8302, -8296, -8290
-dd  -8284, -8278, -8272, -8267, -8261, -8255, -8249, -8243, -8237, -8232, -8226, -8220, -8214, -8208, -8203, -8197
-dd  -8191, -8185, -8179, -8174, -8168, -8162, -8156, -8151, -8145, -8139, -8134, -8128, -8122, -8116, -8111, -8105
-dd  -8099, -8094, -8088, -8082, -8077, -8071, -8065, -8060, -8054, -8048, -8043, -8037, -8032, -8026, -8020, -8015
-dd  -8009, -8004, -7998, -7992, -7987, -7981, -7976, -7970, -7965, -7959, -7953, -7948, -7942, -7937, -7931, -7926
-dd  -7920, -7915, -7909, -7904, -7898, -7893, -7887, -7882, -7876, -7871, -7865, -7860, -7855, -7849, -7844, -7838
-dd  -7833, -7827, -7822, -7816, -7811, -7806, -7800, -7795, -7789, -7784, -7779, -7773, -7768, -7763, -7757, -7752
-dd  -7746, -7741, -7736, -7730, -7725, -7720, -7714, -7709, -7704, -7699, -7693, -7688, -7683, -7677, -7672, -7667
-dd  -7661, -7656, -7651, -7646, -7640, -7635, -7630, -7625, -7619, -7614, -7609, -7604, -7598, -7593, -7588, -7583
-dd  -7578, -7572, -7567, -7562, -7557, -7552, -7547, -7541, -7536, -7531, -7526, -7521, -7516, -7510, -7505, -7500
-dd  -7495, -7490, -7485, -7480, -7475, -7469, -7464, -7459, -7454, -7449, -7444, -7439, -7434, -7429, -7424, -7419
-dd  -7413, -7408, -7403, -7398, -7393, -7388, -7383, -7378, -7373, -7368, -7363, -7358, -7353, -7348, -7343, -7338
-dd  -7333, -7328, -7323, -7318, -7313, -7308, -7303, -7298, -7293, -7288, -7283, -7278, -7273, -7269, -7264, -7259
-dd  -7254, -7249, -7244, -7239, -7234, -7229, -7224, -7219, -7214, -7210, -7205, -7200, -7195, -7190, -7185, -7180
-dd  -7175, -7171, -7166, -7161, -7156, -7151, -7146, -7142, -7137, -7132, -7127, -7122, -7117, -7113, -7108, -7103
-dd  -7098, -7093, -7089, -7084, -7079, -7074, -7070, -7065, -7060, -7055, -7050, -7046, -7041, -7036, -7031, -7027
-dd  -7022, -7017, -7013, -7008, -7003, -6998, -6994, -6989, -6984, -6980, -6975, -6970, -6965, -6961, -6956, -6951
-dd  -6947, -6942, -6937, -6933, -6928, -6923, -6919, -6914, -6909, -6905, -6900, -6896, -6891, -6886, -6882, -6877
-dd  -6872, -6868, -6863, -6859, -6854, -6849, -6845, -6840, -6836, -6831, -6826, -6822, -6817, -6813, -6808, -6804
-dd  -6799, -6794, -6790, -6785, -6781, -6776, -6772, -6767, -6763, -6758, -6754, -6749, -6745, -6740, -6735, -6731
-dd  -6726, -6722, -6717, -6713, -6708, -6704, -6700, -6695, -6691, -6686, -6682, -6677, -6673, -6668, -6664, -6659
-dd  -6655, -6650, -6646, -6642, -6637, -6633, -6628, -6624, -6619, -6615, -6611, -6606, -6602, -6597, -6593, -6588
-dd  -6584, -6580, -6575, -6571, -6567, -6562, -6558, -6553, -6549, -6545, -6540, -6536, -6532, -6527, -6523, -6518
-dd  -6514, -6510, -6505, -6501, -6497, -6492, -6488, -6484, -6479, -6475, -6471, -6467, -6462, -6458, -6454, -6449
-dd  -6445, -6441, -6436, -6432, -6428, -6424, -6419, -6415, -6411, -6406, -6402, -6398, -6394, -6389, -6385, -6381
-dd  -6377, -6372, -6368, -6364, -6360, -6356, -6351, -6347, -6343, -6339, -6334, -6330, -6326, -6322, -6318, -6313
-dd  -6309, -6305, -6301, -6297, -6292, -6288, -6284, -6280, -6276, -6272, -6267, -6263, -6259, -6255, -6251, -6247
-dd  -6242, -6238, -6234, -6230, -6226, -6222, -6218, -6213, -6209, -6205, -6201, -6197, -6193, -6189, -6185, -6180
-dd  -6176, -6172, -6168, -6164, -6160, -6156, -6152, -6148, -6144, -6140, -6135, -6131, -6127, -6123, -6119, -6115
-dd  -6111, -6107, -6103, -6099, -6095, -6091, -6087, -6083, -6079, -6075, -6071, -6067, -6063, -6059, -6055, -6051
-dd  -6046, -6042, -6038, -6034, -6030, -6026, -6022, -6018, -6014, -6010, -6006, -6002, -5999, -5995, -5991, -5987
-dd  -5983, -5979, -5975, -5971, -5967, -5963, -5959, -5955, -5951, -5947, -5943, -5939, -5935, -5931, -5927, -5923
-dd  -5919, -5915, -5912, -5908, -5904, -5900, -5896, -5892, -5888, -5884, -5880, -5876, -5872, -5869, -5865, -5861
-dd  -5857, -5853, -5849, -5845, -5841, -5837, -5834, -5830, -5826, -5822, -5818, -5814, -5810, -5807, -5803, -5799
-dd  -5795, -5791, -5787, -5783, -5780, -5776, -5772, -5768, -5764, -5760, -5757, -5753, -5749, -5745, -5741, -5738
-dd  -5734, -5730, -5726, -5722, -5719, -5715, -5711, -5707, -5703, -5700, -5696, -5692, -5688, -5684, -5681, -5677
-dd  -5673, -5669, -5666, -5662, -5658, -5654, -5651, -5647, -5643, -5639, -5636, -5632, -5628, -5624, -5621, -5617
-dd  -5613, -5609, -5606, -5602, -5598, -5595, -5591, -5587, -5583, -5580, -5576, -5572, -5569, -5565, -5561, -5557
-dd  -5554, -5550, -5546, -5543, -5539, -5535, -5532, -5528, -5524, -5521, -5517, -5513, -5510, -5506, -5502, -5499
-dd  -5495, -5491, -5488, -5484, -5480, -5477, -5473, -5469, -5466, -5462, -5459, -5455, -5451, -5448, -5444, -5440
-dd  -5437, -5433, -5430, -5426, -5422, -5419, -5415, -5411, -5408, -5404, -5401, -5397, -5393, -5390, -5386, -5383
-dd  -5379, -5376, -5372, -5368, -5365, -5361, -5358, -5354, -5350, -5347, -5343, -5340, -5336, -5333, -5329, -5326
-dd  -5322, -5318, -5315, -5311, -5308, -5304, -5301, -5297, -5294, -5290, -5287, -5283, -5280, -5276, -5272, -5269
-dd  -5265, -5262, -5258, -5255, -5251, -5248, -5244, -5241, -5237, -5234, -5230, -5227, -5223, -5220, -5216, -5213
-dd  -5209, -5206, -5202, -5199, -5196, -5192, -5189, -5185, -5182, -5178, -5175, -5171, -5168, -5164, -5161, -5157
-dd  -5154, -5151, -5147, -5144, -5140, -5137, -5133, -5130, -5126, -5123, -5120, -5116, -5113, -5109, -5106, -5102
-dd  -5099, -5096, -5092, -5089, -5085, -5082, -5078, -5075, -5072, -5068, -5065, -5061, -5058, -5055, -5051, -5048
-dd  -5045, -5041, -5038, -5034, -5031, -5028, -5024, -5021, -5017, -5014, -5011, -5007, -5004, -5001, -4997, -4994
-dd  -4991, -4987, -4984, -4980, -4977, -4974, -4970, -4967, -4964, -4960, -4957, -4954, -4950, -4947, -4944, -4940
-dd  -4937, -4934, -4930, -4927, -4924, -4920, -4917, -4914, -4911, -4907, -4904, -4901, -4897, -4894, -4891, -4887
-dd  -4884, -4881, -4877, -4874, -4871, -4868, -4864, -4861, -4858, -4854, -4851, -4848, -4845, -4841, -4838, -4835
-dd  -4832, -4828, -4825, -4822, -4818, -4815, -4812, -4809, -4805, -4802, -4799, -4796, -4792, -4789, -4786, -4783
-dd  -4779, -4776, -4773, -4770, -4767, -4763, -4760, -4757, -4754, -4750, -4747, -4744, -4741, -4738, -4734, -4731
-dd  -4728, -4725, -4721, -4718, -4715, -4712, -4709, -4705, -4702, -4699, -4696, -4693, -4689, -4686, -4683, -4680
-dd  -4677, -4674, -4670, -4667, -4664, -4661, -4658, -4654, -4651, -4648, -4645, -4642, -4639, -4635, -4632, -4629
-dd  -4626, -4623, -4620, -4617, -4613, -4610, -4607, -4604, -4601, -4598, -4595, -4591, -4588, -4585, -4582, -4579
-dd  -4576, -4573, -4569, -4566, -4563, -4560, -4557, -4554, -4551, -4548, -4544, -4541, -4538, -4535, -4532, -4529
-dd  -4526, -4523, -4520, -4517, -4513, -4510, -4507, -4504, -4501, -4498, -4495, -4492, -4489, -4486, -4483, -4479
-dd  -4476, -4473, -4470, -4467, -4464, -4461, -4458, -4455, -4452, -4449, -4446, -4443, -4440, -4437, -4433, -4430
-dd  -4427, -4424, -4421, -4418, -4415, -4412, -4409, -4406, -4403, -4400, -4397, -4394, -4391, -4388, -4385, -4382
-dd  -4379, -4376, -4373, -4370, -4367, -4364, -4361, -4358, -4355, -4352, -4349, -4345, -4342, -4339, -4336, -4333
-dd  -4330, -4327, -4324, -4321, -4318, -4315, -4312, -4309, -4306, -4303, -4301, -4298, -4295, -4292, -4289, -4286
-dd  -4283, -4280, -4277, -4274, -4271, -4268, -4265, -4262, -4259, -4256, -4253, -4250, -4247, -4244, -4241, -4238
-dd  -4235, -4232, -4229, -4226, -4223, -4220, -4217, -4215, -4212, -4209, -4206, -4203, -4200, -4197, -4194, -4191
-dd  -4188, -4185, -4182, -4179, -4176, -4173, -4171, -4168, -4165, -4162, -4159, -4156, -4153, -4150, -4147, -4144
-dd  -4141, -4138, -4136, -4133, -4130, -4127, -4124, -4121, -4118, -4115, -4112, -4109, -4107, -4104, -4101, -4098
-dd  -4095, -4092, -4089, -4086, -4083, -4081, -4078, -4075, -4072, -4069, -4066, -4063, -4060, -4058, -4055, -4052
-dd  -4049, -4046, -4043, -4040, -4038, -4035, -4032, -4029, -4026, -4023, -4020, -4018, -4015, -4012, -4009, -4006
-dd  -4003, -4001, -3998, -3995, -3992, -3989, -3986, -3984, -3981, -3978, -3975, -3972, -3969, -3967, -3964, -3961
-dd  -3958, -3955, -3952, -3950, -3947, -3944, -3941, -3938, -3936, -3933, -3930, -3927, -3924, -3922, -3919, -3916
-dd  -3913, -3910, -3908, -3905, -3902, -3899, -3896, -3894, -3891, -3888, -3885, -3882, -3880, -3877, -3874, -3871
-dd  -3869, -3866, -3863, -3860, -3857, -3855, -3852, -3849, -3846, -3844, -3841, -3838, -3835, -3833, -3830, -3827
-dd  -3824, -3822, -3819, -3816, -3813, -3811, -3808, -3805, -3802, -3800, -3797, -3794, -3791, -3789, -3786, -3783
-dd  -3780, -3778, -3775, -3772, -3769, -3767, -3764, -3761, -3759, -3756, -3753, -3750, -3748, -3745, -3742, -3739
-dd  -3737, -3734, -3731, -3729, -3726, -3723, -3720, -3718, -3715, -3712, -3710, -3707, -3704, -3702, -3699, -3696
-dd  -3693, -3691, -3688, -3685, -3683, -3680, -3677, -3675, -3672, -3669, -3667, -3664, -3661, -3659, -3656, -3653
-dd  -3650, -3648, -3645, -3642, -3640, -3637, -3634, -3632, -3629, -3626, -3624, -3621, -3618, -3616, -3613, -3610
-dd  -3608, -3605, -3603, -3600, -3597, -3595, -3592, -3589, -3587, -3584, -3581, -3579, -3576, -3573, -3571, -3568
-dd  -3565, -3563, -3560, -3558, -3555, -3552, -3550, -3547, -3544, -3542, -3539, -3537, -3534, -3531, -3529, -3526
-dd  -3523, -3521, -3518, -3516, -3513, -3510, -3508, -3505, -3502, -3500, -3497, -3495, -3492, -3489, -3487, -3484
-dd  -3482, -3479, -3476, -3474, -3471, -3469, -3466, -3463, -3461, -3458, -3456, -3453, -3451, -3448, -3445, -3443
-dd  -3440, -3438, -3435, -3432, -3430, -3427, -3425, -3422, -3420, -3417, -3414, -3412, -3409, -3407, -3404, -3402
-dd  -3399, -3396, -3394, -3391, -3389, -3386, -3384, -3381, -3379, -3376, -3373, -3371, -3368, -3366, -3363, -3361
-dd  -3358, -3356, -3353, -3350, -3348, -3345, -3343, -3340, -3338, -3335, -3333, -3330, -3328, -3325, -3323, -3320
-dd  -3317, -3315, -3312, -3310, -3307, -3305, -3302, -3300, -3297, -3295, -3292, -3290, -3287, -3285, -3282, -3280
-dd  -3277, -3275, -3272, -3270, -3267, -3265, -3262, -3260, -3257, -3255, -3252, -3250, -3247, -3245, -3242, -3240
-dd  -3237, -3235, -3232, -3230, -3227, -3225, -3222, -3220, -3217, -3215, -3212, -3210, -3207, -3205, -3202, -3200
-dd  -3197, -3195, -3192, -3190, -3187, -3185, -3182, -3180, -3177, -3175, -3173, -3170, -3168, -3165, -3163, -3160
-dd  -3158, -3155, -3153, -3150, -3148, -3145, -3143, -3141, -3138, -3136, -3133, -3131, -3128, -3126, -3123, -3121
-dd  -3118, -3116, -3114, -3111, -3109, -3106, -3104, -3101, -3099, -3097, -3094, -3092, -3089, -3087, -3084, -3082
-dd  -3079, -3077, -3075, -3072, -3070, -3067, -3065, -3063, -3060, -3058, -3055, -3053, -3050, -3048, -3046, -3043
-dd  -3041, -3038, -3036, -3034, -3031, -3029, -3026, -3024, -3021, -3019, -3017, -3014, -3012, -3009, -3007, -3005
-dd  -3002, -3000, -2997, -2995, -2993, -2990, -2988, -2985, -2983, -2981, -2978, -2976, -2974, -2971, -2969, -2966
-dd  -2964, -2962, -2959, -2957, -2954, -2952, -2950, -2947, -2945, -2943, -2940, -2938, -2935, -2933, -2931, -2928
-dd  -2926, -2924, -2921, -2919, -2917, -2914, -2912, -2909, -2907, -2905, -2902, -2900, -2898, -2895, -2893, -2891
-dd  -2888, -2886, -2884, -2881, -2879, -2876, -2874, -2872, -2869, -2867, -2865, -2862, -2860, -2858, -2855, -2853
-dd  -2851, -2848, -2846, -2844, -2841, -2839, -2837, -2834, -2832, -2830, -2827, -2825, -2823, -2820, -2818, -2816
-dd  -2813, -2811, -2809, -2806, -2804, -2802, -2800, -2797, -2795, -2793, -2790, -2788, -2786, -2783, -2781, -2779
-dd  -2776, -2774, -2772, -2769, -2767, -2765, -2763, -2760, -2758, -2756, -2753, -2751, -2749, -2746, -2744, -2742
-dd  -2740, -2737, -2735, -2733, -2730, -2728, -2726, -2724, -2721, -2719, -2717, -2714, -2712, -2710, -2708, -2705
-dd  -2703, -2701, -2698, -2696, -2694, -2692, -2689, -2687, -2685, -2682, -2680, -2678, -2676, -2673, -2671, -2669
-dd  -2667, -2664, -2662, -2660, -2658, -2655, -2653, -2651, -2649, -2646, -2644, -2642, -2639, -2637, -2635, -2633
-dd  -2630, -2628, -2626, -2624, -2621, -2619, -2617, -2615, -2612, -2610, -2608, -2606, -2604, -2601, -2599, -2597
-dd  -2595, -2592, -2590, -2588, -2586, -2583, -2581, -2579, -2577, -2574, -2572, -2570, -2568, -2566, -2563, -2561
-dd  -2559, -2557, -2554, -2552, -2550, -2548, -2546, -2543, -2541, -2539, -2537, -2534, -2532, -2530, -2528, -2526
-dd  -2523, -2521, -2519, -2517, -2515, -2512, -2510, -2508, -2506, -2503, -2501, -2499, -2497, -2495, -2492, -2490
-dd  -2488, -2486, -2484, -2481, -2479, -2477, -2475, -2473, -2471, -2468, -2466, -2464, -2462, -2460, -2457, -2455
-dd  -2453, -2451, -2449, -2446, -2444, -2442, -2440, -2438, -2436, -2433, -2431, -2429, -2427, -2425, -2422, -2420
-dd  -2418, -2416, -2414, -2412, -2409, -2407, -2405, -2403, -2401, -2399, -2396, -2394, -2392, -2390, -2388, -2386
-dd  -2383, -2381, -2379, -2377, -2375, -2373, -2371, -2368, -2366, -2364, -2362, -2360, -2358, -2355, -2353, -2351
-dd  -2349, -2347, -2345, -2343, -2340, -2338, -2336, -2334, -2332, -2330, -2328, -2325, -2323, -2321, -2319, -2317
-dd  -2315, -2313, -2310, -2308, -2306, -2304, -2302, -2300, -2298, -2296, -2293, -2291, -2289, -2287, -2285, -2283
-dd  -2281, -2279, -2276, -2274, -2272, -2270, -2268, -2266, -2264, -2262, -2260, -2257, -2255, -2253, -2251, -2249
-dd  -2247, -2245, -2243, -2241, -2238, -2236, -2234, -2232, -2230, -2228, -2226, -2224, -2222, -2219, -2217, -2215
-dd  -2213, -2211, -2209, -2207, -2205, -2203, -2201, -2198, -2196, -2194, -2192, -2190, -2188, -2186, -2184, -2182
-dd  -2180, -2178, -2176, -2173, -2171, -2169, -2167, -2165, -2163, -2161, -2159, -2157, -2155, -2153, -2151, -2148
-dd  -2146, -2144, -2142, -2140, -2138, -2136, -2134, -2132, -2130, -2128, -2126, -2124, -2122, -2119, -2117, -2115
-dd  -2113, -2111, -2109, -2107, -2105, -2103, -2101, -2099, -2097, -2095, -2093, -2091, -2089, -2087, -2084, -2082
-dd  -2080, -2078, -2076, -2074, -2072, -2070, -2068, -2066, -2064, -2062, -2060, -2058, -2056, -2054, -2052, -2050
-dd  -2048, -2046, -2044, -2042, -2039, -2037, -2035, -2033, -2031, -2029, -2027, -2025, -2023, -2021, -2019, -2017
-dd  -2015, -2013, -2011, -2009, -2007, -2005, -2003, -2001, -1999, -1997, -1995, -1993, -1991, -1989, -1987, -1985
-dd  -1983, -1981, -1979, -1977, -1975, -1973, -1971, -1969, -1967, -1965, -1963, -1961, -1959, -1957, -1955, -1952
-dd  -1950, -1948, -1946, -1944, -1942, -1940, -1938, -1936, -1934, -1932, -1930, -1928, -1926, -1924, -1922, -1920
-dd  -1918, -1916, -1914, -1912, -1910, -1908, -1906, -1905, -1903, -1901, -1899, -1897, -1895, -1893, -1891, -1889
-dd  -1887, -1885, -1883, -1881, -1879, -1877, -1875, -1873, -1871, -1869, -1867, -1865, -1863, -1861, -1859, -1857
-dd  -1855, -1853, -1851, -1849, -1847, -1845, -1843, -1841, -1839, -1837, -1835, -1833, -1831, -1829, -1827, -1825
-dd  -1823, -1821, -1819, -1818, -1816, -1814, -1812, -1810, -1808, -1806, -1804, -1802, -1800, -1798, -1796, -1794
-dd  -1792, -1790, -1788, -1786, -1784, -1782, -1780, -1778, -1776, -1774, -1773, -1771, -1769, -1767, -1765, -1763
-dd  -1761, -1759, -1757, -1755, -1753, -1751, -1749, -1747, -1745, -1743, -1741, -1740, -1738, -1736, -1734, -1732
-dd  -1730, -1728, -1726, -1724, -1722, -1720, -1718, -1716, -1714, -1712, -1711, -1709, -1707, -1705, -1703, -1701
-dd  -1699, -1697, -1695, -1693, -1691, -1689, -1687, -1686, -1684, -1682, -1680, -1678, -1676, -1674, -1672, -1670
-dd  -1668, -1666, -1664, -1663, -1661, -1659, -1657, -1655, -1653, -1651, -1649, -1647, -1645, -1643, -1642, -1640
-dd  -1638, -1636, -1634, -1632, -1630, -1628, -1626, -1624, -1623, -1621, -1619, -1617, -1615, -1613, -1611, -1609
-dd  -1607, -1605, -1604, -1602, -1600, -1598, -1596, -1594, -1592, -1590, -1588, -1587, -1585, -1583, -1581, -1579
-dd  -1577, -1575, -1573, -1571, -1570, -1568, -1566, -1564, -1562, -1560, -1558, -1556, -1555, -1553, -1551, -1549
-dd  -1547, -1545, -1543, -1541, -1540, -1538, -1536, -1534, -1532, -1530, -1528, -1526, -1525, -1523, -1521, -1519
-dd  -1517, -1515, -1513, -1512, -1510, -1508, -1506, -1504, -1502, -1500, -1499, -1497, -1495, -1493, -1491, -1489
-dd  -1487, -1486, -1484, -1482, -1480, -1478, -1476, -1474, -1473, -1471, -1469, -1467, -1465, -1463, -1461, -1460
-dd  -1458, -1456, -1454, -1452, -1450, -1449, -1447, -1445, -1443, -1441, -1439, -1437, -1436, -1434, -1432, -1430
-dd  -1428, -1426, -1425, -1423, -1421, -1419, -1417, -1415, -1414, -1412, -1410, -1408, -1406, -1404, -1403, -1401
-dd  -1399, -1397, -1395, -1393, -1392, -1390, -1388, -1386, -1384, -1383, -1381, -1379, -1377, -1375, -1373, -1372
-dd  -1370, -1368, -1366, -1364, -1363, -1361, -1359, -1357, -1355, -1353, -1352, -1350, -1348, -1346, -1344, -1343
-dd  -1341, -1339, -1337, -1335, -1334, -1332, -1330, -1328, -1326, -1324, -1323, -1321, -1319, -1317, -1315, -1314
-dd  -1312, -1310, -1308, -1306, -1305, -1303, -1301, -1299, -1297, -1296, -1294, -1292, -1290, -1288, -1287, -1285
-dd  -1283, -1281, -1280, -1278, -1276, -1274, -1272, -1271, -1269, -1267, -1265, -1263, -1262, -1260, -1258, -1256
-dd  -1254, -1253, -1251, -1249, -1247, -1246, -1244, -1242, -1240, -1238, -1237, -1235, -1233, -1231, -1230, -1228
-dd  -1226, -1224, -1222, -1221, -1219, -1217, -1215, -1214, -1212, -1210, -1208, -1206, -1205, -1203, -1201, -1199
-dd  -1198, -1196, -1194, -1192, -1191, -1189, -1187, -1185, -1184, -1182, -1180, -1178, -1176, -1175, -1173, -1171
-dd  -1169, -1168, -1166, -1164, -1162, -1161, -1159, -1157, -1155, -1154, -1152, -1150, -1148, -1147, -1145, -1143
-dd  -1141, -1140, -1138, -1136, -1134, -1133, -1131, -1129, -1127, -1126, -1124, -1122, -1120, -1119, -1117, -1115
-dd  -1113, -1112, -1110, -1108, -1106, -1105, -1103, -1101, -1100, -1098, -1096, -1094, -1093, -1091, -1089, -1087
-dd  -1086, -1084, -1082, -1080, -1079, -1077, -1075, -1074, -1072, -1070, -1068, -1067, -1065, -1063, -1061, -1060
-dd  -1058, -1056, -1055, -1053, -1051, -1049, -1048, -1046, -1044, -1042, -1041, -1039, -1037, -1036, -1034, -1032
-dd  -1030, -1029, -1027, -1025, -1024, -1022, -1020, -1018, -1017, -1015, -1013, -1012, -1010, -1008, -1006, -1005
-dd  -1003, -1001, -1000,  -998,  -996,  -994,  -993,  -991,  -989,  -988,  -986,  -984,  -982,  -981,  -979,  -977
-dd   -976,  -974,  -972,  -971,  -969,  -967,  -965,  -964,  -962,  -960,  -959,  -957,  -955,  -954,  -952,  -950
-dd   -949,  -947,  -945,  -943,  -942,  -940,  -938,  -937,  -935,  -933,  -932,  -930,  -928,  -927,  -925,  -923
-dd   -921,  -920,  -918,  -916,  -915,  -913,  -911,  -910,  -908,  -906,  -905,  -903,  -901,  -900,  -898,  -896
-dd   -895,  -893,  -891,  -890,  -888,  -886,  -884,  -883,  -881,  -879,  -878,  -876,  -874,  -873,  -871,  -869
-dd   -868,  -866,  -864,  -863,  -861,  -859,  -858,  -856,  -854,  -853,  -851,  -849,  -848,  -846,  -844,  -843
-dd   -841,  -839,  -838,  -836,  -834,  -833,  -831,  -829,  -828,  -826,  -824,  -823,  -821,  -819,  -818,  -816
-dd   -815,  -813,  -811,  -810,  -808,  -806,  -805,  -803,  -801,  -800,  -798,  -796,  -795,  -793,  -791,  -790
-dd   -788,  -786,  -785,  -783,  -781,  -780,  -778,  -777,  -775,  -773,  -772,  -770,  -768,  -767,  -765,  -763
-dd   -762,  -760,  -758,  -757,  -755,  -754,  -752,  -750,  -749,  -747,  -745,  -744,  -742,  -740,  -739,  -737
-dd   -736,  -734,  -732,  -731,  -729,  -727,  -726,  -724,  -722,  -721,  -719,  -718,  -716,  -714,  -713,  -711
-dd   -709,  -708,  -706,  -705,  -703,  -701,  -700,  -698,  -696,  -695,  -693,  -692,  -690,  -688,  -687,  -685
-dd   -683,  -682,  -680,  -679,  -677,  -675,  -674,  -672,  -671,  -669,  -667,  -666,  -664,  -662,  -661,  -659
-dd   -658,  -656,  -654,  -653,  -651,  -650,  -648,  -646,  -645,  -643,  -642,  -640,  -638,  -637,  -635,  -633
-dd   -632,  -630,  -629,  -627,  -625,  -624,  -622,  -621,  -619,  -617,  -616,  -614,  -613,  -611,  -609,  -608
-dd   -606,  -605,  -603,  -601,  -600,  -598,  -597,  -595,  -593,  -592,  -590,  -589,  -587,  -585,  -584,  -582
-dd   -581,  -579,  -578,  -576,  -574,  -573,  -571,  -570,  -568,  -566,  -565,  -563,  -562,  -560,  -558,  -557
-dd   -555,  -554,  -552,  -551,  -549,  -547,  -546,  -544,  -543,  -541,  -539,  -538,  -536,  -535,  -533,  -532
-dd   -530,  -528,  -527,  -525,  -524,  -522,  -521,  -519,  -517,  -516,  -514,  -513,  -511,  -510,  -508,  -506
-dd   -505,  -503,  -502,  -500,  -499,  -497,  -495,  -494,  -492,  -491,  -489,  -488,  -486,  -484,  -483,  -481
-dd   -480,  -478,  -477,  -475,  -473,  -472,  -470,  -469,  -467,  -466,  -464,  -463,  -461,  -459,  -458,  -456
-dd   -455,  -453,  -452,  -450,  -448,  -447,  -445,  -444,  -442,  -441,  -439,  -438,  -436,  -434,  -433,  -431
-dd   -430,  -428,  -427,  -425,  -424,  -422,  -421,  -419,  -417,  -416,  -414,  -413,  -411,  -410,  -408,  -407
-dd   -405,  -404,  -402,  -400,  -399,  -397,  -396,  -394,  -393,  -391,  -390,  -388,  -387,  -385,  -383,  -382
-dd   -380,  -379,  -377,  -376,  -374,  -373,  -371,  -370,  -368,  -367,  -365,  -363,  -362,  -360,  -359,  -357
-dd   -356,  -354,  -353,  -351,  -350,  -348,  -347,  -345,  -344,  -342,  -341,  -339,  -337,  -336,  -334,  -333
-dd   -331,  -330,  -328,  -327,  -325,  -324,  -322,  -321,  -319,  -318,  -316,  -315,  -313,  -312,  -310,  -308
-dd   -307,  -305,  -304,  -302,  -301,  -299,  -298,  -296,  -295,  -293,  -292,  -290,  -289,  -287,  -286,  -284
-dd   -283,  -281,  -280,  -278,  -277,  -275,  -274,  -272,  -271,  -269,  -268,  -266,  -265,  -263,  -262,  -260
-dd   -259,  -257,  -256,  -254,  -253,  -251,  -249,  -248,  -246,  -245,  -243,  -242,  -240,  -239,  -237,  -236
-dd   -234,  -233,  -231,  -230,  -228,  -227,  -225,  -224,  -222,  -221,  -219,  -218,  -216,  -215,  -213,  -212
-dd   -210,  -209,  -207,  -206,  -205,  -203,  -202,  -200,  -199,  -197,  -196,  -194,  -193,  -191,  -190,  -188
-dd   -187,  -185,  -184,  -182,  -181,  -179,  -178,  -176,  -175,  -173,  -172,  -170,  -169,  -167,  -166,  -164
-dd   -163,  -161,  -160,  -158,  -157,  -155,  -154,  -152,  -151,  -149,  -148,  -147,  -145,  -144,  -142,  -141
-dd   -139,  -138,  -136,  -135,  -133,  -132,  -130,  -129,  -127,  -126,  -124,  -123,  -121,  -120,  -119,  -117
-dd   -116,  -114,  -113,  -111,  -110,  -108,  -107,  -105,  -104,  -102,  -101,   -99,   -98,   -96,   -95,   -94
-dd    -92,   -91,   -89,   -88,   -86,   -85,   -83,   -82,   -80,   -79,   -77,   -76,   -75,   -73,   -72,   -70
-dd    -69,   -67,   -66,   -64,   -63,   -61,   -60,   -58,   -57,   -56,   -54,   -53,   -51,   -50,   -48,   -47
-dd    -45,   -44,   -42,   -41,   -40,   -38,   -37,   -35,   -34,   -32,   -31,   -29,   -28,   -26,   -25,   -24
-dd    -22,   -21,   -19,   -18,   -16,   -15,   -13,   -12,   -11,    -9,    -8,    -6,    -5,    -3,    -2,     0
-dd      0,     1,     3,     4,     6,     7,     9,    10,    12,    13,    14,    16,    17,    19,    20,    22
-dd     23,    24,    26,    27,    29,    30,    32,    33,    35,    36,    37,    39,    40,    42,    43,    45
-dd     46,    47,    49,    50,    52,    53,    55,    56,    57,    59,    60,    62,    63,    65,    66,    67
-dd     69,    70,    72,    73,    75,    76,    77,    79,    80,    82,    83,    85,    86,    87,    89,    90
-dd     92,    93,    94,    96,    97,    99,   100,   102,   103,   104,   106,   107,   109,   110,   111,   113
-dd    114,   116,   117,   119,   120,   121,   123,   124,   126,   127,   128,   130,   131,   133,   134,   135
-dd    137,   138,   140,   141,   143,   144,   145,   147,   148,   150,   151,   152,   154,   155,   157,   158
-dd    159,   161,   162,   164,   165,   166,   168,   169,   171,   172,   173,   175,   176,   178,   179,   180
-dd    182,   183,   185,   186,   187,   189,   190,   192,   193,   194,   196,   197,   199,   200,   201,   203
-dd    204,   206,   207,   208,   210,   211,   213,   214,   215,   217,   218,   219,   221,   222,   224,   225
-dd    226,   228,   229,   231,   232,   233,   235,   236,   238,   239,   240,   242,   243,   244,   246,   247
-dd    249,   250,   251,   253,   254,   256,   257,   258,   260,   261,   262,   264,   265,   267,   268,   269
-dd    271,   272,   273,   275,   276,   278,   279,   280,   282,   283,   284,   286,   287,   289,   290,   291
-dd    293,   294,   295,   297,   298,   300,   301,   302,   304,   305,   306,   308,   309,   311,   312,   313
-dd    315,   316,   317,   319,   320,   321,   323,   324,   326,   327,   328,   330,   331,   332,   334,   335
-dd    336,   338,   339,   341,   342,   343,   345,   346,   347,   349,   350,   351,   353,   354,   356,   357
-dd    358,   360,   361,   362,   364,   365,   366,   368,   369,   370,   372,   373,   375,   376,   377,   379
-dd    380,   381,   383,   384,   385,   387,   388,   389,   391,   392,   393,   395,   396,   397,   399,   400
-dd    402,   403,   404,   406,   407,   408,   410,   411,   412,   414,   415,   416,   418,   419,   420,   422
-dd    423,   424,   426,   427,   428,   430,   431,   432,   434,   435,   436,   438,   439,   441,   442,   443
-dd    445,   446,   447,   449,   450,   451,   453,   454,   455,   457,   458,   459,   461,   462,   463,   465
-dd    466,   467,   469,   470,   471,   473,   474,   475,   477,   478,   479,   481,   482,   483,   485,   486
-dd    487,   489,   490,   491,   492,   494,   495,   496,   498,   499,   500,   502,   503,   504,   506,   507
-dd    508,   510,   511,   512,   514,   515,   516,   518,   519,   520,   522,   523,   524,   526,   527,   528
-dd    530,   531,   532,   533,   535,   536,   537,   539,   540,   541,   543,   544,   545,   547,   548,   549
-dd    551,   552,   553,   555,   556,   557,   558,   560,   561,   562,   564,   565,   566,   568,   569,   570
-dd    572,   573,   574,   576,   577,   578,   579,   581,   582,   583,   585,   586,   587,   589,   590,   591
-dd    593,   594,   595,   596,   598,   599,   600,   602,   603,   604,   606,   607,   608,   609,   611,   612
-dd    613,   615,   616,   617,   619,   620,   621,   622,   624,   625,   626,   628,   629,   630,   632,   633
-dd    634,   635,   637,   638,   639,   641,   642,   643,   644,   646,   647,   648,   650,   651,   652,   654
-dd    655,   656,   657,   659,   660,   661,   663,   664,   665,   666,   668,   669,   670,   672,   673,   674
-dd    675,   677,   678,   679,   681,   682,   683,   684,   686,   687,   688,   690,   691,   692,   693,   695
-dd    696,   697,   699,   700,   701,   702,   704,   705,   706,   708,   709,   710,   711,   713,   714,   715
-dd    716,   718,   719,   720,   722,   723,   724,   725,   727,   728,   729,   731,   732,   733,   734,   736
-dd    737,   738,   739,   741,   742,   743,   745,   746,   747,   748,   750,   751,   752,   753,   755,   756
-dd    757,   759,   760,   761,   762,   764,   765,   766,   767,   769,   770,   771,   772,   774,   775,   776
-dd    778,   779,   780,   781,   783,   784,   785,   786,   788,   789,   790,   791,   793,   794,   795,   796
-dd    798,   799,   800,   802,   803,   804,   805,   807,   808,   809,   810,   812,   813,   814,   815,   817
-dd    818,   819,   820,   822,   823,   824,   825,   827,   828,   829,   830,   832,   833,   834,   835,   837
-dd    838,   839,   840,   842,   843,   844,   845,   847,   848,   849,   850,   852,   853,   854,   855,   857
-dd    858,   859,   860,   862,   863,   864,   865,   867,   868,   869,   870,   872,   873,   874,   875,   877
-dd    878,   879,   880,   882,   883,   884,   885,   887,   888,   889,   890,   892,   893,   894,   895,   896
-dd    898,   899,   900,   901,   903,   904,   905,   906,   908,   909,   910,   911,   913,   914,   915,   916
-dd    918,   919,   920,   921,   922,   924,   925,   926,   927,   929,   930,   931,   932,   934,   935,   936
-dd    937,   938,   940,   941,   942,   943,   945,   946,   947,   948,   950,   951,   952,   953,   954,   956
-dd    957,   958,   959,   961,   962,   963,   964,   965,   967,   968,   969,   970,   972,   973,   974,   975
-dd    977,   978,   979,   980,   981,   983,   984,   985,   986,   988,   989,   990,   991,   992,   994,   995
-dd    996,   997,   998,  1000,  1001,  1002,  1003,  1005,  1006,  1007,  1008,  1009,  1011,  1012,  1013,  1014
-dd   1016,  1017,  1018,  1019,  1020,  1022,  1023,  1024,  1025,  1026,  1028,  1029,  1030,  1031,  1032,  1034
-dd   1035,  1036,  1037,  1039,  1040,  1041,  1042,  1043,  1045,  1046,  1047,  1048,  1049,  1051,  1052,  1053
-dd   1054,  1055,  1057,  1058,  1059,  1060,  1061,  1063,  1064,  1065,  1066,  1068,  1069,  1070,  1071,  1072
-dd   1074,  1075,  1076,  1077,  1078,  1080,  1081,  1082,  1083,  1084,  1086,  1087,  1088,  1089,  1090,  1092
-dd   1093,  1094,  1095,  1096,  1098,  1099,  1100,  1101,  1102,  1104,  1105,  1106,  1107,  1108,  1110,  1111
-dd   1112,  1113,  1114,  1115,  1117,  1118,  1119,  1120,  1121,  1123,  1124,  1125,  1126,  1127,  1129,  1130
-dd   1131,  1132,  1133,  1135,  1136,  1137,  1138,  1139,  1141,  1142,  1143,  1144,  1145,  1146,  1148,  1149
-dd   1150,  1151,  1152,  1154,  1155,  1156,  1157,  1158,  1160,  1161,  1162,  1163,  1164,  1165,  1167,  1168
-dd   1169,  1170,  1171,  1173,  1174,  1175,  1176,  1177,  1178,  1180,  1181,  1182,  1183,  1184,  1186,  1187
-dd   1188,  1189,  1190,  1191,  1193,  1194,  1195,  1196,  1197,  1199,  1200,  1201,  1202,  1203,  1204,  1206
-dd   1207,  1208,  1209,  1210,  1211,  1213,  1214,  1215,  1216,  1217,  1219,  1220,  1221,  1222,  1223,  1224
-dd   1226,  1227,  1228,  1229,  1230,  1231,  1233,  1234,  1235,  1236,  1237,  1238,  1240,  1241,  1242,  1243
-dd   1244,  1245,  1247,  1248,  1249,  1250,  1251,  1252,  1254,  1255,  1256,  1257,  1258,  1259,  1261,  1262
-dd   1263,  1264,  1265,  1266,  1268,  1269,  1270,  1271,  1272,  1273,  1275,  1276,  1277,  1278,  1279,  1280
-dd   1282,  1283,  1284,  1285,  1286,  1287,  1289,  1290,  1291,  1292,  1293,  1294,  1295,  1297,  1298,  1299
-dd   1300,  1301,  1302,  1304,  1305,  1306,  1307,  1308,  1309,  1311,  1312,  1313,  1314,  1315,  1316,  1317
-dd   1319,  1320,  1321,  1322,  1323,  1324,  1326,  1327,  1328,  1329,  1330,  1331,  1332,  1334,  1335,  1336
-dd   1337,  1338,  1339,  1341,  1342,  1343,  1344,  1345,  1346,  1347,  1349,  1350,  1351,  1352,  1353,  1354
-dd   1355,  1357,  1358,  1359,  1360,  1361,  1362,  1363,  1365,  1366,  1367,  1368,  1369,  1370,  1371,  1373
-dd   1374,  1375,  1376,  1377,  1378,  1379,  1381,  1382,  1383,  1384,  1385,  1386,  1387,  1389,  1390,  1391
-dd   1392,  1393,  1394,  1395,  1397,  1398,  1399,  1400,  1401,  1402,  1403,  1405,  1406,  1407,  1408,  1409
-dd   1410,  1411,  1413,  1414,  1415,  1416,  1417,  1418,  1419,  1420,  1422,  1423,  1424,  1425,  1426,  1427
-dd   1428,  1430,  1431,  1432,  1433,  1434,  1435,  1436,  1437,  1439,  1440,  1441,  1442,  1443,  1444,  1445
-dd   1446,  1448,  1449,  1450,  1451,  1452,  1453,  1454,  1456,  1457,  1458,  1459,  1460,  1461,  1462,  1463
-dd   1465,  1466,  1467,  1468,  1469,  1470,  1471,  1472,  1474,  1475,  1476,  1477,  1478,  1479,  1480,  1481
-dd   1483,  1484,  1485,  1486,  1487,  1488,  1489,  1490,  1491,  1493,  1494,  1495,  1496,  1497,  1498,  1499
-dd   1500,  1502,  1503,  1504,  1505,  1506,  1507,  1508,  1509,  1511,  1512,  1513,  1514,  1515,  1516,  1517
-dd   1518,  1519,  1521,  1522,  1523,  1524,  1525,  1526,  1527,  1528,  1529,  1531,  1532,  1533,  1534,  1535
-dd   1536,  1537,  1538,  1539,  1541,  1542,  1543,  1544,  1545,  1546,  1547,  1548,  1549,  1551,  1552,  1553
-dd   1554,  1555,  1556,  1557,  1558,  1559,  1561,  1562,  1563,  1564,  1565,  1566,  1567,  1568,  1569,  1571
-dd   1572,  1573,  1574,  1575,  1576,  1577,  1578,  1579,  1580,  1582,  1583,  1584,  1585,  1586,  1587,  1588
-dd   1589,  1590,  1592,  1593,  1594,  1595,  1596,  1597,  1598,  1599,  1600,  1601,  1603,  1604,  1605,  1606
-dd   1607,  1608,  1609,  1610,  1611,  1612,  1614,  1615,  1616,  1617,  1618,  1619,  1620,  1621,  1622,  1623
-dd   1624,  1626,  1627,  1628,  1629,  1630,  1631,  1632,  1633,  1634,  1635,  1637,  1638,  1639,  1640,  1641
-dd   1642,  1643,  1644,  1645,  1646,  1647,  1649,  1650,  1651,  1652,  1653,  1654,  1655,  1656,  1657,  1658
-dd   1659,  1661,  1662,  1663,  1664,  1665,  1666,  1667,  1668,  1669,  1670,  1671,  1673,  1674,  1675,  1676
-dd   1677,  1678,  1679,  1680,  1681,  1682,  1683,  1684,  1686,  1687,  1688,  1689,  1690,  1691,  1692,  1693
-dd   1694,  1695,  1696,  1697,  1699,  1700,  1701,  1702,  1703,  1704,  1705,  1706,  1707,  1708,  1709,  1710
-dd   1712,  1713,  1714,  1715,  1716,  1717,  1718,  1719,  1720,  1721,  1722,  1723,  1724,  1726,  1727,  1728
-dd   1729,  1730,  1731,  1732,  1733,  1734,  1735,  1736,  1737,  1738,  1740,  1741,  1742,  1743,  1744,  1745
-dd   1746,  1747,  1748,  1749,  1750,  1751,  1752,  1753,  1755,  1756,  1757,  1758,  1759,  1760,  1761,  1762
-dd   1763,  1764,  1765,  1766,  1767,  1768,  1770,  1771,  1772,  1773,  1774,  1775,  1776,  1777,  1778,  1779
-dd   1780,  1781,  1782,  1783,  1785,  1786,  1787,  1788,  1789,  1790,  1791,  1792,  1793,  1794,  1795,  1796
-dd   1797,  1798,  1799,  1800,  1802,  1803,  1804,  1805,  1806,  1807,  1808,  1809,  1810,  1811,  1812,  1813
-dd   1814,  1815,  1816,  1817,  1819,  1820,  1821,  1822,  1823,  1824,  1825,  1826,  1827,  1828,  1829,  1830
-dd   1831,  1832,  1833,  1834,  1835,  1837,  1838,  1839,  1840,  1841,  1842,  1843,  1844,  1845,  1846,  1847
-dd   1848,  1849,  1850,  1851,  1852,  1853,  1854,  1856,  1857,  1858,  1859,  1860,  1861,  1862,  1863,  1864
-dd   1865,  1866,  1867,  1868,  1869,  1870,  1871,  1872,  1873,  1874,  1876,  1877,  1878,  1879,  1880,  1881
-dd   1882,  1883,  1884,  1885,  1886,  1887,  1888,  1889,  1890,  1891,  1892,  1893,  1894,  1895,  1897,  1898
-dd   1899,  1900,  1901,  1902,  1903,  1904,  1905,  1906,  1907,  1908,  1909,  1910,  1911,  1912,  1913,  1914
-dd   1915,  1916,  1917,  1918,  1919,  1921,  1922,  1923,  1924,  1925,  1926,  1927,  1928,  1929,  1930,  1931
-dd   1932,  1933,  1934,  1935,  1936,  1937,  1938,  1939,  1940,  1941,  1942,  1943,  1944,  1945,  1947,  1948
-dd   1949,  1950,  1951,  1952,  1953,  1954,  1955,  1956,  1957,  1958,  1959,  1960,  1961,  1962,  1963,  1964
-dd   1965,  1966,  1967,  1968,  1969,  1970,  1971,  1972,  1973,  1974,  1976,  1977,  1978,  1979,  1980,  1981
-dd   1982,  1983,  1984,  1985,  1986,  1987,  1988,  1989,  1990,  1991,  1992,  1993,  1994,  1995,  1996,  1997
-dd   1998,  1999,  2000,  2001,  2002,  2003,  2004,  2005,  2006,  2007,  2008,  2009,  2011,  2012,  2013,  2014
-dd   2015,  2016,  2017,  2018,  2019,  2020,  2021,  2022,  2023,  2024,  2025,  2026,  2027,  2028,  2029,  2030
-dd   2031,  2032,  2033,  2034,  2035,  2036,  2037,  2038,  2039,  2040,  2041,  2042,  2043,  2044,  2045,  2046
-dd   2047,  2048,  2049,  2050,  2051,  2052,  2053,  2055,  2056,  2057,  2058,  2059,  2060,  2061,  2062,  2063
-dd   2064,  2065,  2066,  2067,  2068,  2069,  2070,  2071,  2072,  2073,  2074,  2075,  2076,  2077,  2078,  2079
-dd   2080,  2081,  2082,  2083,  2084,  2085,  2086,  2087,  2088,  2089,  2090,  2091,  2092,  2093,  2094,  2095
-dd   2096,  2097,  2098,  2099,  2100,  2101,  2102,  2103,  2104,  2105,  2106,  2107,  2108,  2109,  2110,  2111
-dd   2112,  2113,  2114,  2115,  2116,  2117,  2118,  2119,  2120,  2121,  2122,  2123,  2124,  2125,  2126,  2127
-dd   2128,  2129,  2130,  2131,  2132,  2133,  2134,  2135,  2136,  2137,  2138,  2139,  2140,  2141,  2143,  2144
-dd   2145,  2146,  2147,  2148,  2149,  2150,  2151,  2152,  2153,  2154,  2155,  2156,  2157,  2158,  2159,  2160
-dd   2161,  2162,  2163,  2164,  2165,  2166,  2167,  2168,  2169,  2170,  2171,  2172,  2173,  2174,  2175,  2176
-dd   2177,  2178,  2179,  2180,  2181,  2182,  2183,  2184,  2185,  2186,  2187,  2188,  2189,  2190,  2190,  2191
-dd   2192,  2193,  2194,  2195,  2196,  2197,  2198,  2199,  2200,  2201,  2202,  2203,  2204,  2205,  2206,  2207
-dd   2208,  2209,  2210,  2211,  2212,  2213,  2214,  2215,  2216,  2217,  2218,  2219,  2220,  2221,  2222,  2223
-dd   2224,  2225,  2226,  2227,  2228,  2229,  2230,  2231,  2232,  2233,  2234,  2235,  2236,  2237,  2238,  2239
-dd   2240,  2241,  2242,  2243,  2244,  2245,  2246,  2247,  2248,  2249,  2250,  2251,  2252,  2253,  2254,  2255
-dd   2256,  2257,  2258,  2259,  2260,  2261,  2262,  2263,  2264,  2265,  2266,  2267,  2268,  2269,  2270,  2271
-dd   2272,  2273,  2274,  2275,  2276,  2277,  2277,  2278,  2279,  2280,  2281,  2282,  2283,  2284,  2285,  2286
-dd   2287,  2288,  2289,  2290,  2291,  2292,  2293,  2294,  2295,  2296,  2297,  2298,  2299,  2300,  2301,  2302
-dd   2303,  2304,  2305,  2306,  2307,  2308,  2309,  2310,  2311,  2312,  2313,  2314,  2315,  2316,  2317,  2318
-dd   2319,  2320,  2321,  2321,  2322,  2323,  2324,  2325,  2326,  2327,  2328,  2329,  2330,  2331,  2332,  2333
-dd   2334,  2335,  2336,  2337,  2338,  2339,  2340,  2341,  2342,  2343,  2344,  2345,  2346,  2347,  2348,  2349
-dd   2350,  2351,  2352,  2353,  2354,  2355,  2355,  2356,  2357,  2358,  2359,  2360,  2361,  2362,  2363,  2364
-dd   2365,  2366,  2367,  2368,  2369,  2370,  2371,  2372,  2373,  2374,  2375,  2376,  2377,  2378,  2379,  2380
-dd   2381,  2382,  2383,  2383,  2384,  2385,  2386,  2387,  2388,  2389,  2390,  2391,  2392,  2393,  2394,  2395
-dd   2396,  2397,  2398,  2399,  2400,  2401,  2402,  2403,  2404,  2405,  2406,  2407,  2408,  2408,  2409,  2410
-dd   2411,  2412,  2413,  2414,  2415,  2416,  2417,  2418,  2419,  2420,  2421,  2422,  2423,  2424,  2425,  2426
-dd   2427,  2428,  2429,  2430,  2431,  2431,  2432,  2433,  2434,  2435,  2436,  2437,  2438,  2439,  2440,  2441
-dd   2442,  2443,  2444,  2445,  2446,  2447,  2448,  2449,  2450,  2451,  2452,  2452,  2453,  2454,  2455,  2456
-dd   2457,  2458,  2459,  2460,  2461,  2462,  2463,  2464,  2465,  2466,  2467,  2468,  2469,  2470,  2471,  2472
-dd   2472,  2473,  2474,  2475,  2476,  2477,  2478,  2479,  2480,  2481,  2482,  2483,  2484,  2485,  2486,  2487
-dd   2488,  2489,  2490,  2490,  2491,  2492,  2493,  2494,  2495,  2496,  2497,  2498,  2499,  2500,  2501,  2502
-dd   2503,  2504,  2505,  2506,  2507,  2507,  2508,  2509,  2510,  2511,  2512,  2513,  2514,  2515,  2516,  2517
-dd   2518,  2519,  2520,  2521,  2522,  2523,  2524,  2524,  2525,  2526,  2527,  2528,  2529,  2530,  2531,  2532
-dd   2533,  2534,  2535,  2536,  2537,  2538,  2539,  2539,  2540,  2541,  2542,  2543,  2544,  2545,  2546,  2547
-dd   2548,  2549,  2550,  2551,  2552,  2553,  2554,  2554,  2555,  2556,  2557,  2558,  2559,  2560,  2561,  2562
-dd   2563,  2564,  2565,  2566,  2567,  2568,  2569,  2569,  2570,  2571,  2572,  2573,  2574,  2575,  2576,  2577
-dd   2578,  2579,  2580,  2581,  2582,  2583,  2583,  2584,  2585,  2586,  2587,  2588,  2589,  2590,  2591,  2592
-dd   2593,  2594,  2595,  2596,  2596,  2597,  2598,  2599,  2600,  2601,  2602,  2603,  2604,  2605,  2606,  2607
-dd   2608,  2609,  2609,  2610,  2611,  2612,  2613,  2614,  2615,  2616,  2617,  2618,  2619,  2620,  2621,  2622
-dd   2622,  2623,  2624,  2625,  2626,  2627,  2628,  2629,  2630,  2631,  2632,  2633,  2634,  2634,  2635,  2636
-dd   2637,  2638,  2639,  2640,  2641,  2642,  2643,  2644,  2645,  2646,  2646,  2647,  2648,  2649,  2650,  2651
-dd   2652,  2653,  2654,  2655,  2656,  2657,  2658,  2658,  2659,  2660,  2661,  2662,  2663,  2664,  2665,  2666
-dd   2667,  2668,  2669,  2669,  2670,  2671,  2672,  2673,  2674,  2675,  2676,  2677,  2678,  2679,  2680,  2680
-dd   2681,  2682,  2683,  2684,  2685,  2686,  2687,  2688,  2689,  2690,  2691,  2691,  2692,  2693,  2694,  2695
-dd   2696,  2697,  2698,  2699,  2700,  2701,  2702,  2702,  2703,  2704,  2705,  2706,  2707,  2708,  2709,  2710
-dd   2711,  2712,  2712,  2713,  2714,  2715,  2716,  2717,  2718,  2719,  2720,  2721,  2722,  2722,  2723,  2724
-dd   2725,  2726,  2727,  2728,  2729,  2730,  2731,  2732,  2732,  2733,  2734,  2735,  2736,  2737,  2738,  2739
-dd   2740,  2741,  2742,  2742,  2743,  2744,  2745,  2746,  2747,  2748,  2749,  2750,  2751,  2752,  2752,  2753
-dd   2754,  2755,  2756,  2757,  2758,  2759,  2760,  2761,  2761,  2762,  2763,  2764,  2765,  2766,  2767,  2768
-dd   2769,  2770,  2771,  2771,  2772,  2773,  2774,  2775,  2776,  2777,  2778,  2779,  2780,  2780,  2781,  2782
-dd   2783,  2784,  2785,  2786,  2787,  2788,  2789,  2789,  2790,  2791,  2792,  2793,  2794,  2795,  2796,  2797
-dd   2798,  2798,  2799,  2800,  2801,  2802,  2803,  2804,  2805,  2806,  2807,  2807,  2808,  2809,  2810,  2811
-dd   2812,  2813,  2814,  2815,  2815,  2816,  2817,  2818,  2819,  2820,  2821,  2822,  2823,  2824,  2824,  2825
-dd   2826,  2827,  2828,  2829,  2830,  2831,  2832,  2832,  2833,  2834,  2835,  2836,  2837,  2838,  2839,  2840
-dd   2841,  2841,  2842,  2843,  2844,  2845,  2846,  2847,  2848,  2849,  2849,  2850,  2851,  2852,  2853,  2854
-dd   2855,  2856,  2857,  2857,  2858,  2859,  2860,  2861,  2862,  2863,  2864,  2865,  2865,  2866,  2867,  2868
-dd   2869,  2870,  2871,  2872,  2873,  2873,  2874,  2875,  2876,  2877,  2878,  2879,  2880,  2881,  2881,  2882
-dd   2883,  2884,  2885,  2886,  2887,  2888,  2889,  2889,  2890,  2891,  2892,  2893,  2894,  2895,  2896,  2896
-dd   2897,  2898,  2899,  2900,  2901,  2902,  2903,  2904,  2904,  2905,  2906,  2907,  2908,  2909,  2910,  2911
-dd   2911,  2912,  2913,  2914,  2915,  2916,  2917,  2918,  2919,  2919,  2920,  2921,  2922,  2923,  2924,  2925
-dd   2926,  2926,  2927,  2928,  2929,  2930,  2931,  2932,  2933,  2933,  2934,  2935,  2936,  2937,  2938,  2939
-dd   2940,  2940,  2941,  2942,  2943,  2944,  2945,  2946,  2947,  2947,  2948,  2949,  2950,  2951,  2952,  2953
-dd   2954,  2954,  2955,  2956,  2957,  2958,  2959,  2960,  2961,  2961,  2962,  2963,  2964,  2965,  2966,  2967
-dd   2968,  2968,  2969,  2970,  2971,  2972,  2973,  2974,  2975,  2975,  2976,  2977,  2978,  2979,  2980,  2981
-dd   2982,  2982,  2983,  2984,  2985,  2986,  2987,  2988,  2989,  2989,  2990,  2991,  2992,  2993,  2994,  2995
-dd   2995,  2996,  2997,  2998,  2999,  3000,  3001,  3002,  3002,  3003,  3004,  3005,  3006,  3007,  3008,  3009
-dd   3009,  3010,  3011,  3012,  3013,  3014,  3015,  3015,  3016,  3017,  3018,  3019,  3020,  3021,  3021,  3022
-dd   3023,  3024,  3025,  3026,  3027,  3028,  3028,  3029,  3030,  3031,  3032,  3033,  3034,  3034,  3035,  3036
-dd   3037,  3038,  3039,  3040,  3040,  3041,  3042,  3043,  3044,  3045,  3046,  3047,  3047,  3048,  3049,  3050
-dd   3051,  3052,  3053,  3053,  3054,  3055,  3056,  3057,  3058,  3059,  3059,  3060,  3061,  3062,  3063,  3064
-dd   3065,  3065,  3066,  3067,  3068,  3069,  3070,  3071,  3071,  3072,  3073,  3074,  3075,  3076,  3077,  3077
-dd   3078,  3079,  3080,  3081,  3082,  3083,  3083,  3084,  3085,  3086,  3087,  3088,  3089,  3089,  3090,  3091
-dd   3092,  3093,  3094,  3095,  3095,  3096,  3097,  3098,  3099,  3100,  3101,  3101,  3102,  3103,  3104,  3105
-dd   3106,  3107,  3107,  3108,  3109,  3110,  3111,  3112,  3113,  3113,  3114,  3115,  3116,  3117,  3118,  3118
-dd   3119,  3120,  3121,  3122,  3123,  3124,  3124,  3125,  3126,  3127,  3128,  3129,  3130,  3130,  3131,  3132
-dd   3133,  3134,  3135,  3135,  3136,  3137,  3138,  3139,  3140,  3141,  3141,  3142,  3143,  3144,  3145,  3146
-dd   3146,  3147,  3148,  3149,  3150,  3151,  3152,  3152,  3153,  3154,  3155,  3156,  3157,  3157,  3158,  3159
-dd   3160,  3161,  3162,  3163,  3163,  3164,  3165,  3166,  3167,  3168,  3168,  3169,  3170,  3171,  3172,  3173
-dd   3174,  3174,  3175,  3176,  3177,  3178,  3179,  3179,  3180,  3181,  3182,  3183,  3184,  3184,  3185,  3186
-dd   3187,  3188,  3189,  3190,  3190,  3191,  3192,  3193,  3194,  3195,  3195,  3196,  3197,  3198,  3199,  3200
-dd   3200,  3201,  3202,  3203,  3204,  3205,  3205,  3206,  3207,  3208,  3209,  3210,  3211,  3211,  3212,  3213
-dd   3214,  3215,  3216,  3216,  3217,  3218,  3219,  3220,  3221,  3221,  3222,  3223,  3224,  3225,  3226,  3226
-dd   3227,  3228,  3229,  3230,  3231,  3231,  3232,  3233,  3234,  3235,  3236,  3236,  3237,  3238,  3239,  3240
-dd   3241,  3241,  3242,  3243,  3244,  3245,  3246,  3246,  3247,  3248,  3249,  3250,  3251,  3251,  3252,  3253
-dd   3254,  3255,  3256,  3256,  3257,  3258,  3259,  3260,  3261,  3261,  3262,  3263,  3264,  3265,  3266,  3266
-dd   3267,  3268,  3269,  3270,  3271,  3271,  3272,  3273,  3274,  3275,  3276,  3276,  3277,  3278,  3279,  3280
-dd   3280,  3281,  3282,  3283,  3284,  3285,  3285,  3286,  3287,  3288,  3289,  3290,  3290,  3291,  3292,  3293
-dd   3294,  3295,  3295,  3296,  3297,  3298,  3299,  3300,  3300,  3301,  3302,  3303,  3304,  3304,  3305,  3306
-dd   3307,  3308,  3309,  3309,  3310,  3311,  3312,  3313,  3314,  3314,  3315,  3316,  3317,  3318,  3318,  3319
-dd   3320,  3321,  3322,  3323,  3323,  3324,  3325,  3326,  3327,  3327,  3328,  3329,  3330,  3331,  3332,  3332
-dd   3333,  3334,  3335,  3336,  3337,  3337,  3338,  3339,  3340,  3341,  3341,  3342,  3343,  3344,  3345,  3346
-dd   3346,  3347,  3348,  3349,  3350,  3350,  3351,  3352,  3353,  3354,  3355,  3355,  3356,  3357,  3358,  3359
-dd   3359,  3360,  3361,  3362,  3363,  3364,  3364,  3365,  3366,  3367,  3368,  3368,  3369,  3370,  3371,  3372
-dd   3373,  3373,  3374,  3375,  3376,  3377,  3377,  3378,  3379,  3380,  3381,  3381,  3382,  3383,  3384,  3385
-dd   3386,  3386,  3387,  3388,  3389,  3390,  3390,  3391,  3392,  3393,  3394,  3394,  3395,  3396,  3397,  3398
-dd   3399,  3399,  3400,  3401,  3402,  3403,  3403,  3404,  3405,  3406,  3407,  3407,  3408,  3409,  3410,  3411
-dd   3412,  3412,  3413,  3414,  3415,  3416,  3416,  3417,  3418,  3419,  3420,  3420,  3421,  3422,  3423,  3424
-dd   3424,  3425,  3426,  3427,  3428,  3429,  3429,  3430,  3431,  3432,  3433,  3433,  3434,  3435,  3436,  3437
-dd   3437,  3438,  3439,  3440,  3441,  3441,  3442,  3443,  3444,  3445,  3445,  3446,  3447,  3448,  3449,  3449
-dd   3450,  3451,  3452,  3453,  3453,  3454,  3455,  3456,  3457,  3458,  3458,  3459,  3460,  3461,  3462,  3462
-dd   3463,  3464,  3465,  3466,  3466,  3467,  3468,  3469,  3470,  3470,  3471,  3472,  3473,  3474,  3474,  3475
-dd   3476,  3477,  3478,  3478,  3479,  3480,  3481,  3482,  3482,  3483,  3484,  3485,  3486,  3486,  3487,  3488
-dd   3489,  3490,  3490,  3491,  3492,  3493,  3494,  3494,  3495,  3496,  3497,  3498,  3498,  3499,  3500,  3501
-dd   3502,  3502,  3503,  3504,  3505,  3506,  3506,  3507,  3508,  3509,  3510,  3510,  3511,  3512,  3513,  3513
-dd   3514,  3515,  3516,  3517,  3517,  3518,  3519,  3520,  3521,  3521,  3522,  3523,  3524,  3525,  3525,  3526
-dd   3527,  3528,  3529,  3529,  3530,  3531,  3532,  3533,  3533,  3534,  3535,  3536,  3537,  3537,  3538,  3539
-dd   3540,  3540,  3541,  3542,  3543,  3544,  3544,  3545,  3546,  3547,  3548,  3548,  3549,  3550,  3551,  3552
-dd   3552,  3553,  3554,  3555,  3556,  3556,  3557,  3558,  3559,  3559,  3560,  3561,  3562,  3563,  3563,  3564
-dd   3565,  3566,  3567,  3567,  3568,  3569,  3570,  3571,  3571,  3572,  3573,  3574,  3574,  3575,  3576,  3577
-dd   3578,  3578,  3579,  3580,  3581,  3582,  3582,  3583,  3584,  3585,  3585,  3586,  3587,  3588,  3589,  3589
-dd   3590,  3591,  3592,  3593,  3593,  3594,  3595,  3596,  3596,  3597,  3598,  3599,  3600,  3600,  3601,  3602
-dd   3603,  3604,  3604,  3605,  3606,  3607,  3607,  3608,  3609,  3610,  3611,  3611,  3612,  3613,  3614,  3615
-dd   3615,  3616,  3617,  3618,  3618,  3619,  3620,  3621,  3622,  3622,  3623,  3624,  3625,  3625,  3626,  3627
-dd   3628,  3629,  3629,  3630,  3631,  3632,  3632,  3633,  3634,  3635,  3636,  3636,  3637,  3638,  3639,  3640
-dd   3640,  3641,  3642,  3643,  3643,  3644,  3645,  3646,  3647,  3647,  3648,  3649,  3650,  3650,  3651,  3652
-dd   3653,  3654,  3654,  3655,  3656,  3657,  3657,  3658,  3659,  3660,  3661,  3661,  3662,  3663,  3664,  3664
-dd   3665,  3666,  3667,  3668,  3668,  3669,  3670,  3671,  3671,  3672,  3673,  3674,  3674,  3675,  3676,  3677
-dd   3678,  3678,  3679,  3680,  3681,  3681,  3682,  3683,  3684,  3685,  3685,  3686,  3687,  3688,  3688,  3689
-dd   3690,  3691,  3691,  3692,  3693,  3694,  3695,  3695,  3696,  3697,  3698,  3698,  3699,  3700,  3701,  3702
-dd   3702,  3703,  3704,  3705,  3705,  3706,  3707,  3708,  3708,  3709,  3710,  3711,  3712,  3712,  3713,  3714
-dd   3715,  3715,  3716,  3717,  3718,  3718,  3719,  3720,  3721,  3722,  3722,  3723,  3724,  3725,  3725,  3726
-dd   3727,  3728,  3728,  3729,  3730,  3731,  3732,  3732,  3733,  3734,  3735,  3735,  3736,  3737,  3738,  3738
-dd   3739,  3740,  3741,  3741,  3742,  3743,  3744,  3745,  3745,  3746,  3747,  3748,  3748,  3749,  3750,  3751
-dd   3751,  3752,  3753,  3754,  3754,  3755,  3756,  3757,  3758,  3758,  3759,  3760,  3761,  3761,  3762,  3763
-dd   3764,  3764,  3765,  3766,  3767,  3767,  3768,  3769,  3770,  3771,  3771,  3772,  3773,  3774,  3774,  3775
-dd   3776,  3777,  3777,  3778,  3779,  3780,  3780,  3781,  3782,  3783,  3783,  3784,  3785,  3786,  3787,  3787
-dd   3788,  3789,  3790,  3790,  3791,  3792,  3793,  3793,  3794,  3795,  3796,  3796,  3797,  3798,  3799,  3799
-dd   3800,  3801,  3802,  3802,  3803,  3804,  3805,  3805,  3806,  3807,  3808,  3809,  3809,  3810,  3811,  3812
-dd   3812,  3813,  3814,  3815,  3815,  3816,  3817,  3818,  3818,  3819,  3820,  3821,  3821,  3822,  3823,  3824
-dd   3824,  3825,  3826,  3827,  3827,  3828,  3829,  3830,  3830,  3831,  3832,  3833,  3833,  3834,  3835,  3836
-dd   3836,  3837,  3838,  3839,  3839,  3840,  3841,  3842,  3842,  3843,  3844,  3845,  3846,  3846,  3847,  3848
-dd   3849,  3849,  3850,  3851,  3852,  3852,  3853,  3854,  3855,  3855,  3856,  3857,  3858,  3858,  3859,  3860
-dd   3861,  3861,  3862,  3863,  3864,  3864,  3865,  3866,  3867,  3867,  3868,  3869,  3870,  3870,  3871,  3872
-dd   3873,  3873,  3874,  3875,  3876,  3876,  3877,  3878,  3879,  3879,  3880,  3881,  3882,  3882,  3883,  3884
-dd   3885,  3885,  3886,  3887,  3888,  3888,  3889,  3890,  3890,  3891,  3892,  3893,  3893,  3894,  3895,  3896
-dd   3896,  3897,  3898,  3899,  3899,  3900,  3901,  3902,  3902,  3903,  3904,  3905,  3905,  3906,  3907,  3908
-dd   3908,  3909,  3910,  3911,  3911,  3912,  3913,  3914,  3914,  3915,  3916,  3917,  3917,  3918,  3919,  3920
-dd   3920,  3921,  3922,  3923,  3923,  3924,  3925,  3925,  3926,  3927,  3928,  3928,  3929,  3930,  3931,  3931
-dd   3932,  3933,  3934,  3934,  3935,  3936,  3937,  3937,  3938,  3939,  3940,  3940,  3941,  3942,  3943,  3943
-dd   3944,  3945,  3946,  3946,  3947,  3948,  3948,  3949,  3950,  3951,  3951,  3952,  3953,  3954,  3954,  3955
-dd   3956,  3957,  3957,  3958,  3959,  3960,  3960,  3961,  3962,  3962,  3963,  3964,  3965,  3965,  3966,  3967
-dd   3968,  3968,  3969,  3970,  3971,  3971,  3972,  3973,  3974,  3974,  3975,  3976,  3976,  3977,  3978,  3979
-dd   3979,  3980,  3981,  3982,  3982,  3983,  3984,  3985,  3985,  3986,  3987,  3988,  3988,  3989,  3990,  3990
-dd   3991,  3992,  3993,  3993,  3994,  3995,  3996,  3996,  3997,  3998,  3999,  3999,  4000,  4001,  4001,  4002
-dd   4003,  4004,  4004,  4005,  4006,  4007,  4007,  4008,  4009,  4010,  4010,  4011,  4012,  4012,  4013,  4014
-dd   4015,  4015,  4016,  4017,  4018,  4018,  4019,  4020,  4020,  4021,  4022,  4023,  4023,  4024,  4025,  4026
-dd   4026,  4027,  4028,  4029,  4029,  4030,  4031,  4031,  4032,  4033,  4034,  4034,  4035,  4036,  4037,  4037
-dd   4038,  4039,  4039,  4040,  4041,  4042,  4042,  4043,  4044,  4045,  4045,  4046,  4047,  4047,  4048,  4049
-dd   4050,  4050,  4051,  4052,  4053,  4053,  4054,  4055,  4055,  4056,  4057,  4058,  4058,  4059,  4060,  4061
-dd   4061,  4062,  4063,  4063,  4064,  4065,  4066,  4066,  4067,  4068,  4069,  4069,  4070,  4071,  4071,  4072
-dd   4073,  4074,  4074,  4075,  4076,  4076,  4077,  4078,  4079,  4079,  4080,  4081,  4082,  4082,  4083,  4084
-dd   4084,  4085,  4086,  4087,  4087,  4088,  4089,  4090,  4090,  4091,  4092,  4092,  4093,  4094,  4095,  4095
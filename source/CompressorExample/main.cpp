@@ -22,6 +22,9 @@
 
 #include <cstdio>
 
+// Inputs above this size are estimated with the large-input functions
+static const int LARGE_INPUT_SIZE = 1024 * 1024;
+
 // Optional progress update callback
 void ProgressUpdateCallback(void* userData, int value, int max)
 {
@@ -64,8 +67,20 @@ int main(int argc, const char* argv[])
 	printf("Calculating models...");
 
 	unsigned char context[MAX_CONTEXT_LENGTH] = {};	// The MAX_CONTEXT_LENGTH bytes in the context window before data. They will not be compressed, but will be use for prediction.
-	int compressedSize = 0;							// Resulting compressed size. BIT_PRECISION units per bit.
-	ModelList4k modelList = ApproximateModels4k(data, dataSize, context, COMPRESSION_SLOW, false, DEFAULT_BASEPROB, &compressedSize, ProgressUpdateCallback, nullptr);
+	long long compressedSize = 0;					// Resulting compressed size. BIT_PRECISION units per bit.
+	ModelList4k modelList;
+	if (dataSize <= LARGE_INPUT_SIZE)
+	{
+		int size = 0;
+		modelList = ApproximateModels4k(data, dataSize, context, COMPRESSION_SLOW, false, DEFAULT_BASEPROB, 0, 0, &size, ProgressUpdateCallback, nullptr);
+		compressedSize = size;
+	}
+	else
+	{
+		// The model search needs memory and time proportional to the input size. For large inputs,
+		// search on a sample and estimate the size in windows instead.
+		modelList = ApproximateModels4kLarge(data, dataSize, COMPRESSION_SLOW, false, DEFAULT_BASEPROB, 0, &compressedSize, ProgressUpdateCallback, nullptr);
+	}
 
 	printf("\nEstimated compressed size: %.3f bytes\n", compressedSize / float(BIT_PRECISION * 8));
 	printf("Selected models: ");
@@ -81,9 +96,17 @@ int main(int argc, const char* argv[])
 	// As long as the transformations are small, the size deltas seen from evaluating using a fixed set of models should
 	// be close to what you would see when recalculating the models from scratch.
 	// Reusing models allows for more rapid iteration by users or tools.
-	ModelList4k* modelLists[] = { &modelList };
-	int segmentSizes[] = { dataSize };
-	int transformedSize = EvaluateSize4k(data, 1, segmentSizes, nullptr, modelLists, DEFAULT_BASEPROB, false);
+	long long transformedSize;
+	if (dataSize <= LARGE_INPUT_SIZE)
+	{
+		ModelList4k* modelLists[] = { &modelList };
+		int segmentSizes[] = { dataSize };
+		transformedSize = EvaluateSize4k(data, 1, segmentSizes, nullptr, modelLists, DEFAULT_BASEPROB, false);
+	}
+	else
+	{
+		transformedSize = EvaluateSize4kLarge(data, dataSize, modelList, DEFAULT_BASEPROB, false, 0);
+	}
 	printf("Estimated compressed size of transformed data: %.3f bytes\n", transformedSize / float(BIT_PRECISION * 8));
 
 	delete[] data;
@@ -0,0 +1,669 @@
+// Self tests for the Compressor library.
+// Returns a non-zero exit code if any test fails.
+
+#define _CRT_SECURE_NO_WARNINGS
+
+#include "../Compressor/Compressor.h"
+#include "../Compressor/CompressionState.h"
+#include "../Compressor/CompressionStream.h"
+#include "../Compressor/CompressionStateEvaluator.h"
+#include "../Compressor/IncrementalEvaluator.h"
+
+#include <climits>
+#include <cmath>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <thread>
+#include <vector>
+
+static const char* InstructionSetName(InstructionSet instructionSet)
+{
+	switch (instructionSet)
+	{
+		case INSTRUCTION_SET_SSE:
+			return "SSE";
+		case INSTRUCTION_SET_AVX2:
+			return "AVX2";
+		case INSTRUCTION_SET_AVX512:
+			return "AVX512";
+		default:
+			return "AUTO";
+	}
+}
+
+// Deterministic test data with some structure, so that most models make predictions
+static std::vector<unsigned char> GenerateData(int size, unsigned int seed)
+{
+	std::vector<unsigned char> data(size);
+	for (int i = 0; i < size; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		unsigned int r = seed >> 16;
+		if (i >= 16 && (r & 3) != 0)
+			data[i] = data[i - 1 - (r >> 2) % 16] + (unsigned char)((r >> 8) & 1);
+		else
+			data[i] = (unsigned char)r;
+	}
+	return data;
+}
+
+// A fixed sequence of model sets, adding and removing models and changing weights
+static std::vector<ModelList4k> GenerateModelSets(int count, unsigned int seed)
+{
+	std::vector<ModelList4k> modelSets;
+	ModelList4k models;
+	for (int i = 0; i < count; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		unsigned int r = seed >> 8;
+		if (models.nmodels > 0 && (r & 3) == 0)
+		{
+			int m = (r >> 2) % models.nmodels;
+			models.nmodels--;
+			models[m] = models[models.nmodels];
+		}
+		else if (models.nmodels > 0 && (r & 3) == 1)
+		{
+			models[(r >> 2) % models.nmodels].weight = (unsigned char)((r >> 12) % 10);
+		}
+		else if (models.nmodels < 20)
+		{
+			unsigned char mask = (unsigned char)(r >> 2);
+			bool used = false;
+			for (int m = 0; m < models.nmodels; m++)
+				used |= models[m].mask == mask;
+			if (!used)
+			{
+				Model model = { (unsigned char)((r >> 12) % 10), mask };
+				models.AddModel(model);
+			}
+		}
+		modelSets.push_back(models);
+	}
+	return modelSets;
+}
+
+// Evaluating with the 256 and 512 bit kernels must give exactly the same sizes as the 128 bit kernel
+static bool TestEvaluatorKernels()
+{
+	bool success = true;
+	const int sizes[] = { 1, 7, 8, 100, 3000 };
+	for (int size : sizes)
+	{
+		std::vector<unsigned char> data = GenerateData(size, size);
+		std::vector<ModelList4k> modelSets = GenerateModelSets(200, size);
+		unsigned char context[MAX_CONTEXT_LENGTH] = {};
+
+		std::vector<int> referenceSizes;
+		const InstructionSet instructionSets[] = { INSTRUCTION_SET_SSE, INSTRUCTION_SET_AVX2, INSTRUCTION_SET_AVX512 };
+		for (InstructionSet instructionSet : instructionSets)
+		{
+			for (int saturate = 0; saturate < 2; saturate++)
+			{
+				CompressionStateEvaluator evaluator(instructionSet);
+				CompressionState state(data.data(), size, DEFAULT_BASEPROB, saturate != 0, &evaluator, context);
+				if (evaluator.GetInstructionSet() != instructionSet)
+				{
+					printf("  %s not supported by this CPU, skipped\n", InstructionSetName(instructionSet));
+					break;
+				}
+
+				std::vector<int> compressedSizes;
+				for (const ModelList4k& models : modelSets)
+					compressedSizes.push_back(state.SetModels(models));
+
+				if (instructionSet == INSTRUCTION_SET_SSE)
+				{
+					referenceSizes.insert(referenceSizes.end(), compressedSizes.begin(), compressedSizes.end());
+				}
+				else
+				{
+					for (size_t i = 0; i < compressedSizes.size(); i++)
+					{
+						if (compressedSizes[i] != referenceSizes[saturate * modelSets.size() + i])
+						{
+							printf("  %s differs from SSE: size %d, saturate %d, model set %d: %d != %d\n", InstructionSetName(instructionSet),
+								size, saturate, (int)i, compressedSizes[i], referenceSizes[saturate * modelSets.size() + i]);
+							success = false;
+							break;
+						}
+					}
+				}
+			}
+		}
+	}
+	return success;
+}
+
+// Changing several models at once must give exactly the same sizes as changing them one at a time in mask order
+static bool TestEvaluatorMultiModelChanges()
+{
+	bool success = true;
+	const int sizes[] = { 7, 100, 3000 };
+	for (int size : sizes)
+	{
+		std::vector<unsigned char> data = GenerateData(size, size);
+		std::vector<ModelList4k> modelSets = GenerateModelSets(300, size);
+		unsigned char context[MAX_CONTEXT_LENGTH] = {};
+
+		const InstructionSet instructionSets[] = { INSTRUCTION_SET_SSE, INSTRUCTION_SET_AVX2, INSTRUCTION_SET_AVX512 };
+		for (InstructionSet instructionSet : instructionSets)
+		{
+			CompressionStateEvaluator fusedEvaluator(instructionSet);
+			CompressionStateEvaluator stepEvaluator(instructionSet);
+			CompressionState fusedState(data.data(), size, DEFAULT_BASEPROB, false, &fusedEvaluator, context);
+			CompressionState stepState(data.data(), size, DEFAULT_BASEPROB, false, &stepEvaluator, context);
+			if (fusedEvaluator.GetInstructionSet() != instructionSet)
+			{
+				printf("  %s not supported by this CPU, skipped\n", InstructionSetName(instructionSet));
+				continue;
+			}
+
+			// Jump between every 10th model set, so that many models change in each step
+			int weights[256];
+			for (int mask = 0; mask < 256; mask++)
+				weights[mask] = -1;
+			for (size_t i = 0; i < modelSets.size(); i += 10)
+			{
+				const ModelList4k& models = modelSets[i];
+				int fusedSize = fusedState.SetModels(models);
+
+				int newWeights[256];
+				for (int mask = 0; mask < 256; mask++)
+					newWeights[mask] = -1;
+				for (int m = 0; m < models.nmodels; m++)
+					newWeights[models[m].mask] = models[m].weight;
+
+				int stepSize = stepState.GetCompressedSize();
+				for (int mask = 0; mask < 256; mask++)
+				{
+					if (newWeights[mask] == weights[mask])
+						continue;
+					weights[mask] = newWeights[mask];
+					ModelList4k stepModels;
+					for (int m = 0; m < 256; m++)
+					{
+						if (weights[m] >= 0)
+						{
+							Model model = { (unsigned char)weights[m], (unsigned char)m };
+							stepModels.AddModel(model);
+						}
+					}
+					stepSize = stepState.SetModels(stepModels);
+				}
+
+				if (fusedSize != stepSize)
+				{
+					printf("  %s differs: size %d, model set %d: %d != %d\n", InstructionSetName(instructionSet), size, (int)i, fusedSize, stepSize);
+					success = false;
+					break;
+				}
+			}
+		}
+	}
+	return success;
+}
+
+// Evaluations rolled back to a checkpoint must leave no trace in the following evaluations
+static bool TestEvaluatorRollback()
+{
+	bool success = true;
+	const int sizes[] = { 7, 100, 3000 };
+	for (int size : sizes)
+	{
+		std::vector<unsigned char> data = GenerateData(size, size);
+		std::vector<ModelList4k> modelSets = GenerateModelSets(100, size);
+		std::vector<ModelList4k> trialSets = GenerateModelSets(100, size + 1);
+		unsigned char context[MAX_CONTEXT_LENGTH] = {};
+
+		CompressionStateEvaluator referenceEvaluator;
+		CompressionStateEvaluator trialEvaluator;
+		CompressionState referenceState(data.data(), size, DEFAULT_BASEPROB, false, &referenceEvaluator, context);
+		CompressionState trialState(data.data(), size, DEFAULT_BASEPROB, false, &trialEvaluator, context);
+		for (size_t i = 0; i < modelSets.size(); i++)
+		{
+			int referenceSize = referenceState.SetModels(modelSets[i]);
+
+			trialState.Checkpoint();
+			int checkpointSize = trialState.GetCompressedSize();
+			for (size_t j = i; j < trialSets.size(); j += 30)
+				trialState.SetModels(trialSets[j]);
+			trialState.Rollback();
+			int rollbackSize = trialState.GetCompressedSize();
+			int trialSize = trialState.SetModels(modelSets[i]);
+			trialState.Commit();
+
+			if (rollbackSize != checkpointSize || trialSize != referenceSize)
+			{
+				printf("  Differs after rollback: size %d, model set %d: %d != %d, %d != %d\n",
+					size, (int)i, rollbackSize, checkpointSize, trialSize, referenceSize);
+				success = false;
+				break;
+			}
+		}
+	}
+	return success;
+}
+
+// The model search must find the same models regardless of how many candidates are evaluated in parallel
+static bool TestSpeculativeModelSearch()
+{
+	bool success = true;
+	std::vector<unsigned char> data = GenerateData(400, 400);
+	unsigned char context[MAX_CONTEXT_LENGTH] = {};
+	const struct { CompressionType compressionType; int beamWidth; } searches[] = {
+		{ COMPRESSION_FAST, 0 }, { COMPRESSION_FAST, 2 }, { COMPRESSION_SLOW, 0 }, { COMPRESSION_VERYSLOW, 0 }
+	};
+	for (const auto& search : searches)
+	{
+		CompressionType compressionType = search.compressionType;
+		int referenceSize = 0;
+		ModelList4k referenceModels;
+		const int replicaCounts[] = { 1, 2, 5 };
+		for (int numReplicas : replicaCounts)
+		{
+			int size;
+			ModelList4k models = ApproximateModels4k(data.data(), (int)data.size(), context, compressionType, false, DEFAULT_BASEPROB, search.beamWidth, numReplicas, &size, nullptr, nullptr);
+			if (numReplicas == 1)
+			{
+				referenceSize = size;
+				referenceModels = models;
+				continue;
+			}
+
+			bool same = size == referenceSize && models.nmodels == referenceModels.nmodels;
+			for (int m = 0; same && m < models.nmodels; m++)
+				same = models[m].mask == referenceModels[m].mask && models[m].weight == referenceModels[m].weight;
+			if (!same)
+			{
+				printf("  %s, beam width %d, with %d replicas differs: %d != %d\n", CompressionTypeName(compressionType), search.beamWidth, numReplicas, size, referenceSize);
+				success = false;
+			}
+		}
+	}
+	return success;
+}
+
+// Released model predictions must be prefetched again when asked for, and give the same sizes
+static bool TestModelRelease()
+{
+	bool success = true;
+	std::vector<unsigned char> data = GenerateData(500, 500);
+	std::vector<ModelList4k> modelSets = GenerateModelSets(10, 500);
+	unsigned char context[MAX_CONTEXT_LENGTH] = {};
+
+	CompressionStateEvaluator evaluator;
+	CompressionState state(data.data(), (int)data.size(), DEFAULT_BASEPROB, false, &evaluator, context);
+	for (const ModelList4k& models : modelSets)
+	{
+		if (models.nmodels == 0)
+			continue;
+		unsigned char mask = models[0].mask;
+		int referenceSize = state.SetModels(models);
+		state.SetModels(ModelList4k());
+		for (int round = 0; round < 2 && success; round++)
+		{
+			state.ReleaseModel(mask);
+			if (state.HasPredictions(mask))
+			{
+				printf("  Model %02X still has predictions after release\n", mask);
+				success = false;
+				break;
+			}
+
+			// The prefetch task runs on a worker thread, or right away without workers
+			state.PrefetchModels(&mask, 1);
+			for (int wait = 0; wait < 10000 && !state.HasPredictions(mask); wait++)
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			if (!state.HasPredictions(mask))
+			{
+				printf("  Model %02X is not prefetched again after release %d\n", mask, round + 1);
+				success = false;
+			}
+		}
+
+		int size = state.SetModels(models);
+		if (size != referenceSize)
+		{
+			printf("  Model set with %02X differs after release: %d != %d\n", mask, size, referenceSize);
+			success = false;
+		}
+		if (!success)
+			break;
+	}
+	return success;
+}
+
+// Windowed evaluation must match evaluating the windows as separate segments, and the
+// sampled model search must match the plain search when the sample covers the whole input
+static bool TestLargeInputEstimation()
+{
+	bool success = true;
+	std::vector<unsigned char> data = GenerateData(3000, 3000);
+	unsigned char context[MAX_CONTEXT_LENGTH] = {};
+	int size;
+	ModelList4k models = ApproximateModels4k(data.data(), (int)data.size(), context, COMPRESSION_FAST, false, DEFAULT_BASEPROB, 0, 0, &size, nullptr, nullptr);
+
+	ModelList4k* modelLists[] = { &models, &models, &models };
+	const int segmentSizes[] = { 1000, 1000, 1000 };
+	long long segmentedSize = EvaluateSize4k(data.data(), 3, segmentSizes, nullptr, modelLists, DEFAULT_BASEPROB, false) - 2 * models.nmodels * 8 * BIT_PRECISION;
+	long long windowedSize = EvaluateSize4kLarge(data.data(), (long long)data.size(), models, DEFAULT_BASEPROB, false, 1000);
+	if (windowedSize != segmentedSize)
+	{
+		printf("  Windowed size differs: %lld != %lld\n", windowedSize, segmentedSize);
+		success = false;
+	}
+
+	const int wholeSegmentSize[] = { (int)data.size() };
+	long long wholeSize = EvaluateSize4k(data.data(), 1, wholeSegmentSize, nullptr, modelLists, DEFAULT_BASEPROB, false);
+	long long sampledSize;
+	ModelList4k sampledModels = ApproximateModels4kLarge(data.data(), (long long)data.size(), COMPRESSION_FAST, false, DEFAULT_BASEPROB, (int)data.size(), &sampledSize, nullptr, nullptr);
+	bool same = sampledSize == wholeSize && models.nmodels == sampledModels.nmodels;
+	for (int m = 0; same && m < models.nmodels; m++)
+		same = models[m].mask == sampledModels[m].mask && models[m].weight == sampledModels[m].weight;
+	if (!same)
+	{
+		printf("  Search on the whole input as sample differs: %lld != %lld\n", sampledSize, wholeSize);
+		success = false;
+	}
+	return success;
+}
+
+// Incremental evaluation of changing data must give the same sizes as EvaluateSize4k,
+// whether or not the previous evaluations were accepted
+static bool TestIncrementalEvaluation()
+{
+	bool success = true;
+	std::vector<unsigned char> data = GenerateData(1200, 1200);
+	std::vector<ModelList4k> modelSets = GenerateModelSets(30, 1200);
+	ModelList4k* modelLists[] = { &modelSets[29], &modelSets[14] };
+	int segmentSizes[] = { 700, 500 };
+	IncrementalEvaluator4k evaluator(2, modelLists, DEFAULT_BASEPROB, false);
+
+	unsigned int seed = 1200;
+	std::vector<unsigned char> accepted = data;
+	int acceptedSizes[] = { segmentSizes[0], segmentSizes[1] };
+	for (int i = 0; i < 40 && success; i++)
+	{
+		// Move a block, sometimes changing the size of the first segment
+		seed = seed * 1103515245 + 12345;
+		unsigned int r = seed >> 8;
+		data = accepted;
+		segmentSizes[0] = acceptedSizes[0];
+		segmentSizes[1] = acceptedSizes[1];
+		int length = 1 + r % 64;
+		int from = (r >> 6) % ((int)data.size() - length);
+		int to = (r >> 16) % ((int)data.size() - length);
+		std::vector<unsigned char> block(data.begin() + from, data.begin() + from + length);
+		data.erase(data.begin() + from, data.begin() + from + length);
+		data.insert(data.begin() + to, block.begin(), block.end());
+		if ((r & 0x30) == 0)
+		{
+			int delta = (int)((r >> 24) % 200) - 100;
+			segmentSizes[0] += delta;
+			segmentSizes[1] -= delta;
+		}
+
+		int compressedSizes[2], expectedSizes[2];
+		int size = evaluator.Evaluate(data.data(), segmentSizes, compressedSizes);
+		int expectedSize = EvaluateSize4k(data.data(), 2, segmentSizes, expectedSizes, modelLists, DEFAULT_BASEPROB, false);
+		if (size != expectedSize || compressedSizes[0] != expectedSizes[0] || compressedSizes[1] != expectedSizes[1])
+		{
+			printf("  Evaluation %d differs: %d != %d\n", i, size, expectedSize);
+			success = false;
+		}
+
+		if (r & 0x100)
+		{
+			evaluator.Accept();
+			accepted = data;
+			acceptedSizes[0] = segmentSizes[0];
+			acceptedSizes[1] = segmentSizes[1];
+		}
+	}
+	return success;
+}
+
+// Compression with a size limit must stop with a size above the limit when the full size exceeds it,
+// and otherwise give the same output as compressing without a limit
+static bool TestCompressionSizeLimit()
+{
+	bool success = true;
+	std::vector<unsigned char> data = GenerateData(2000, 2000);
+	std::vector<ModelList4k> modelSets = GenerateModelSets(20, 2000);
+	ModelList4k* modelLists[] = { &modelSets[19], &modelSets[9] };
+	const int segmentSizes[] = { 1200, 800 };
+
+	unsigned char context[MAX_CONTEXT_LENGTH] = {};
+	HashBits hashbits[2];
+	hashbits[0] = ComputeHashBits(data.data(), segmentSizes[0], context, *modelLists[0], true, false);
+	hashbits[1] = ComputeHashBits(data.data() + segmentSizes[0], segmentSizes[1], context, *modelLists[1], false, true);
+	TinyHashTable hashtable;
+
+	const int maxSize = 5000;
+	const int hashsize = 1 << 16;
+	std::vector<unsigned char> full(maxSize), limited(maxSize);
+	int fullSize = CompressFromHashBits4k(hashbits, hashtable, 2, full.data(), maxSize, false, DEFAULT_BASEPROB, hashsize, nullptr, INT_MAX);
+	if (fullSize != Compress4k(data.data(), 2, segmentSizes, limited.data(), maxSize, modelLists, false, DEFAULT_BASEPROB, hashsize, nullptr))
+	{
+		printf("  Size differs from Compress4k\n");
+		success = false;
+	}
+
+	const int limits[] = { 0, fullSize / 2, fullSize - 1, fullSize, fullSize + 1 };
+	for (int limit : limits)
+	{
+		int size = CompressFromHashBits4k(hashbits, hashtable, 2, limited.data(), maxSize, false, DEFAULT_BASEPROB, hashsize, nullptr, limit);
+		bool ok = fullSize > limit ? size > limit : size == fullSize && limited == full;
+		if (!ok)
+		{
+			printf("  Limit %d gives size %d, full size is %d\n", limit, size, fullSize);
+			success = false;
+		}
+	}
+	return success;
+}
+
+static double ReferenceInformation(const int counts[2])
+{
+	double information = 0.0;
+	for (int bit = 0; bit < 2; bit++)
+		if (counts[bit] > 0)
+			information -= counts[bit] * log2(counts[bit] / double(counts[0] + counts[1]));
+	return information;
+}
+
+static bool TestHashCollisionPrediction()
+{
+	bool success = true;
+	std::vector<unsigned char> data = GenerateData(3000, 3000);
+	std::vector<ModelList4k> modelSets = GenerateModelSets(20, 3000);
+	ModelList4k* modelLists[] = { &modelSets[19], &modelSets[9] };
+	const int segmentSizes[] = { 2000, 1000 };
+
+	unsigned char context[MAX_CONTEXT_LENGTH] = {};
+	HashBits hashbits[2];
+	hashbits[0] = ComputeHashBits(data.data(), segmentSizes[0], context, *modelLists[0], true, false);
+	hashbits[1] = ComputeHashBits(data.data() + segmentSizes[0], segmentSizes[1], context, *modelLists[1], false, true);
+
+	const int hashsizes[] = { 64, 1000, 1 << 12, 12345, 1 << 16, 1 << 20 };
+	const int numHashsizes = sizeof(hashsizes) / sizeof(hashsizes[0]);
+	long long costs[numHashsizes];
+	PredictHashCollisionCosts(hashbits, 2, hashsizes, numHashsizes, costs);
+
+	for (int h = 0; h < numHashsizes; h++)
+	{
+		// Group the contexts by reduced hash the straightforward way
+		double cost = 0.0;
+		HashReduction reduce(hashsizes[h]);
+		for (const HashBits& segment : hashbits)
+		{
+			int nmodels = (int)segment.weights.size();
+			std::map<unsigned int, std::map<unsigned int, std::vector<int>>> groups;
+			for (int i = 0; i < segment.length; i++)
+			{
+				unsigned int hash = segment.GetHash(i);
+				std::vector<int>& counts = groups[reduce(hash)][hash];
+				counts.resize(2);
+				counts[segment.bits[i / nmodels]]++;
+			}
+			for (const auto& group : groups)
+			{
+				int merged[2] = { 0, 0 };
+				for (const auto& hash : group.second)
+				{
+					merged[0] += hash.second[0];
+					merged[1] += hash.second[1];
+					cost -= ReferenceInformation(hash.second.data());
+				}
+				cost += ReferenceInformation(merged);
+			}
+		}
+
+		long long expected = (long long)(cost * BIT_PRECISION + 0.5);
+		if (llabs(costs[h] - expected) > 2)
+		{
+			printf("  Hash size %d predicts cost %lld, expected %lld\n", hashsizes[h], costs[h], expected);
+			success = false;
+		}
+	}
+
+	if (!(costs[0] > costs[numHashsizes - 1]))
+	{
+		printf("  Tiny hash size predicts cost %lld, large hash size %lld\n", costs[0], costs[numHashsizes - 1]);
+		success = false;
+	}
+	return success;
+}
+
+// The arithmetic coder written out bit by bit, with a division per coded bit
+struct ReferenceAritCoder
+{
+	std::vector<unsigned char>	output;
+	int							destBit = -1;
+	unsigned int				intervalSize = 0x80000000;
+	unsigned int				intervalMin = 0;
+
+	explicit ReferenceAritCoder(int maxSize) : output(maxSize, 0) {}
+
+	void PutBit(int bit)
+	{
+		while (--bit >= 0)
+		{
+			unsigned char mask = (unsigned char)(1 << (bit & 7));
+			output[bit >> 3] ^= mask;
+			if (output[bit >> 3] & mask)
+				break;
+		}
+	}
+
+	void Code(unsigned int zeroProb, unsigned int oneProb, int bit)
+	{
+		unsigned int threshold = (unsigned int)((uint64_t)intervalSize * zeroProb / (zeroProb + oneProb));
+		if (bit)
+		{
+			intervalMin += threshold;
+			if (intervalMin < threshold)
+				PutBit(destBit);
+			intervalSize -= threshold;
+		}
+		else
+		{
+			intervalSize = threshold;
+		}
+		while (intervalSize < 0x80000000)
+		{
+			destBit++;
+			if (intervalMin & 0x80000000)
+				PutBit(destBit);
+			intervalMin <<= 1;
+			intervalSize <<= 1;
+		}
+	}
+
+	int End()
+	{
+		if (intervalMin > 0)
+		{
+			if (intervalMin + intervalSize - 1 >= intervalMin)
+				destBit++;
+			PutBit(destBit);
+		}
+		return destBit;
+	}
+};
+
+static bool TestArithmeticCoder()
+{
+	bool success = true;
+	const int numBits = 100000;
+	const int maxSize = numBits * 4;
+	for (unsigned int seed = 1; seed <= 6; seed++)
+	{
+		// Alternate between moderate and very skewed probabilities, so runs of ones build up long carries
+		ReferenceAritCoder reference(maxSize);
+		std::vector<unsigned char> output(maxSize, 0);
+		AritState state;
+		AritCodeInit(&state, output.data());
+		unsigned int r = seed;
+		for (int i = 0; i < numBits; i++)
+		{
+			r = r * 1103515245 + 12345;
+			bool skewed = ((i >> 10) + seed) % 3 == 0;
+			unsigned int zeroProb = 1 + ((r >> 8) & (skewed ? 0xF : 0xFFFF));
+			r = r * 1103515245 + 12345;
+			unsigned int oneProb = skewed ? 1 << (16 + (r >> 29)) : 1 + ((r >> 8) & 0xFFFF);
+			r = r * 1103515245 + 12345;
+			int bit = skewed ? (r >> 8) % 1000 != 0 : (r >> 16) & 1;
+			reference.Code(zeroProb, oneProb, bit);
+			AritCode(&state, zeroProb, oneProb, bit);
+		}
+
+		int referenceBits = reference.End();
+		int bits = AritCodeEnd(&state);
+		if (bits != referenceBits || output != reference.output)
+		{
+			printf("  Seed %u codes %d bits, reference codes %d bits%s\n", seed, bits, referenceBits, output != reference.output ? " differently" : "");
+			success = false;
+		}
+	}
+	return success;
+}
+
+int main(int argc, const char* argv[])
+{
+	InitCompressor();
+
+	struct Test
+	{
+		const char* name;
+		bool (*function)();
+	};
+	const Test tests[] = {
+		{ "EvaluatorKernels", TestEvaluatorKernels },
+		{ "EvaluatorMultiModelChanges", TestEvaluatorMultiModelChanges },
+		{ "EvaluatorRollback", TestEvaluatorRollback },
+		{ "SpeculativeModelSearch", TestSpeculativeModelSearch },
+		{ "ModelRelease", TestModelRelease },
+		{ "LargeInputEstimation", TestLargeInputEstimation },
+		{ "IncrementalEvaluation", TestIncrementalEvaluation },
+		{ "CompressionSizeLimit", TestCompressionSizeLimit },
+		{ "HashCollisionPrediction", TestHashCollisionPrediction },
+		{ "ArithmeticCoder", TestArithmeticCoder },
+	};
+
+	int numFailed = 0;
+	for (const Test& test : tests)
+	{
+		printf("%s\n", test.name);
+		bool success = test.function();
+		printf("  %s\n", success ? "OK" : "FAILED");
+		if (!success)
+			numFailed++;
+	}
+
+	return numFailed != 0;
+}
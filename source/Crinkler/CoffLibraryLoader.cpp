@@ -2,11 +2,13 @@
 
 #include <windows.h>
 #include <string>
+#include <ppl.h>
 #include "HunkList.h"
 #include "CoffObjectLoader.h"
 #include "Hunk.h"
 #include "misc.h"
 #include "NameMangling.h"
+#include "StringMisc.h"
 #include "Symbol.h"
 
 using namespace std;
@@ -31,9 +33,15 @@ bool CoffLibraryLoader::Clicks(const char* data, int size) const {
 }
 
 HunkList* CoffLibraryLoader::Load(const char* data, int size, const char* module) {
+	CoffLibrary library(data, module);
+	library.LoadAll();
+	return library.TakeHunks();
+}
+
+CoffLibrary::CoffLibrary(const char* data, const char* module) :
+	m_data(data), m_module(module)
+{
 	// Assume that the header and first linker member are fine (as it is checked by click)
-	
-	HunkList* hunklist = new HunkList;
 	const char* ptr = data + 8;
 	// Skip first linker member
 	int memberSize = atoi(&ptr[48]);
@@ -73,77 +81,194 @@ HunkList* CoffLibraryLoader::Load(const char* data, int size, const char* module
 	}
 
 	// Make symbol names table
-	vector<const char*> symbolNames(numberOfSymbols);
+	m_symbolNames.resize(numberOfSymbols);
+	m_symbolOffsets.resize(numberOfSymbols);
+	m_importHunks.resize(numberOfSymbols);
 	for(int i = 0; i < numberOfSymbols; i++) {
-		symbolNames[i] = ptr;
+		int idx = indices ? indices[i] - 1 : i;
+		m_symbolNames[i] = ptr;
+		m_symbolOffsets[i] = indices ? offsets[idx] : ReadBigEndian((const unsigned char*)&offsets[idx]);
+		m_symbolsByName[ptr].push_back(i);
 		ptr += strlen(ptr) + 1;
 	}
 
-	// Add COFF
+	// COFF members, in the order they are loaded
 	int prev_offset = 0;
 	for(int i = 0; i < numberOfMembers; i++) {
-		char memberModuleName[256];
-		sprintf_s(memberModuleName, 256, "%s|%d", module, i);
 		int offset = indices ? offsets[i] : ReadBigEndian((const unsigned char*)&offsets[i]);
 		if (offset == 0 || offset == prev_offset) continue;
 		prev_offset = offset;
-		ptr = data + offset;
-		ptr += 60;	// Skip member header
-
-		// COFF
-		if(*(int*)ptr != 0xFFFF0000) {
-			CoffObjectLoader coffLoader;
-			HunkList* hl = coffLoader.Load(ptr, 0, memberModuleName);
-			hunklist->Append(hl);
-			delete hl;
+		if(!IsImport(offset)) {
+			m_membersByOffset[offset].push_back((int)m_members.size());
+			m_members.push_back({offset, i, false});
 		}
 	}
+}
 
-	// Add imports
-	for(int i = 0; i < numberOfSymbols; i++) {
-		int idx = indices ? indices[i] - 1 : i;
-		int offset = indices ? offsets[idx] : ReadBigEndian((const unsigned char*)&offsets[idx]);
-		if (offset == 0) continue;
-		ptr = data + offset;
-		ptr += 60;
+bool CoffLibrary::IsImport(int offset) const {
+	return *(int*)(m_data + offset + 60) == 0xFFFF0000;
+}
 
-		if(*(int*)ptr == 0xFFFF0000) {	// Import
-			unsigned short flags = *((unsigned short*) &ptr[18]);
-			unsigned int nameType = (flags >> 2) & 7;
-
-			ptr += 20;
-			string importName = ptr;
-			ptr += strlen(ptr) + 1;
-			const char* importDLL = ptr;
-
-			switch(nameType) {
-				case IMPORT_OBJECT_NAME_NO_PREFIX:
-					importName = StripSymbolPrefix(importName.c_str());
-					break;
-				case IMPORT_OBJECT_NAME:
-					break;
-				case IMPORT_OBJECT_NAME_UNDECORATE:
-				default:
-					importName = UndecorateSymbolName(importName.c_str());
-					break;
-			}
+HunkList* CoffLibrary::ParseMember(int index) const {
+	const Member& member = m_members[index];
+	char memberModuleName[256];
+	sprintf_s(memberModuleName, 256, "%s|%d", m_module.c_str(), member.number);
+	CoffObjectLoader coffLoader;
+	return coffLoader.Load(m_data + member.offset + 60, 0, memberModuleName);
+}
+
+void CoffLibrary::LoadMember(int index, vector<Hunk*>& loaded) {
+	if(!m_members[index].loaded)
+		AddMember(index, ParseMember(index), loaded);
+}
+
+void CoffLibrary::LoadMembers(const vector<int>& indices, vector<Hunk*>& loaded) {
+	// Parse the members concurrently, then add them in order
+	vector<HunkList*> hunkLists(indices.size());
+	concurrency::parallel_for(0, (int)indices.size(), [&](int i) {
+		if(!m_members[indices[i]].loaded)
+			hunkLists[i] = ParseMember(indices[i]);
+	});
+	for(int i = 0; i < (int)indices.size(); i++) {
+		if(hunkLists[i])
+			AddMember(indices[i], hunkLists[i], loaded);
+	}
+}
+
+void CoffLibrary::AddMember(int index, HunkList* hl, vector<Hunk*>& loaded) {
+	Member& member = m_members[index];
+	member.loaded = true;
+	for(int i = 0; i < hl->GetNumHunks(); i++) {
+		Hunk* hunk = (*hl)[i];
+		hunk->MarkHunkAsLibrary();
+		member.hunks.push_back(hunk);
+		m_loadedHunks.AddHunkBack(hunk);
+		loaded.push_back(hunk);
+	}
+	hl->Clear();	// The hunks are owned by the library
+	delete hl;
+}
+
+void CoffLibrary::LoadSymbolMember(int symbol, vector<Hunk*>& loaded) {
+	int offset = m_symbolOffsets[symbol];
+	if (offset == 0) return;
+
+	if(!IsImport(offset)) {
+		for(int index : m_membersByOffset[offset])
+			LoadMember(index, loaded);
+		return;
+	}
+
+	if(m_importHunks[symbol])
+		return;
 
-			if(strlen(symbolNames[i]) >= 6 && memcmp(symbolNames[i], "__imp_", 6) == 0) {
-				// An import
-				char dllName[256] = {};
-				for(int j = 0; importDLL[j] && importDLL[j] != '.'; j++)
-					dllName[j] = (char)tolower(importDLL[j]);
+	const char* ptr = m_data + offset + 60;
+	unsigned short flags = *((unsigned short*) &ptr[18]);
+	unsigned int nameType = (flags >> 2) & 7;
 
-				hunklist->AddHunkBack(new Hunk(symbolNames[i], importName.c_str(), dllName));
-			} else {
-				// A call stub
-				hunklist->AddHunkBack(MakeCallStub(symbolNames[i]));
+	ptr += 20;
+	string importName = ptr;
+	ptr += strlen(ptr) + 1;
+	const char* importDLL = ptr;
+
+	switch(nameType) {
+		case IMPORT_OBJECT_NAME_NO_PREFIX:
+			importName = StripSymbolPrefix(importName.c_str());
+			break;
+		case IMPORT_OBJECT_NAME:
+			break;
+		case IMPORT_OBJECT_NAME_UNDECORATE:
+		default:
+			importName = UndecorateSymbolName(importName.c_str());
+			break;
+	}
+
+	const char* symbolName = m_symbolNames[symbol];
+	Hunk* hunk;
+	if(strlen(symbolName) >= 6 && memcmp(symbolName, "__imp_", 6) == 0) {
+		// An import
+		char dllName[256] = {};
+		for(int j = 0; importDLL[j] && importDLL[j] != '.'; j++)
+			dllName[j] = (char)tolower(importDLL[j]);
+
+		hunk = new Hunk(symbolName, importName.c_str(), dllName);
+	} else {
+		// A call stub
+		hunk = MakeCallStub(symbolName);
+	}
+	hunk->MarkHunkAsLibrary();
+	m_importHunks[symbol] = hunk;
+	m_loadedHunks.AddHunkBack(hunk);
+	loaded.push_back(hunk);
+}
+
+bool CoffLibrary::LoadSymbol(const char* name, vector<Hunk*>& loaded) {
+	auto it = m_symbolsByName.find(name);
+	if(it == m_symbolsByName.end())
+		return false;
+
+	for(int symbol : it->second)
+		LoadSymbolMember(symbol, loaded);
+	return true;
+}
+
+bool CoffLibrary::LoadUndecoratedSymbol(const char* name, vector<Hunk*>& loaded) {
+	bool found = false;
+	for(int i = 0; i < (int)m_symbolNames.size(); i++) {
+		if(UndecorateSymbolName(m_symbolNames[i]).compare(name) == 0) {
+			LoadSymbolMember(i, loaded);
+			found = true;
+		}
+	}
+	return found;
+}
+
+void CoffLibrary::LoadInitializers(vector<Hunk*>& loaded) {
+	// Members with dynamic initializers are always included, see Crinkler::CreateDynamicInitializerHunk
+	vector<int> initializers;
+	for(int index = 0; index < (int)m_members.size(); index++) {
+		const char* ptr = m_data + m_members[index].offset + 60;
+		const IMAGE_FILE_HEADER* header = (const IMAGE_FILE_HEADER*)ptr;
+		const IMAGE_SECTION_HEADER* sectionHeaders = (const IMAGE_SECTION_HEADER*)(ptr + sizeof(IMAGE_FILE_HEADER));
+		const char* stringTable = ptr + header->PointerToSymbolTable + header->NumberOfSymbols*sizeof(IMAGE_SYMBOL);
+		for(int i = 0; i < header->NumberOfSections; i++) {
+			char name[9] = {};
+			memcpy(name, sectionHeaders[i].Name, 8);
+			if(EndsWith(name[0] == '/' ? &stringTable[atoi(&name[1])] : name, "CRT$XCU")) {
+				initializers.push_back(index);
+				break;
 			}
 		}
 	}
+	LoadMembers(initializers, loaded);
+}
 
-	hunklist->MarkHunksAsLibrary();
+void CoffLibrary::LoadAll() {
+	vector<Hunk*> loaded;
+	vector<int> indices(m_members.size());
+	for(int index = 0; index < (int)m_members.size(); index++)
+		indices[index] = index;
+	LoadMembers(indices, loaded);
+	for(int i = 0; i < (int)m_symbolNames.size(); i++)
+		if(m_symbolOffsets[i] != 0 && IsImport(m_symbolOffsets[i]))
+			LoadSymbolMember(i, loaded);
+}
 
+HunkList* CoffLibrary::TakeHunks() {
+	// Members in archive order followed by imports in symbol order, as when loading everything
+	HunkList* hunklist = new HunkList;
+	for(Member& member : m_members) {
+		for(Hunk* hunk : member.hunks)
+			hunklist->AddHunkBack(hunk);
+		member.hunks.clear();
+	}
+	for(Hunk*& hunk : m_importHunks) {
+		if(hunk) {
+			hunklist->AddHunkBack(hunk);
+			hunk = NULL;
+		}
+	}
+	m_loadedHunks.Clear();
 	return hunklist;
 }
 
@@ -154,7 +279,7 @@ Hunk* MakeCallStub(const char* name) {
 	stubHunk->AddSymbol(new Symbol(name, 0, SYMBOL_IS_RELOCATEABLE, stubHunk));
 
 	Relocation r;
-	r.symbolname += string("__imp_") + name;
+	r.symbolname = Name(string("__imp_") + name);
 	r.offset = 2;
 	r.type = RELOCTYPE_ABS32;
 	stubHunk->AddRelocation(r);
@@ -2,9 +2,14 @@
 #ifndef _COFF_LIBRARY_LOADER_H_
 #define _COFF_LIBRARY_LOADER_H_
 
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "HunkList.h"
 #include "HunkLoader.h"
+#include "NameTable.h"
 class Hunk;
-class HunkList;
+class Symbol;
 
 class CoffLibraryLoader : public HunkLoader {
 public:
@@ -12,6 +17,49 @@ public:
 	virtual HunkList*	Load(const char* data, int size, const char* module);
 };
 
+// A COFF library whose members are loaded on demand through the archive symbol index.
+// The data must stay valid while members are loaded. TakeHunks returns the loaded hunks
+// in the same order as loading the whole library.
+class CoffLibrary {
+	struct Member {
+		int					offset;
+		int					number;		// Index in the linker member
+		bool				loaded;
+		std::vector<Hunk*>	hunks;
+	};
+
+	const char*					m_data;
+	std::string					m_module;
+	std::vector<const char*>	m_symbolNames;
+	std::vector<int>			m_symbolOffsets;	// Member offset per symbol, 0 if none
+	std::vector<Hunk*>			m_importHunks;		// Per symbol, NULL if not loaded
+	std::vector<Member>			m_members;			// COFF members in load order
+	std::unordered_map<std::string, std::vector<int>>	m_symbolsByName;
+	std::unordered_map<int, std::vector<int>>			m_membersByOffset;
+	HunkList					m_loadedHunks;		// Owns the hunks until they are taken
+
+	bool		IsImport(int offset) const;
+	HunkList*	ParseMember(int index) const;
+	void		AddMember(int index, HunkList* hl, std::vector<Hunk*>& loaded);
+	void		LoadMember(int index, std::vector<Hunk*>& loaded);
+	void		LoadMembers(const std::vector<int>& indices, std::vector<Hunk*>& loaded);
+	void		LoadSymbolMember(int symbol, std::vector<Hunk*>& loaded);
+public:
+	CoffLibrary(const char* data, const char* module);
+
+	// Load the members defining a symbol and append the new hunks to loaded.
+	// Return false if the library does not define the symbol.
+	bool		LoadSymbol(const char* name, std::vector<Hunk*>& loaded);
+	bool		LoadUndecoratedSymbol(const char* name, std::vector<Hunk*>& loaded);
+	void		LoadInitializers(std::vector<Hunk*>& loaded);
+	void		LoadAll();
+
+	Symbol*		FindSymbol(const char* name) const				{ return m_loadedHunks.FindSymbol(name); }
+	Symbol*		FindSymbol(const Name& name) const				{ return m_loadedHunks.FindSymbol(name); }
+	Symbol*		FindUndecoratedSymbol(const char* name) const	{ return m_loadedHunks.FindUndecoratedSymbol(name); }
+	HunkList*	TakeHunks();
+};
+
 Hunk* MakeCallStub(const char* name);
 
 #endif
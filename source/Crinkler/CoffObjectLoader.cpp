@@ -89,7 +89,8 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 		Hunk* hunk = new Hunk(hunkName, data+sectionHeaders[i].PointerToRawData,	// Data pointer
 								flags, GetAlignmentBitsFromCharacteristics(chars),	// Alignment
 								isInitialized ? sectionHeaders[i].SizeOfRawData : 0,
-								sectionHeaders[i].SizeOfRawData);	// Virtual size
+								sectionHeaders[i].SizeOfRawData,	// Virtual size
+								true);	// Refer to the loaded data until modified
 		hunklist->AddHunkBack(hunk);
 
 		// Relocations
@@ -105,9 +106,9 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 				// Construct local name
 				char name[1000];
 				sprintf_s(name, 1000, "l[%s(%d)]!%s", module, symbolIndex, symbolName.c_str());
-				r.symbolname = name;
+				r.symbolname = Name(name);
 			} else {
-				r.symbolname = symbolName;
+				r.symbolname = Name(symbolName);
 			}
 			r.offset = relocs[j].VirtualAddress;
 			switch(relocs[j].Type) {
@@ -118,7 +119,7 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 				case IMAGE_REL_I386_REL32:
 					r.type = RELOCTYPE_REL32;
 			}
-			r.objectname = StripNumeral(StripPath(module));
+			r.objectname = Name(StripNumeral(StripPath(module)));
 			
 			hunk->AddRelocation(r);
 		}
@@ -153,11 +154,11 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 
 				char symname[1000];
 				sprintf_s(symname, 1000, "l[%s(%d)]!%s", module, i, s->name.c_str());
-				s->name = symname;
+				s->name = Name(symname);
 				s->flags |= SYMBOL_IS_LOCAL;
 				if(sym->StorageClass == IMAGE_SYM_CLASS_STATIC && sym->NumberOfAuxSymbols == 1) {
 					s->flags |= SYMBOL_IS_SECTION;
-					s->miscString = module;
+					s->miscString = Name(module);
 				}
 			}
 			s->hunk->AddSymbol(s);
@@ -173,7 +174,7 @@ HunkList* CoffObjectLoader::Load(const char* data, int size, const char* module)
 		} else if(sym->SectionNumber == 0 && sym->StorageClass == IMAGE_SYM_CLASS_WEAK_EXTERNAL && sym->Value == 0) {
 			// Weak external
 			const IMAGE_AUX_SYMBOL* aux = (const IMAGE_AUX_SYMBOL*) (sym+1);
-			s->secondaryName = GetSymbolName(&symbolTable[aux->Sym.TagIndex], stringTable);
+			s->secondaryName = Name(GetSymbolName(&symbolTable[aux->Sym.TagIndex], stringTable));
 			s->hunk = constantsHunk;
 			s->flags = 0;
 			s->hunk->AddSymbol(s);
@@ -4,6 +4,11 @@
 
 #include <set>
 #include <ctime>
+#include <cmath>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 #include <ppl.h>
 
 #include "HunkList.h"
@@ -75,6 +80,10 @@ Crinkler::Crinkler():
 	m_useSafeImporting(true),
 	m_hashtries(0),
 	m_hunktries(0),
+	m_hunkBatch(0),
+	m_hunkSearch(ORDERSEARCH_GREEDY),
+	m_hunkTimeLimit(0),
+	m_beamWidth(0),
 	m_printFlags(0),
 	m_showProgressBar(false),
 	m_useTinyHeader(false),
@@ -130,13 +139,50 @@ void Crinkler::OverrideAlignments(HunkList& hunklist) {
 	}
 }
 
-void Crinkler::Load(const char* filename) {
-	HunkList* hunkList = m_hunkLoader.LoadFromFile(filename);
-	if(hunkList) {
-		m_hunkPool.Append(hunkList);
-		delete hunkList;
-	} else {
-		Log::Error(filename, "Unsupported file type");
+void Crinkler::Load(const vector<string>& filenames) {
+	// Map and parse the files concurrently. Nothing in here may report a fatal error, as that would
+	// exit while other files are still being parsed. Failing files are left for the serial pass.
+	int numFiles = (int)filenames.size();
+	vector<unique_ptr<MemoryFile>> files(numFiles);
+	vector<CoffLibrary*> libraries(numFiles);
+	vector<HunkList*> hunkLists(numFiles);
+	concurrency::parallel_for(0, numFiles, [&](int i) {
+		const char* filename = filenames[i].c_str();
+		files[i].reset(new MemoryFile(filename, false, true));
+		const char* data = files[i]->GetPtr();
+		int size = files[i]->GetSize();
+		if(data == NULL)
+			return;
+		if(CoffLibraryLoader().Clicks(data, size)) {
+			// Only the members needed to resolve symbols are loaded, when linking
+			libraries[i] = new CoffLibrary(data, filename);
+		} else if(CoffObjectLoader().Clicks(data, size)) {
+			hunkLists[i] = CoffObjectLoader().Load(data, size, filename);
+		}
+	});
+
+	// Add them in command line order, so symbols resolve as when loading one file at a time.
+	// The first failing file on the command line is the one reported.
+	for(int i = 0; i < numFiles; i++) {
+		const char* filename = filenames[i].c_str();
+		if(files[i]->GetPtr() == NULL)
+			Log::Error("", "Cannot open file '%s'\n", filename);
+		if(!libraries[i] && !hunkLists[i])
+			hunkLists[i] = m_hunkLoader.Load(files[i]->GetPtr(), files[i]->GetSize(), filename);
+
+		if(libraries[i]) {
+			Library library;
+			library.position = m_hunkPool.GetNumHunks();
+			library.library.reset(libraries[i]);
+			library.file = move(files[i]);
+			m_libraries.push_back(move(library));
+		} else if(hunkLists[i]) {
+			m_hunkPool.Append(hunkLists[i]);
+			delete hunkLists[i];
+			m_inputFiles.push_back(move(files[i]));
+		} else {
+			Log::Error(filename, "Unsupported file type");
+		}
 	}
 }
 
@@ -165,6 +211,117 @@ void Crinkler::AddRuntimeLibrary() {
 	delete hunklist;
 }
 
+void Crinkler::LoadLibraryMembers() {
+	if(m_libraries.empty())
+		return;
+
+	unordered_map<const Hunk*, int> positions;
+	for(int i = 0; i < m_hunkPool.GetNumHunks(); i++)
+		positions[m_hunkPool[i]] = i;
+
+	vector<Name> pending;
+	vector<Hunk*> loaded;
+	auto addReferences = [&](Hunk* hunk) {
+		for(int i = 0; i < hunk->GetNumRelocations(); i++)
+			pending.push_back(hunk->GetRelocations()[i].symbolname);
+	};
+	auto addLoaded = [&]() {
+		for(Hunk* hunk : loaded)
+			addReferences(hunk);
+		loaded.clear();
+	};
+
+	for(int i = 0; i < m_hunkPool.GetNumHunks(); i++)
+		addReferences(m_hunkPool[i]);
+	for(Library& library : m_libraries)
+		library.library->LoadInitializers(loaded);
+	addLoaded();
+
+	// Symbols kept by RemoveUnreferencedHunks
+	for(const Export& e : m_exports) {
+		if(!e.HasValue())
+			pending.push_back(Name(e.GetSymbol()));
+	}
+	pending.push_back(Name("__imp__LoadLibraryA@4"));
+	pending.push_back(Name("__imp__MessageBoxA@16"));
+
+	// Entry point. Normal symbols take precedence over library symbols, which take precedence over weak ones.
+	string entryName = GetEntrySymbolName();
+	Symbol* entry = m_hunkPool.FindUndecoratedSymbol(entryName.c_str());
+	if(entry == NULL || entry->fromLibrary || entry->secondaryName.size() > 0) {
+		int limit = entry && entry->secondaryName.empty() ? positions[entry->hunk] : INT_MAX;
+		for(Library& library : m_libraries) {
+			if(library.position > limit)
+				break;
+			if(library.library->LoadUndecoratedSymbol(entryName.c_str(), loaded)) {
+				Symbol* s = library.library->FindUndecoratedSymbol(entryName.c_str());
+				if(s && s->secondaryName.empty())
+					break;
+			}
+		}
+		addLoaded();
+	}
+
+	// Load the definitions of referenced symbols until nothing more is referenced. As in
+	// HunkList::FindSymbol, the first non-weak definition wins, so libraries after it are skipped.
+	unordered_set<int> resolved;
+	while(!pending.empty()) {
+		Name name = pending.back();
+		pending.pop_back();
+		if(!resolved.insert(name.GetId()).second)
+			continue;
+
+		vector<Name> weakTargets;
+		Symbol* s = m_hunkPool.FindSymbol(name);
+		int limit = INT_MAX;
+		if(s && s->secondaryName.empty())
+			limit = positions[s->hunk];
+		else if(s)
+			weakTargets.push_back(s->secondaryName);
+
+		for(Library& library : m_libraries) {
+			if(library.position > limit)
+				break;
+			if(!library.library->LoadSymbol(name.c_str(), loaded))
+				continue;
+
+			Symbol* ls = library.library->FindSymbol(name);
+			if(ls && ls->secondaryName.empty()) {
+				weakTargets.clear();
+				break;
+			} else if(ls) {
+				weakTargets.push_back(ls->secondaryName);
+			}
+		}
+		addLoaded();
+		if(limit != INT_MAX)
+			weakTargets.clear();
+		for(const Name& target : weakTargets)
+			pending.push_back(target);
+	}
+
+	// Insert the loaded hunks where the libraries were given
+	vector<Hunk*> hunks;
+	for(int i = 0; i < m_hunkPool.GetNumHunks(); i++)
+		hunks.push_back(m_hunkPool[i]);
+	m_hunkPool.Clear();
+	int next = 0;
+	for(Library& library : m_libraries) {
+		while(next < library.position)
+			m_hunkPool.AddHunkBack(hunks[next++]);
+		HunkList* libraryHunks = library.library->TakeHunks();
+		for(int i = 0; i < libraryHunks->GetNumHunks(); i++)
+			m_hunkPool.AddHunkBack((*libraryHunks)[i]);
+		libraryHunks->Clear();
+		delete libraryHunks;
+	}
+	while(next < (int)hunks.size())
+		m_hunkPool.AddHunkBack(hunks[next++]);
+	for(Library& library : m_libraries)
+		m_inputFiles.push_back(move(library.file));
+	m_libraries.clear();
+}
+
 std::string Crinkler::GetEntrySymbolName() const {
 	if(m_entry.empty()) {
 		switch(m_subsystem) {
@@ -283,6 +440,12 @@ Hunk* Crinkler::CreateModelHunk(int splittingPoint, int rawsize) {
 	return models;
 }
 
+// Up to this many tries, the default, every hash size is compressed in full and the result is exact
+static const int MAX_EXACT_HASH_TRIES = 100;
+// With more tries, only this many sizes with the least predicted collision cost are compressed.
+// On 1000 tries, the best 64 came within a byte of compressing the first 100 sizes in full.
+static const int MAX_HASH_COMPRESSIONS = 64;
+
 int Crinkler::OptimizeHashsize(unsigned char* data, int datasize, int hashsize, int splittingPoint, int tries) {
 	if(tries == 0)
 		return hashsize;
@@ -297,26 +460,65 @@ int Crinkler::OptimizeHashsize(unsigned char* data, int datasize, int hashsize,
 	hashbits[0] = ComputeHashBits(data, splittingPoint, context, m_modellist1, true, false);
 	hashbits[1] = ComputeHashBits(data + splittingPoint, datasize - splittingPoint, context, m_modellist2, false, true);
 
-	uint32_t* hashsizes = new uint32_t[tries];
+	int* hashsizes = new int[tries];
 	for (int i = 0; i < tries; i++) {
 		hashsize = PreviousPrime(hashsize / 2) * 2;
 		hashsizes[i] = hashsize;
 	}
 
 	int* sizes = new int[tries];
+	vector<int> candidates(tries);
+	for (int i = 0; i < tries; i++) {
+		candidates[i] = i;
+		sizes[i] = INT_MAX;
+	}
+	if (tries > MAX_EXACT_HASH_TRIES) {
+		// Only compress the sizes predicted to lose the least to hash collisions
+		vector<long long> costs(tries);
+		PredictHashCollisionCosts(hashbits, 2, hashsizes, tries, costs.data());
+		stable_sort(candidates.begin(), candidates.end(), [&costs](int a, int b) { return costs[a] < costs[b]; });
+		candidates.resize(MAX_HASH_COMPRESSIONS);
+		sort(candidates.begin(), candidates.end());
+	}
+	int numCandidates = (int)candidates.size();
+
+	// Compression of a hash size stops once it is known to be larger than the smallest complete one.
+	// Every coarseStep-th size is tried first, then the others nearest to the best of those first,
+	// so the limit is low early on. Only sizes that cannot be the smallest are cut short, so the
+	// result is the same as when compressing all sizes in full.
+	int coarseStep = max(1, (int)sqrt((double)numCandidates));
+	vector<int> order;
+	for (int i = 0; i < numCandidates; i += coarseStep)
+		order.push_back(i);
+	int numCoarse = (int)order.size();
 
 	int progress = 0;
+	atomic<int> sizeLimit(INT_MAX);
 	concurrency::combinable<vector<unsigned char>> buffers([maxsize]() { return vector<unsigned char>(maxsize, 0); });
-	concurrency::combinable<vector<TinyHashEntry>> hashtable1([&hashbits]() { return vector<TinyHashEntry>(hashbits[0].tinyhashsize); });
-	concurrency::combinable<vector<TinyHashEntry>> hashtable2([&hashbits]() { return vector<TinyHashEntry>(hashbits[1].tinyhashsize); });
+	concurrency::combinable<TinyHashTable> hashtables([]() { return TinyHashTable(); });
 	concurrency::critical_section cs;
-	concurrency::parallel_for(0, tries, [&](int i) {
-		TinyHashEntry* hashtables[] = { hashtable1.local().data(), hashtable2.local().data() };
-		sizes[i] = CompressFromHashBits4k(hashbits, hashtables, 2, buffers.local().data(), maxsize, m_saturate != 0, CRINKLER_BASEPROB, hashsizes[i], nullptr);
+	auto compress = [&](int j) {
+		int i = candidates[order[j]];
+		sizes[i] = CompressFromHashBits4k(hashbits, hashtables.local(), 2, buffers.local().data(), maxsize, m_saturate != 0, CRINKLER_BASEPROB, hashsizes[i], nullptr, sizeLimit);
 
 		Concurrency::critical_section::scoped_lock l(cs);
-		m_progressBar.Update(++progress, m_hashtries);
-	});
+		if (sizes[i] < sizeLimit)
+			sizeLimit = sizes[i];
+		m_progressBar.Update(++progress, numCandidates);
+	};
+	concurrency::parallel_for(0, numCoarse, compress);
+
+	int coarseBest = 0;
+	for (int j = 0; j < numCoarse; j++) {
+		if (sizes[candidates[order[j]]] <= sizes[candidates[coarseBest]])
+			coarseBest = order[j];
+	}
+	for (int i = 0; i < numCandidates; i++) {
+		if (i % coarseStep != 0)
+			order.push_back(i);
+	}
+	stable_sort(order.begin() + numCoarse, order.end(), [coarseBest](int a, int b) { return abs(a - coarseBest) < abs(b - coarseBest); });
+	concurrency::parallel_for(numCoarse, numCandidates, compress);
 
 	for (int i = 0; i < tries; i++) {
 		if (sizes[i] <= bestsize) {
@@ -367,7 +569,7 @@ int Crinkler::EstimateModels(unsigned char* data, int datasize, int splittingPoi
 
 		int new_size1, new_size2;
 		m_progressBar.BeginTask(reestimate ? "Reestimating models for code" : "Estimating models for code");
-		modellist1 = ApproximateModels4k(data, splittingPoint, contexts[0], m_compressionType, m_saturate != 0, CRINKLER_BASEPROB, &new_size1, ProgressUpdateCallback, &m_progressBar);
+		modellist1 = ApproximateModels4k(data, splittingPoint, contexts[0], m_compressionType, m_saturate != 0, CRINKLER_BASEPROB, m_beamWidth, 0, &new_size1, ProgressUpdateCallback, &m_progressBar);
 		m_progressBar.EndTask();
 
 		if(new_size1 < size1)
@@ -382,7 +584,7 @@ int Crinkler::EstimateModels(unsigned char* data, int datasize, int splittingPoi
 		printf("Estimated compressed size of code: %.2f\n", size1 / (float)(BIT_PRECISION * 8));
 
 		m_progressBar.BeginTask(reestimate ? "Reestimating models for data" : "Estimating models for data");
-		modellist2 = ApproximateModels4k(data + splittingPoint, datasize - splittingPoint, contexts[1], m_compressionType, m_saturate != 0, CRINKLER_BASEPROB, &new_size2, ProgressUpdateCallback, &m_progressBar);
+		modellist2 = ApproximateModels4k(data + splittingPoint, datasize - splittingPoint, contexts[1], m_compressionType, m_saturate != 0, CRINKLER_BASEPROB, m_beamWidth, 0, &new_size2, ProgressUpdateCallback, &m_progressBar);
 		m_progressBar.EndTask();
 
 		if(new_size2 < size2)
@@ -1102,7 +1304,7 @@ Hunk* Crinkler::CreateDynamicInitializerHunk()
 			Relocation* relocations = hunk->GetRelocations();
 			for(int i = 0; i < num_relocations; i++)
 			{
-				symbols.push_back(m_hunkPool.FindSymbol(relocations[i].symbolname.c_str()));
+				symbols.push_back(m_hunkPool.FindSymbol(relocations[i].symbolname.GetId()));
 			}
 		}
 	}
@@ -1151,6 +1353,8 @@ void Crinkler::Link(const char* filename) {
 	}
 
 
+	LoadLibraryMembers();
+
 	// Find entry hunk and move it to front
 	Symbol* entry = FindEntryPoint();
 	if(entry == NULL)
@@ -1326,10 +1530,10 @@ void Crinkler::Link(const char* filename) {
 
 			idealsize = EstimateModels((unsigned char*)phase1->GetPtr(), phase1->GetRawSize(), splittingPoint, false, m_useTinyHeader, INT_MAX, INT_MAX);
 
-			if (m_hunktries > 0)
+			if (m_hunktries > 0 || m_hunkTimeLimit > 0)
 			{
 				int target_size1, target_size2;
-				EmpiricalHunkSorter::SortHunkList(&m_hunkPool, *m_transform, m_modellist1, m_modellist2, m_modellist1k, CRINKLER_BASEPROB, m_saturate != 0, m_hunktries, m_showProgressBar ? &m_windowBar : NULL, m_useTinyHeader, &target_size1, &target_size2);
+				EmpiricalHunkSorter::SortHunkList(&m_hunkPool, *m_transform, m_modellist1, m_modellist2, m_modellist1k, CRINKLER_BASEPROB, m_saturate != 0, m_hunktries, m_hunkBatch, m_hunkSearch, m_hunkTimeLimit, m_showProgressBar ? &m_windowBar : NULL, m_useTinyHeader, &target_size1, &target_size2);
 				delete phase1;
 				delete phase1Untransformed;
 				m_transform->LinkAndTransform(&m_hunkPool, importSymbol, CRINKLER_CODEBASE, phase1, &phase1Untransformed, &splittingPoint, true);
@@ -1472,6 +1676,9 @@ void Crinkler::PrintOptions(FILE *out) {
 	if(!m_useTinyHeader)
 	{
 		fprintf(out, " /COMPMODE:%s", CompressionTypeName(m_compressionType));
+		if (m_beamWidth > 0) {
+			fprintf(out, " /BEAMWIDTH:%d", m_beamWidth);
+		}
 		if (m_saturate) {
 			fprintf(out, " /SATURATE");
 		}
@@ -1483,7 +1690,17 @@ void Crinkler::PrintOptions(FILE *out) {
 		{
 			fprintf(out, " /HASHTRIES:%d", m_hashtries);
 		}
-		fprintf(out, " /ORDERTRIES:%d", m_hunktries);
+		if (m_hunkTimeLimit > 0) {
+			fprintf(out, " /ORDERTIME:%d", m_hunkTimeLimit);
+		} else {
+			fprintf(out, " /ORDERTRIES:%d", m_hunktries);
+		}
+		if (m_hunkSearch != ORDERSEARCH_GREEDY) {
+			fprintf(out, " /ORDERSEARCH:%s", OrderSearchTypeName(m_hunkSearch));
+		}
+		if (m_hunkBatch > 0) {
+			fprintf(out, " /ORDERBATCH:%d", m_hunkBatch);
+		}
 	}
 	for(int i = 0; i < (int)m_rangeDlls.size(); i++) {
 		fprintf(out, " /RANGE:%s", m_rangeDlls[i].c_str());
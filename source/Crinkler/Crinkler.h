@@ -3,11 +3,14 @@
 #define _CRINKLER_H_
 
 #include <map>
+#include <memory>
 #include <set>
 #include <string>
 #include <cstdio>
 
 #include "MultiLoader.h"
+#include "CoffLibraryLoader.h"
+#include "MemoryFile.h"
 #include "HunkList.h"
 #include "../Compressor/Compressor.h"
 #include "Transform.h"
@@ -17,6 +20,8 @@
 #include "CompositeProgressBar.h"
 #include "Export.h"
 #include "Reuse.h"
+#include "OrderSearchStrategy.h"
+#include "ObjectPool.h"
 
 
 class HunkLoader;
@@ -38,8 +43,17 @@ static const int PRINT_MODELS =		4;
 static const int CRINKLER_LINKER_VERSION = 0x3332;
 
 class Crinkler {
+	struct Library {
+		int								position;	// Index in the hunk pool where its hunks are inserted
+		std::unique_ptr<MemoryFile>		file;
+		std::unique_ptr<CoffLibrary>	library;
+	};
+
+	ObjectArena							m_arena;		// Hunks and symbols of the link. Declared first to be released last.
 	MultiLoader							m_hunkLoader;
 	HunkList							m_hunkPool;
+	std::vector<Library>				m_libraries;	// Libraries whose members are loaded when linking
+	std::vector<std::unique_ptr<MemoryFile>>	m_inputFiles;	// Data shared by the loaded hunks
 	std::string							m_entry;
 	std::string							m_summaryFilename;
 	std::string							m_reuseFilename;
@@ -47,6 +61,10 @@ class Crinkler {
 	int									m_hashsize;
 	int									m_hashtries;
 	int									m_hunktries;
+	int									m_hunkBatch;
+	OrderSearchType						m_hunkSearch;
+	int									m_hunkTimeLimit;
+	int									m_beamWidth;
 	int									m_printFlags;
 	bool								m_useSafeImporting;
 	CompressionType						m_compressionType;
@@ -76,6 +94,7 @@ class Crinkler {
 	WindowProgressBar					m_windowBar;
 	CompositeProgressBar				m_progressBar;
 
+	void	LoadLibraryMembers();
 	Symbol*	FindEntryPoint();
 	void RemoveUnreferencedHunks(Hunk* base);
 	std::string GetEntrySymbolName() const;
@@ -99,7 +118,7 @@ public:
 	Crinkler();
 	~Crinkler();
 
-	void Load(const char* filename);
+	void Load(const std::vector<std::string>& filenames);
 	void Load(const char* data, int size, const char* module);
 	void AddRuntimeLibrary();
 	void Recompress(const char* input_filename, const char* output_filename);
@@ -126,6 +145,10 @@ public:
 	void SetHashsize(int hashsize)							{ m_hashsize = hashsize*1024*1024; }
 	void SetHashtries(int hashtries)						{ m_hashtries = hashtries; }
 	void SetHunktries(int hunktries)						{ m_hunktries = hunktries; }
+	void SetHunkBatch(int hunkBatch)						{ m_hunkBatch = hunkBatch; }
+	void SetHunkSearch(OrderSearchType hunkSearch)			{ m_hunkSearch = hunkSearch; }
+	void SetHunkTimeLimit(int hunkTimeLimit)				{ m_hunkTimeLimit = hunkTimeLimit; }
+	void SetBeamWidth(int beamWidth)						{ m_beamWidth = beamWidth; }
 	void SetSaturate(int saturate)							{ m_saturate = saturate; }
 	
 	void SetImportingType(bool safe)						{ m_useSafeImporting = safe; }
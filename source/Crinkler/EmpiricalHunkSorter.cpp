@@ -1,17 +1,30 @@
 #include "EmpiricalHunkSorter.h"
-#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
-#include <ppl.h>
+#include <memory>
+#include <random>
+#include <vector>
 #include "HunkList.h"
 #include "Hunk.h"
 #include "../Compressor/CompressionStream.h"
+#include "../Compressor/IncrementalEvaluator.h"
+#include "../Compressor/ThreadPool.h"
 #include "ProgressBar.h"
 #include "Crinkler.h"
+#include "OrderSearchStrategy.h"
+#include "HunkLayout.h"
 
 using namespace std;
 
-static void PermuteHunklist(HunkList* hunklist, int strength) {
-	int n_permutes = (rand() % strength) + 1;
+// Batch candidate i of round r permutes with a generator seeded by (BATCH_SEED, r, i), so the
+// search only depends on the batch size, not on the number of threads or the evaluation order.
+static const unsigned int BATCH_SEED = 1;
+
+template<class Random>
+static void PermuteHunklist(HunkList* hunklist, int strength, Random& random) {
+	int n_permutes = (random() % strength) + 1;
 	for (int p = 0 ; p < n_permutes ; p++)
 	{
 		int h1i, h2i;
@@ -39,14 +52,14 @@ static void PermuteHunklist(HunkList* hunklist, int strength) {
 
 		int s;
 		do {
-			s = rand() % 3;
+			s = random() % 3;
 		} while (sections[s] < 2);
 		int max_n = sections[s]/2;
 		if (max_n > strength) max_n = strength;
-		int n = (rand() % max_n) + 1;
-		h1i = rand() % (sections[s] - n + 1);
+		int n = (random() % max_n) + 1;
+		h1i = random() % (sections[s] - n + 1);
 		do {
-			h2i = rand() % (sections[s] - n + 1);
+			h2i = random() % (sections[s] - n + 1);
 		} while (h2i == h1i);
 		int base = (s > 0 ? sections[0] : 0) + (s > 1 ? sections[1] : 0);
 
@@ -67,147 +80,304 @@ static void PermuteHunklist(HunkList* hunklist, int strength) {
 	}
 }
 
+template<class Random>
+static void PermuteOrdering(HunkList* hunklist, Random& random) {
+	// Save DLL hunk
+	Hunk* dllhunk = nullptr;
+	int dlli;
+	for(dlli = 0; dlli < hunklist->GetNumHunks(); dlli++) {
+		if((*hunklist)[dlli]->GetFlags() & HUNK_IS_LEADING) {
+			dllhunk = (*hunklist)[dlli];
+			hunklist->RemoveHunk(dllhunk);
+			break;
+		}
+	}
+
+	Hunk* eh = nullptr;
+	int ehi;
+	for (ehi = 0; ehi < hunklist->GetNumHunks(); ehi++) {
+		if ((*hunklist)[ehi]->GetFlags() & HUNK_IS_TRAILING) {
+			eh = (*hunklist)[ehi];
+			hunklist->RemoveHunk(eh);
+			break;
+		}
+	}
+
+	PermuteHunklist(hunklist, 2, random);
+
+	// Restore export hunk, if present
+	if (eh) {
+		hunklist->InsertHunk(ehi, eh);
+	}
+
+	if(dllhunk)
+	{
+		hunklist->InsertHunk(dlli, dllhunk);
+	}
+}
+
+static int EvaluateSize1k(Hunk* phase1, ModelList1k& models1k) {
+	int size = 0;
+	int max_size = phase1->GetRawSize() * 2 + 1000;
+	unsigned char* compressed_data_ptr = new unsigned char[max_size];
+	Compress1k((unsigned char*)phase1->GetPtr(), phase1->GetRawSize(), compressed_data_ptr, max_size, models1k, nullptr, &size);	//TODO: Estimate instead of compress
+	delete[] compressed_data_ptr;
+	return size;
+}
+
 EmpiricalHunkSorter::EmpiricalHunkSorter() {
 }
 
 EmpiricalHunkSorter::~EmpiricalHunkSorter() {
 }
 
-int EmpiricalHunkSorter::TryHunkCombination(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, bool use1KMode, int* out_size1, int* out_size2)
+int EmpiricalHunkSorter::TryHunkCombination(HunkList* hunklist, HunkLayout& layout, Hunk* phase1, IncrementalEvaluator4k* evaluator, ModelList1k& models1k, bool use1KMode, int* out_size1, int* out_size2)
 {
 	int splittingPoint;
-
-	Hunk* phase1;
-	Symbol* import = hunklist->FindSymbol("_Import");
-	transform.LinkAndTransform(hunklist, import, CRINKLER_CODEBASE, phase1, NULL, &splittingPoint, false);
+	layout.LinkAndTransform(hunklist, phase1, &splittingPoint);
 
 	int totalsize = 0;
 	if (use1KMode)
 	{
-		int max_size = phase1->GetRawSize() * 2 + 1000;
-		unsigned char* compressed_data_ptr = new unsigned char[max_size];
-		Compress1k((unsigned char*)phase1->GetPtr(), phase1->GetRawSize(), compressed_data_ptr, max_size, models1k, nullptr, &totalsize);	//TODO: Estimate instead of compress
-		delete[] compressed_data_ptr;
+		totalsize = EvaluateSize1k(phase1, models1k);
 
 		if(out_size1) *out_size1 = totalsize;
 		if(out_size2) *out_size2 = 0;
 	}
 	else
 	{
-		ModelList4k* ModelLists[] = { &codeModels, &dataModels };
+		// Only the part after the first moved byte is evaluated again
 		int sectionSizes[] = {splittingPoint, phase1->GetRawSize() - splittingPoint};
 		int compressedSizes[2] = {};
-		totalsize = EvaluateSize4k((unsigned char*)phase1->GetPtr(), 2, sectionSizes, compressedSizes, ModelLists, baseprob, saturate);
+		totalsize = evaluator->Evaluate((unsigned char*)phase1->GetPtr(), sectionSizes, compressedSizes);
 		
 		if (out_size1) *out_size1 = compressedSizes[0];
 		if (out_size2) *out_size2 = compressedSizes[1];
-
-		delete phase1;
 	}
 
 	return totalsize;
 }
 
-int EmpiricalHunkSorter::SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2)
+int EmpiricalHunkSorter::TryHunkBatch(HunkList* hunklist, HunkLayout& layout, Hunk* current, Hunk** phase1s, IncrementalEvaluator4k** evaluators, int numEvaluators, ModelList1k& models1k, bool use1KMode, int round, int batchSize, int* out_size1, int* out_size2)
+{
+	int nHunks = hunklist->GetNumHunks();
+	vector<vector<Hunk*>> orders(batchSize);
+	vector<int> splittingPoints(batchSize);
+
+	// Link serially, as a transform may disable itself while linking
+	int currentSplittingPoint = 0;
+	if (!use1KMode)
+		layout.LinkAndTransform(hunklist, current, &currentSplittingPoint);
+	HunkList candidate;
+	for (int i = 0; i < batchSize; i++) {
+		seed_seq seed = { BATCH_SEED, (unsigned int)round, (unsigned int)i };
+		mt19937 random(seed);
+
+		candidate.Clear();
+		for (int j = 0; j < nHunks; j++)
+			candidate.AddHunkBack((*hunklist)[j]);
+		PermuteOrdering(&candidate, random);
+		for (int j = 0; j < nHunks; j++)
+			orders[i].push_back(candidate[j]);
+
+		layout.LinkAndTransform(&candidate, phase1s[i], &splittingPoints[i]);
+	}
+	candidate.Clear();	// The hunks are owned by hunklist
+
+	// Every evaluator takes candidates until none are left. It first accepts the current ordering,
+	// so the candidates, which all permute it, are evaluated from their first moved byte.
+	vector<int> sizes(batchSize), sizes1(batchSize), sizes2(batchSize);
+	atomic<int> nextCandidate(0);
+	ParallelFor(0, min(numEvaluators, batchSize), [&](int e) {
+		IncrementalEvaluator4k* evaluator = evaluators[e];
+		if (!use1KMode)
+		{
+			int sectionSizes[] = { currentSplittingPoint, current->GetRawSize() - currentSplittingPoint };
+			evaluator->Evaluate((unsigned char*)current->GetPtr(), sectionSizes, nullptr);
+			evaluator->Accept();
+		}
+
+		for (int i = nextCandidate++; i < batchSize; i = nextCandidate++) {
+			Hunk* phase1 = phase1s[i];
+			if (use1KMode)
+			{
+				sizes[i] = sizes1[i] = EvaluateSize1k(phase1, models1k);
+				sizes2[i] = 0;
+			}
+			else
+			{
+				int sectionSizes[] = { splittingPoints[i], phase1->GetRawSize() - splittingPoints[i] };
+				int compressedSizes[2] = {};
+				sizes[i] = evaluator->Evaluate((unsigned char*)phase1->GetPtr(), sectionSizes, compressedSizes);
+				sizes1[i] = compressedSizes[0];
+				sizes2[i] = compressedSizes[1];
+			}
+		}
+	});
+
+	// Smallest size wins, ties go to the lowest index
+	int best = 0;
+	for (int i = 0; i < batchSize; i++) {
+		if (sizes[i] < sizes[best])
+			best = i;
+	}
+
+	for (int j = 0; j < nHunks; j++)
+		hunklist->SetHunk(j, orders[best][j]);
+	if (out_size1) *out_size1 = sizes1[best];
+	if (out_size2) *out_size2 = sizes2[best];
+	return sizes[best];
+}
+
+static void PrintIteration(int iteration, bool use1KMode, int size1, int size2, int total_size) {
+	if(use1KMode)
+	{
+		printf("  Iteration: %5d  Size: %5.2f\n", iteration, total_size / (BIT_PRECISION * 8.0f));
+	}
+	else
+	{
+		printf("  Iteration: %5d  Code: %.2f  Data: %.2f  Size: %.2f\n", iteration, size1 / (BIT_PRECISION * 8.0f), size2 / (BIT_PRECISION * 8.0f), total_size / (BIT_PRECISION * 8.0f));
+	}
+	fflush(stdout);
+}
+
+int EmpiricalHunkSorter::SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, int batchSize, OrderSearchType searchType, int timeLimit, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2)
 {
 	srand(1);
+	auto crtRandom = []() { return rand(); };
+	unique_ptr<OrderSearchStrategy> strategy(OrderSearchStrategy::Create(searchType));
 
 	int nHunks = hunklist->GetNumHunks();
 	
 	printf("\n\nReordering sections...\n");
 	fflush(stdout);
 	
+	// The first incremental evaluator follows the current ordering. Batches get one evaluator per thread,
+	// which share the memory budget for their journals.
+	ModelList4k* modelLists[] = { &codeModels, &dataModels };
+	int numEvaluators = batchSize > 1 ? min(batchSize, ThreadPool::Instance().GetNumThreads()) : 1;
+	vector<unique_ptr<IncrementalEvaluator4k>> evaluators;
+	vector<IncrementalEvaluator4k*> evaluatorPtrs;
+	for(int i = 0; i < numEvaluators; i++) {
+		evaluators.emplace_back(new IncrementalEvaluator4k(2, modelLists, baseprob, saturate, MAX_INCREMENTAL_MEMORY / numEvaluators));
+		evaluatorPtrs.push_back(evaluators.back().get());
+	}
+	IncrementalEvaluator4k& evaluator = *evaluators[0];
+	bool incremental = !use1KMode && batchSize <= 1;
+
+	// Every candidate is relinked into its own reused hunk, and batches link the current ordering into one more
+	HunkLayout layout(hunklist, transform, hunklist->FindSymbol("_Import"), CRINKLER_CODEBASE);
+	int numLinked = batchSize > 1 ? batchSize + 1 : 1;
+	Hunk** linked = new Hunk*[numLinked];
+	for(int i = 0; i < numLinked; i++)
+		linked[i] = layout.CreateHunk();
+
 	int best_size1;
 	int best_size2;
-	int best_total_size = TryHunkCombination(hunklist, transform, codeModels, dataModels, models1k, baseprob, saturate, use1KMode, &best_size1, &best_size2);
-	if(use1KMode)
-	{
-		printf("  Iteration: %5d  Size: %5.2f\n", 0, best_total_size / (BIT_PRECISION * 8.0f));
-	}
-	else
-	{
-		printf("  Iteration: %5d  Code: %.2f  Data: %.2f  Size: %.2f\n", 0, best_size1 / (BIT_PRECISION * 8.0f), best_size2 / (BIT_PRECISION * 8.0f), best_total_size / (BIT_PRECISION * 8.0f));
-	}
+	int best_total_size = TryHunkCombination(hunklist, layout, linked[0], &evaluator, models1k, use1KMode, &best_size1, &best_size2);
+	if(!use1KMode)
+		evaluator.Accept();
+	PrintIteration(0, use1KMode, best_size1, best_size2, best_total_size);
 	
 	if(progress)
 		progress->BeginTask("Reordering sections");
 
 	Hunk** backup = new Hunk*[nHunks];
+	Hunk** best = new Hunk*[nHunks];
+	for(int j = 0; j < nHunks; j++)
+		best[j] = (*hunklist)[j];
+
+	int current_size = best_total_size;
+	int tries = 0;
+	int steps = 0;
+	int moves = 0;
 	int fails = 0;
-	int stime = clock();
-	for(int i = 1; i < numIterations; i++) {
+	auto stime = chrono::steady_clock::now();
+	float elapsed = 0.0f;
+	while(true) {
+		// With a time limit, the search runs until the time is up rather than for numIterations tries
+		elapsed = chrono::duration<float>(chrono::steady_clock::now() - stime).count();
+		int i = tries + 1;
+		if(timeLimit > 0 ? elapsed >= timeLimit : i >= numIterations)
+			break;
+		float searchProgress = timeLimit > 0 ? elapsed / timeLimit : i / (float)numIterations;
+
 		for(int j = 0; j < nHunks; j++)
 			backup[j] = (*hunklist)[j];
-		
-		// Save DLL hunk
-		Hunk* dllhunk = nullptr;
-		int dlli;
-		for(dlli = 0; dlli < hunklist->GetNumHunks(); dlli++) {
-			if((*hunklist)[dlli]->GetFlags() & HUNK_IS_LEADING) {
-				dllhunk = (*hunklist)[dlli];
-				hunklist->RemoveHunk(dllhunk);
-				break;
-			}
+
+		int stepTries = 1;
+		int size1, size2, total_size;
+		if(batchSize > 1) {
+			// Permute the current ordering in batchSize different ways and take the best one
+			stepTries = timeLimit > 0 ? batchSize : min(batchSize, numIterations - i);
+			total_size = TryHunkBatch(hunklist, layout, linked[batchSize], linked, evaluatorPtrs.data(), numEvaluators, models1k, use1KMode, steps, stepTries, &size1, &size2);
+		} else {
+			PermuteOrdering(hunklist, crtRandom);
+			total_size = TryHunkCombination(hunklist, layout, linked[0], &evaluator, models1k, use1KMode, &size1, &size2);
 		}
-		
+		tries += stepTries;
+		steps++;
 
-		Hunk* eh = nullptr;
-		int ehi;
-		for (ehi = 0; ehi < hunklist->GetNumHunks(); ehi++) {
-			if ((*hunklist)[ehi]->GetFlags() & HUNK_IS_TRAILING) {
-				eh = (*hunklist)[ehi];
-				hunklist->RemoveHunk(eh);
-				break;
+		if(strategy->Accept(total_size, current_size, searchProgress)) {
+			moves++;
+			current_size = total_size;
+			if(incremental)
+				evaluator.Accept();
+			if(total_size < best_total_size) {
+				PrintIteration(tries, use1KMode, size1, size2, total_size);
+				best_total_size = total_size;
+				best_size1 = size1;
+				best_size2 = size2;
+				for(int j = 0; j < nHunks; j++)
+					best[j] = (*hunklist)[j];
+				fails = 0;
+			} else {
+				fails += stepTries;
 			}
+		} else {
+			fails += stepTries;
+			// Restore from backup
+			for(int j = 0; j < nHunks; j++)
+				hunklist->SetHunk(j, backup[j]);
 		}
 
-		PermuteHunklist(hunklist, 2);
-		
-		// Restore export hunk, if present
-		if (eh) {
-			hunklist->InsertHunk(ehi, eh);
-		}
-		
-		if(dllhunk)
-		{
-			hunklist->InsertHunk(dlli, dllhunk);
+		if(strategy->Restart(fails)) {
+			if(current_size != best_total_size) {
+				for(int j = 0; j < nHunks; j++)
+					hunklist->SetHunk(j, best[j]);
+				current_size = best_total_size;
+				if(incremental) {
+					TryHunkCombination(hunklist, layout, linked[0], &evaluator, models1k, use1KMode, nullptr, nullptr);
+					evaluator.Accept();
+				}
+			}
+			fails = 0;
 		}
 
-
-		int size1, size2;
-		int total_size = TryHunkCombination(hunklist, transform, codeModels, dataModels, models1k, baseprob, saturate, use1KMode, &size1, &size2);
-		if(total_size < best_total_size) {
-			if(use1KMode)
-			{
-				printf("  Iteration: %5d  Size: %5.2f\n", i, total_size / (BIT_PRECISION * 8.0f));
-			}
+		if(progress) {
+			if(timeLimit > 0)
+				progress->Update(min((int)(elapsed * 1000), timeLimit * 1000), timeLimit * 1000);
 			else
-			{
-				printf("  Iteration: %5d  Code: %.2f  Data: %.2f  Size: %.2f\n", i, size1 / (BIT_PRECISION * 8.0f), size2 / (BIT_PRECISION * 8.0f), total_size / (BIT_PRECISION * 8.0f));
-			}
-			
-			fflush(stdout);
-			best_total_size = total_size;
-			best_size1 = size1;
-			best_size2 = size2;
-			fails = 0;
-		} else {
-			fails++;
-			// Restore from backup
-			for(int j = 0; j < nHunks; j++)
-				(*hunklist)[j] = backup[j];
+				progress->Update(tries + 1, numIterations);
 		}
-		if(progress)
-			progress->Update(i+1, numIterations);
 	}
 	if(progress)
 		progress->EndTask();
 
+	// The search may have moved away from the best ordering
+	for(int j = 0; j < nHunks; j++)
+		hunklist->SetHunk(j, best[j]);
+
 	if(out_size1) *out_size1 = best_size1;
 	if(out_size2) *out_size2 = best_size2;
 
 	delete[] backup;
-	int timespent = (clock() - stime)/CLOCKS_PER_SEC;
+	delete[] best;
+	for(int i = 0; i < numLinked; i++)
+		delete linked[i];
+	delete[] linked;
+	int timespent = (int)elapsed;
+	printf("Tries: %d  Tries per second: %.1f  Accepted: %.1f%%\n", tries, tries / max(elapsed, 0.001f), steps > 0 ? moves * 100.0f / steps : 0.0f);
 	printf("Time spent: %dm%02ds\n", timespent/60, timespent%60);
 	return best_total_size;
-}
\ No newline at end of file
+}
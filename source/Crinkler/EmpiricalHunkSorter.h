@@ -2,18 +2,24 @@
 #ifndef _EMPIRICAL_HUNK_SORTER_H_
 #define _EMPIRICAL_HUNK_SORTER_H_
 
+#include "OrderSearchStrategy.h"
+
 class HunkList;
 class ModelList4k;
 class ModelList1k;
 class ProgressBar;
 class Transform;
+class IncrementalEvaluator4k;
+class HunkLayout;
+class Hunk;
 class EmpiricalHunkSorter {
-	static int TryHunkCombination(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, bool use1KMode, int* out_size1, int* out_size2);
+	static int TryHunkCombination(HunkList* hunklist, HunkLayout& layout, Hunk* phase1, IncrementalEvaluator4k* evaluator, ModelList1k& models1k, bool use1KMode, int* out_size1, int* out_size2);
+	static int TryHunkBatch(HunkList* hunklist, HunkLayout& layout, Hunk* current, Hunk** phase1s, IncrementalEvaluator4k** evaluators, int numEvaluators, ModelList1k& models1k, bool use1KMode, int round, int batchSize, int* out_size1, int* out_size2);
 public:
 	EmpiricalHunkSorter();
 	~EmpiricalHunkSorter();
 
-	static int SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2);
+	static int SortHunkList(HunkList* hunklist, Transform& transform, ModelList4k& codeModels, ModelList4k& dataModels, ModelList1k& models1k, int baseprob, bool saturate, int numIterations, int batchSize, OrderSearchType searchType, int timeLimit, ProgressBar* progress, bool use1KMode, int* out_size1, int* out_size2);
 };
 
 #endif
\ No newline at end of file
@@ -106,7 +106,7 @@ Hunk* CreateExportTable(const std::set<Export>& exports) {
 
 	// Create hunk
 	Hunk* hunk = new Hunk("Exports", &data[0], HUNK_IS_TRAILING, 2, hunk_size, hunk_size);
-	std::string object_name = "EXPORT";
+	Name object_name("EXPORT");
 
 	// Add labels
 	hunk->AddSymbol(new Symbol("exports", 0, SYMBOL_IS_RELOCATEABLE | SYMBOL_IS_SECTION, hunk, object_name.c_str()));
@@ -127,15 +127,15 @@ Hunk* CreateExportTable(const std::set<Export>& exports) {
 	}
 
 	// Add relocations
-	hunk->AddRelocation({ "_ExportAddresses", table_offset + 28, RELOCTYPE_ABS32, object_name });
-	hunk->AddRelocation({ "_ExportNames", table_offset + 32, RELOCTYPE_ABS32, object_name });
-	hunk->AddRelocation({ "_ExportOrdinals", table_offset + 36, RELOCTYPE_ABS32, object_name });
+	hunk->AddRelocation({ Name("_ExportAddresses"), table_offset + 28, RELOCTYPE_ABS32, object_name });
+	hunk->AddRelocation({ Name("_ExportNames"), table_offset + 32, RELOCTYPE_ABS32, object_name });
+	hunk->AddRelocation({ Name("_ExportOrdinals"), table_offset + 36, RELOCTYPE_ABS32, object_name });
 	int i = 0;
 	for (const Export& e : exports) {
 		const std::string& export_label = e.HasValue() ? e.GetName() : e.GetSymbol();
-		hunk->AddRelocation({ export_label, addresses_offset + i * 4, RELOCTYPE_ABS32, object_name });
+		hunk->AddRelocation({ Name(export_label), addresses_offset + i * 4, RELOCTYPE_ABS32, object_name });
 		std::string name_label = "_ExportName_" + e.GetName();
-		hunk->AddRelocation({ name_label, name_pointers_offset + i * 4, RELOCTYPE_ABS32, object_name });
+		hunk->AddRelocation({ Name(name_label), name_pointers_offset + i * 4, RELOCTYPE_ABS32, object_name });
 		i++;
 	}
 
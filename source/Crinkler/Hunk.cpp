@@ -2,12 +2,14 @@
 #include <vector>
 #include <algorithm>
 #include <cassert>
+#include <atomic>
 #include "StringMisc.h"
 #include "misc.h"
 
 #include "Hunk.h"
 #include "NameMangling.h"
 #include "Log.h"
+#include "ObjectPool.h"
 #include "Symbol.h"
 
 using namespace std;
@@ -41,9 +43,10 @@ static int GetType(int level) {
 
 Hunk::Hunk(const Hunk& h) : 
 	m_alignmentBits(h.m_alignmentBits), m_flags(h.m_flags), m_data(h.m_data),
+	m_sharedData(h.m_sharedData), m_sharedSize(h.m_sharedSize),
 	m_virtualsize(h.m_virtualsize), m_relocations(h.m_relocations), m_name(h.m_name),
 	m_importName(h.m_importName), m_importDll(h.m_importDll), m_numReferences(0),
-	m_alignmentOffset(0), m_continuation(NULL)
+	m_alignmentOffset(0), m_continuation(NULL), m_indexed(false)
 {
 	// Deep copy symbols
 	for(const auto& p : h.m_symbols) {
@@ -55,25 +58,39 @@ Hunk::Hunk(const Hunk& h) :
 
 
 Hunk::Hunk(const char* symbolName, const char* importName, const char* importDll) :
-	m_name(symbolName), m_virtualsize(0),
+	m_name(symbolName), m_virtualsize(0), m_sharedData(NULL), m_sharedSize(0),
 	m_flags(HUNK_IS_IMPORT), m_alignmentBits(0), m_importName(importName),
 	m_importDll(importDll), m_numReferences(0),
-	m_alignmentOffset(0), m_continuation(NULL)
+	m_alignmentOffset(0), m_continuation(NULL), m_indexed(false)
 {
 	AddSymbol(new Symbol(symbolName, 0, SYMBOL_IS_RELOCATEABLE, this));
 }
 
 
-Hunk::Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize) :
+Hunk::Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize, bool shareData) :
 	m_name(name), m_flags(flags), m_alignmentBits(alignmentBits),
-	m_virtualsize(virtualsize), m_numReferences(0),
-	m_alignmentOffset(0), m_continuation(NULL)
+	m_virtualsize(virtualsize), m_sharedData(NULL), m_sharedSize(0), m_numReferences(0),
+	m_alignmentOffset(0), m_continuation(NULL), m_indexed(false)
 {
+	if(shareData && data != NULL && rawsize > 0) {
+		// The data must outlive the hunk, or the hunk must be unshared
+		m_sharedData = data;
+		m_sharedSize = rawsize;
+		return;
+	}
 	m_data.resize(rawsize);
 	if(data != NULL)
 		copy(data, data+rawsize, m_data.begin());
 }
 
+void Hunk::Unshare() {
+	if(m_sharedData) {
+		m_data.assign(m_sharedData, m_sharedData + m_sharedSize);
+		m_sharedData = NULL;
+		m_sharedSize = 0;
+	}
+}
+
 
 Hunk::~Hunk() {
 	// Free symbols
@@ -82,15 +99,34 @@ Hunk::~Hunk() {
 	}
 }
 
+void* Hunk::operator new(size_t size) {
+	return size == sizeof(Hunk) ? ObjectPool<sizeof(Hunk)>::Allocate() : ::operator new(size);
+}
+
+void Hunk::operator delete(void* ptr, size_t size) {
+	if(size == sizeof(Hunk))
+		ObjectPool<sizeof(Hunk)>::Free(ptr);
+	else
+		::operator delete(ptr);
+}
+
+static atomic<unsigned int> s_symbolGeneration(0);
+
+unsigned int Hunk::GetSymbolGeneration() {
+	return s_symbolGeneration;
+}
+
 void Hunk::AddSymbol(Symbol* s) {
-	map<string, Symbol*>::iterator it = m_symbols.find(s->name.c_str());
+	if(m_indexed)
+		s_symbolGeneration++;
+	auto it = m_symbols.find(s->name);
 	if(it == m_symbols.end()) {
 		m_symbols.insert(make_pair(s->name, s));
 	} else {
 		Symbol* oldSym = it->second;
 		if(oldSym->secondaryName.size() > 0) {
 			// Overwrite weak symbols
-			m_symbols[s->name.c_str()] = s;
+			it->second = s;
 			delete oldSym;
 		} else {
 			delete s;
@@ -131,7 +167,15 @@ Symbol* Hunk::FindUndecoratedSymbol(const char* name) const {
 }
 
 Symbol* Hunk::FindSymbol(const char* name) const {
-	map<string, Symbol*>::const_iterator it = m_symbols.find(name);
+	auto it = m_symbols.find(name);
+	if(it != m_symbols.end())
+		return it->second;
+	else
+		return NULL;
+}
+
+Symbol* Hunk::FindSymbol(const Name& name) const {
+	auto it = m_symbols.find(name);
 	if(it != m_symbols.end())
 		return it->second;
 	else
@@ -161,11 +205,12 @@ static const char* HelpMessage(const char* name) {
 
 void Hunk::Relocate(int imageBase) {
 	bool error = false;
+	Unshare();
 	for(const Relocation& relocation : m_relocations) {
 		// Find symbol
-		Symbol* s = FindSymbol(relocation.symbolname.c_str());
+		Symbol* s = FindSymbol(relocation.symbolname);
 		if(s && s->secondaryName.size() > 0)
-			s = FindSymbol(s->secondaryName.c_str());
+			s = FindSymbol(s->secondaryName);
 		if(s != NULL) {
 			// Perform relocation
 			int* word = (int*)&m_data[relocation.offset];
@@ -210,6 +255,11 @@ void Hunk::Relocate(int imageBase) {
 }
 
 void Hunk::SetRawSize(int size) {
+	if(m_sharedData && size <= m_sharedSize) {
+		m_sharedSize = size;
+		return;
+	}
+	Unshare();
 	m_data.resize(size);
 }
 
@@ -225,16 +275,23 @@ void Hunk::Trim() {
 		farestReloc = max(relocation.offset+relocSize, farestReloc);
 	}
 
+	if(m_sharedData) {
+		while(m_sharedSize > farestReloc && m_sharedData[m_sharedSize - 1] == 0)
+			m_sharedSize--;
+		return;
+	}
 	while((int)m_data.size() > farestReloc && m_data.back() == 0)
 		m_data.pop_back();
 }
 
 void Hunk::AppendZeroes(int num) {
+	Unshare();
 	while(num--)
 		m_data.push_back(0);
 }
 
 void Hunk::Insert(int offset, const unsigned char* data, int size) {
+	Unshare();
 	m_data.resize(m_data.size() + size);
 	memmove(&m_data[offset + size], &m_data[offset], m_data.size() - (offset + size));
 	memcpy(&m_data[offset], data, size);
@@ -337,9 +394,9 @@ map<int, Symbol*> Hunk::GetOffsetToRelocationMap() {
 	map<int, Symbol*> offsetmap;
 	map<int, Symbol*> symbolmap = GetOffsetToSymbolMap();
 	for(Relocation& relocation : m_relocations) {
-		Symbol* s = FindSymbol(relocation.symbolname.c_str());
+		Symbol* s = FindSymbol(relocation.symbolname);
 		if(s && s->secondaryName.size() > 0)
-			s = FindSymbol(s->secondaryName.c_str());
+			s = FindSymbol(s->secondaryName);
 		if(s && s->flags & SYMBOL_IS_RELOCATEABLE && s->flags & SYMBOL_IS_SECTION)
 			s = symbolmap.find(s->value)->second;	// Replace relocation to section with non-section
 		offsetmap.insert(make_pair(relocation.offset, s));
@@ -367,6 +424,7 @@ map<int, Symbol*> Hunk::GetOffsetToSymbolMap() {
 // Default round double: __real@XXXXXXXXXXXXXXXX, *@3NA
 // Round *tf_XX* to XX bits.
 void Hunk::RoundFloats(int defaultBits) {
+	Unshare();
 	map<int, Symbol*> offset_to_symbol = GetOffsetToSymbolMap();
 	for(const auto& p : m_symbols) {
 		Symbol* s = p.second;
@@ -470,6 +528,8 @@ void Hunk::OverrideAlignment(int defaultBits) {
 }
 
 void Hunk::MarkHunkAsLibrary() {
+	if(m_indexed)
+		s_symbolGeneration++;
 	for(auto& p : m_symbols) {
 		p.second->fromLibrary = true;
 	}
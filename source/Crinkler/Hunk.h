@@ -6,6 +6,8 @@
 #include <map>
 #include <vector>
 
+#include "NameTable.h"
+
 const int HUNK_IS_CODE =		0x01;
 const int HUNK_IS_WRITEABLE =	0x02;
 const int HUNK_IS_IMPORT =		0x04;
@@ -74,22 +76,25 @@ struct CompressionReportRecord {
 };
 
 struct Relocation {
-	std::string		symbolname;
+	Name			symbolname;
 	int				offset;
 	RelocationType	type;
-	std::string		objectname;
+	Name			objectname;
 };
 
 class Hunk {
 	friend class HunkList;
+	friend class HunkLayout;
 	int				m_alignmentBits;
 	int				m_alignmentOffset;
 	unsigned int	m_flags;
 	int				m_virtualsize;
 
 	std::vector<char>	m_data;
+	const char*		m_sharedData;	// Data of a loaded file, used instead of m_data until the hunk is modified
+	int				m_sharedSize;
 	std::vector<Relocation> m_relocations;
-	std::map<std::string, Symbol*> m_symbols;
+	std::map<Name, Symbol*, NameLess> m_symbols;
 	Symbol* m_continuation;
 	std::string m_name;
 	std::string m_importName;
@@ -97,10 +102,11 @@ class Hunk {
 	std::string m_cached_id;
 
 	int			m_numReferences;
+	mutable bool	m_indexed;		// Symbols are in the index of a HunkList
 public:
 	Hunk(const Hunk& h);
 	Hunk(const char* symbolName, const char* importName, const char* importDll);
-	Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize);
+	Hunk(const char* name, const char* data, unsigned int flags, int alignmentBits, int rawsize, int virtualsize, bool shareData = false);
 	~Hunk();
 
 	void		AddRelocation(Relocation r);
@@ -111,6 +117,7 @@ public:
 	Symbol*		GetContinuation() const							{ return m_continuation; }
 	Symbol*		FindUndecoratedSymbol(const char* name) const;
 	Symbol*		FindSymbol(const char* name) const;
+	Symbol*		FindSymbol(const Name& name) const;
 	void		PrintSymbols() const;
 	void		Relocate(int imageBase);
 	void		SetVirtualSize(int size)						{ m_virtualsize = size; }
@@ -124,6 +131,7 @@ public:
 	void		Insert(int offset, const unsigned char* data, int length);
 
 	void		MarkHunkAsLibrary();
+	void		Unshare();		// Copies shared data, so the hunk no longer refers to the loaded file
 
 	CompressionReportRecord* GetCompressionSummary(int* sizefill, int splittingPoint);
 
@@ -132,8 +140,9 @@ public:
 	int				GetAlignmentOffset() const		{ return m_alignmentOffset; }
 	unsigned int	GetFlags() const				{ return m_flags; }
 	const char*		GetName() const					{ return m_name.c_str(); }
-	char*			GetPtr()						{ return m_data.data(); }
-	int				GetRawSize() const				{ return (int)m_data.size(); }
+	const char*		GetData() const					{ return m_sharedData ? m_sharedData : m_data.data(); }
+	char*			GetPtr()						{ if(m_sharedData) Unshare(); return m_data.data(); }
+	int				GetRawSize() const				{ return m_sharedData ? m_sharedSize : (int)m_data.size(); }
 	int				GetVirtualSize() const			{ return m_virtualsize; }
 	int				GetNumReferences() const		{ return m_numReferences; }
 	const char*		GetImportName() const			{ return m_importName.c_str(); }
@@ -142,6 +151,13 @@ public:
 	std::map<int, Symbol*> GetOffsetToRelocationMap();
 	std::map<int, Symbol*> GetOffsetToSymbolMap();
 	const std::string& GetID();
+
+	// Changes whenever symbols are added to or marked in a hunk indexed by a HunkList
+	static unsigned int	GetSymbolGeneration();
+
+	// Hunks are allocated from an ObjectPool
+	static void*	operator new(size_t size);
+	static void		operator delete(void* ptr, size_t size);
 };
 
 #endif
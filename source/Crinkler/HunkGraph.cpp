@@ -0,0 +1,55 @@
+#include "HunkGraph.h"
+
+#include "Hunk.h"
+#include "HunkList.h"
+#include "Symbol.h"
+
+using namespace std;
+
+HunkGraph::HunkGraph(const HunkList& hunklist) {
+	int numHunks = hunklist.GetNumHunks();
+	m_hunks.reserve(numHunks);
+	for(int i = 0; i < numHunks; i++) {
+		m_hunks.push_back(hunklist[i]);
+		m_indices[hunklist[i]] = i;
+	}
+
+	// Last hunk with a strong edge to each hunk, to skip duplicate edges
+	vector<int> strongEdgeFrom(numHunks, -1);
+	m_firstEdge.reserve(numHunks + 1);
+	for(int h = 0; h < numHunks; h++) {
+		Hunk* hunk = m_hunks[h];
+		int first = (int)m_edges.size();
+		m_firstEdge.push_back(first);
+		for(int i = 0; i < hunk->GetNumRelocations(); i++) {
+			Symbol* s = hunklist.FindSymbol(hunk->GetRelocations()[i].symbolname.GetId());
+			if(s == NULL)
+				continue;
+
+			Edge edge = { -1, -1 };
+			if(s->secondaryName.size() > 0) {	// Weak symbol
+				edge.weak = m_indices.at(s->hunk);
+				s = hunklist.FindSymbol(s->secondaryName.GetId());
+			}
+			if(s != NULL)
+				edge.target = m_indices.at(s->hunk);
+
+			bool duplicate = false;
+			if(edge.weak == -1) {
+				duplicate = strongEdgeFrom[edge.target] == h;
+				strongEdgeFrom[edge.target] = h;
+			} else {
+				for(int e = first; e < (int)m_edges.size() && !duplicate; e++)
+					duplicate = m_edges[e].target == edge.target && m_edges[e].weak == edge.weak;
+			}
+			if(!duplicate)
+				m_edges.push_back(edge);
+		}
+	}
+	m_firstEdge.push_back((int)m_edges.size());
+}
+
+int HunkGraph::GetIndex(const Hunk* hunk) const {
+	auto it = m_indices.find(hunk);
+	return it != m_indices.end() ? it->second : -1;
+}
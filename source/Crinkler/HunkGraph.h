@@ -0,0 +1,38 @@
+#pragma once
+#ifndef _HUNK_GRAPH_H_
+#define _HUNK_GRAPH_H_
+
+#include <unordered_map>
+#include <vector>
+
+class Hunk;
+class HunkList;
+
+// References between the hunks of a HunkList, resolved once for HunkList::RemoveUnreferencedHunks.
+// Each relocation becomes an edge to the hunk defining its symbol as found by HunkList::FindSymbol,
+// with weak symbols followed to the symbol they refer to. Hunks are identified by their index in
+// the list. The graph is not kept up to date, so build it right before walking it.
+class HunkGraph {
+public:
+	struct Edge {
+		int		target;		// Hunk defining the symbol, or -1 if a weak symbol refers to an undefined one
+		int		weak;		// Hunk of the weak symbol the reference went through, or -1
+	};
+private:
+	std::vector<Hunk*>						m_hunks;
+	std::unordered_map<const Hunk*, int>	m_indices;
+	std::vector<int>						m_firstEdge;	// Edges of hunk i are m_edges[m_firstEdge[i]] to m_edges[m_firstEdge[i + 1] - 1]
+	std::vector<Edge>						m_edges;
+public:
+	HunkGraph(const HunkList& hunklist);
+
+	int				GetNumHunks() const				{ return (int)m_hunks.size(); }
+	Hunk*			GetHunk(int index) const		{ return m_hunks[index]; }
+	int				GetIndex(const Hunk* hunk) const;	// -1 if the hunk is not in the graph
+
+	// Distinct references of a hunk, in order of first occurrence
+	int				GetNumEdges(int index) const	{ return m_firstEdge[index + 1] - m_firstEdge[index]; }
+	const Edge*		GetEdges(int index) const		{ return m_edges.data() + m_firstEdge[index]; }
+};
+
+#endif
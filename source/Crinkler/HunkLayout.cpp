@@ -0,0 +1,285 @@
+#include "HunkLayout.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "Hunk.h"
+#include "HunkList.h"
+#include "Log.h"
+#include "misc.h"
+#include "Symbol.h"
+#include "Transform.h"
+
+using namespace std;
+
+HunkLayout::HunkLayout(const HunkList* hunklist, Transform& transform, Symbol* entry, int baseAddress) :
+	m_transform(transform), m_entry(entry), m_baseAddress(baseAddress), m_transformEnabled(false), m_detransformer(nullptr), m_maxSize(0)
+{
+	Build(hunklist);
+}
+
+HunkLayout::~HunkLayout() {
+	delete m_detransformer;
+}
+
+int HunkLayout::GetNameIndex(const Name& name) {
+	auto it = m_nameIndices.find(name.GetId());
+	if(it != m_nameIndices.end())
+		return it->second;
+
+	int index = (int)m_names.size();
+	m_nameIndices[name.GetId()] = index;
+	m_names.push_back(name);
+	m_definitions.emplace_back();
+	return index;
+}
+
+void HunkLayout::Build(const HunkList* hunklist) {
+	// Same detransformer as Transform::LinkAndTransform
+	delete m_detransformer;
+	m_detransformer = nullptr;
+	m_transformEnabled = m_transform.IsEnabled();
+	if(m_transformEnabled)
+	{
+		m_detransformer = m_transform.GetDetransformer();
+		if(m_detransformer)
+		{
+			m_detransformer->SetVirtualSize(m_detransformer->GetRawSize());
+		}
+	}
+	if(!m_detransformer)
+	{
+		m_detransformer = new Hunk("Stub", NULL, HUNK_IS_CODE, 0, 0, 0);
+	}
+	m_detransformer->SetContinuation(m_entry);
+
+	vector<Hunk*> hunks;
+	hunks.push_back(m_detransformer);
+	for(int i = 0; i < hunklist->GetNumHunks(); i++)
+		hunks.push_back((*hunklist)[i]);
+
+	m_hunks.clear();
+	m_relocations.clear();
+	m_hunkIndices.clear();
+	m_nameIndices.clear();
+	m_names.clear();
+	m_definitions.clear();
+	m_maxSize = 0;
+	for(int i = 0; i < (int)hunks.size(); i++)
+		m_hunkIndices[hunks[i]] = i;
+
+	for(int i = 0; i < (int)hunks.size(); i++) {
+		Hunk* h = hunks[i];
+		LayoutHunk lh;
+		lh.data = h->GetData();
+		lh.rawsize = h->GetRawSize();
+		lh.virtualsize = h->GetVirtualSize();
+		lh.alignmentBits = h->GetAlignmentBits();
+		lh.alignmentOffset = h->GetAlignmentOffset();
+		lh.flags = h->GetFlags();
+		lh.continuationName = -1;
+		lh.continuationHunk = -1;
+		lh.continuationValue = 0;
+		if(Symbol* cont = h->GetContinuation()) {
+			auto it = m_hunkIndices.find(cont->hunk);
+			lh.continuationName = GetNameIndex(cont->name);
+			lh.continuationHunk = it != m_hunkIndices.end() ? it->second : -1;
+			lh.continuationValue = cont->value;
+		}
+
+		lh.firstRelocation = (int)m_relocations.size();
+		lh.numRelocations = (int)h->m_relocations.size();
+		for(const Relocation& relocation : h->m_relocations) {
+			m_relocations.push_back({relocation.offset, relocation.type, GetNameIndex(relocation.symbolname)});
+		}
+
+		for(const auto& p : h->m_symbols) {
+			const Symbol* s = p.second;
+			Definition d;
+			d.hunk = i;
+			d.value = s->value;
+			d.relocatable = (s->flags & SYMBOL_IS_RELOCATEABLE) != 0;
+			d.weak = !s->secondaryName.empty();
+			d.secondaryName = d.weak ? GetNameIndex(s->secondaryName) : -1;
+			m_definitions[GetNameIndex(s->name)].push_back(d);
+		}
+
+		m_maxSize += (1 << lh.alignmentBits) + max(lh.rawsize, lh.virtualsize) + 5;
+		m_hunks.push_back(lh);
+	}
+
+	m_order.resize(m_hunks.size());
+	m_positions.resize(m_hunks.size());
+	m_addresses.resize(m_hunks.size());
+	m_jumps.clear();
+	m_jumps.reserve(m_hunks.size());
+}
+
+const HunkLayout::Definition* HunkLayout::FindDefinition(int name) const {
+	// As Hunk::AddSymbol when merging the hunks: the first strong definition wins, else the last weak one
+	const vector<Definition>& definitions = m_definitions[name];
+	if(definitions.size() <= 1)
+		return definitions.empty() ? nullptr : &definitions[0];
+
+	const Definition* strong = nullptr;
+	const Definition* weak = nullptr;
+	for(const Definition& d : definitions) {
+		if(!d.weak) {
+			if(!strong || m_positions[d.hunk] < m_positions[strong->hunk])
+				strong = &d;
+		} else {
+			if(!weak || m_positions[d.hunk] > m_positions[weak->hunk])
+				weak = &d;
+		}
+	}
+	return strong ? strong : weak;
+}
+
+const HunkLayout::Definition* HunkLayout::Resolve(int name) const {
+	// As Hunk::Relocate, weak symbols are followed one step
+	const Definition* d = FindDefinition(name);
+	if(d && d->weak)
+		d = FindDefinition(d->secondaryName);
+	return d;
+}
+
+Hunk* HunkLayout::CreateHunk() const {
+	Hunk* linked = new Hunk("linked", 0, 0, 0, m_maxSize, 0);
+	linked->SetRawSize(0);
+
+	// The transform looks up symbols of the detransformer, which is always placed first
+	int address = m_baseAddress - m_detransformer->GetAlignmentOffset();
+	address = Align(address, m_detransformer->GetAlignmentBits());
+	address -= m_baseAddress - m_detransformer->GetAlignmentOffset();
+	for(const auto& p : m_detransformer->m_symbols) {
+		Symbol* s = new Symbol(*p.second);
+		s->hunk = linked;
+		if(s->flags & SYMBOL_IS_RELOCATEABLE) {
+			s->value += address;
+			s->hunk_offset = p.second->hunk_offset + address;
+		}
+		linked->AddSymbol(s);
+	}
+	return linked;
+}
+
+bool HunkLayout::LinkAndTransform(const HunkList* hunklist, Hunk* linked, int* splittingPoint) {
+	if(m_transform.IsEnabled() != m_transformEnabled)
+		Build(hunklist);
+
+	int numHunks = hunklist->GetNumHunks() + 1;
+	m_order[0] = 0;
+	for(int i = 1; i < numHunks; i++)
+		m_order[i] = m_hunkIndices.at((*hunklist)[i - 1]);
+	for(int i = 0; i < numHunks; i++)
+		m_positions[m_order[i]] = i;
+
+	auto needsContinuationJump = [&](int i) {
+		const LayoutHunk& h = m_hunks[m_order[i]];
+		return h.continuationName >= 0 && (h.continuationValue > 0 || i + 1 == numHunks || m_order[i + 1] != h.continuationHunk);
+	};
+
+	// Calculate raw size, as in HunkList::ToHunk
+	int rawsize = 0;
+	int virtualsize = 0;
+	bool overflow = false;
+	for(int i = 0; i < numHunks; i++) {
+		const LayoutHunk& h = m_hunks[m_order[i]];
+		virtualsize += m_baseAddress - h.alignmentOffset;
+		virtualsize = Align(virtualsize, h.alignmentBits);
+		virtualsize -= m_baseAddress - h.alignmentOffset;
+		if (virtualsize < 0) { overflow = true; break; }
+
+		if(h.rawsize > 0)
+			rawsize = virtualsize + h.rawsize;
+		virtualsize += h.virtualsize;
+		if (virtualsize < 0) { overflow = true; break; }
+		if (needsContinuationJump(i)) {
+			rawsize += 5;
+			virtualsize = rawsize;
+		}
+		if (virtualsize < 0) { overflow = true; break; }
+	}
+
+	if (overflow) {
+		Log::Error("", "Virtual size overflows 2GB limit");
+	}
+
+	// Copy data
+	linked->SetRawSize(rawsize);
+	linked->SetVirtualSize(virtualsize);
+	unsigned char* data = (unsigned char*)linked->GetPtr();
+	memset(data, 0, rawsize);
+	m_jumps.clear();
+
+	int address = 0;
+	int farestReloc = 0;
+	int sp = -1;
+	for(int i = 0; i < numHunks; i++) {
+		const LayoutHunk& h = m_hunks[m_order[i]];
+		address += m_baseAddress - h.alignmentOffset;
+		address = Align(address, h.alignmentBits);
+		address -= m_baseAddress - h.alignmentOffset;
+		m_addresses[m_order[i]] = address;
+
+		for(int r = h.firstRelocation; r < h.firstRelocation + h.numRelocations; r++)
+			farestReloc = max(address + m_relocations[r].offset + 4, farestReloc);
+
+		if(sp == -1 && !(h.flags & HUNK_IS_CODE))
+			sp = address;
+
+		memcpy(&data[address], h.data, h.rawsize);
+		if (needsContinuationJump(i)) {
+			data[address + h.rawsize] = 0xE9;
+			m_jumps.push_back({address + h.rawsize + 1, RELOCTYPE_REL32, h.continuationName});
+			farestReloc = max(address + h.rawsize + 5, farestReloc);
+			address += h.rawsize + 5;
+		} else {
+			address += h.virtualsize;
+		}
+	}
+
+	// Trim, as in Hunk::Trim
+	int size = rawsize;
+	while(size > farestReloc && data[size - 1] == 0)
+		size--;
+	linked->SetRawSize(size);
+
+	// Relocate, as in Hunk::Relocate
+	auto relocate = [&](int offset, int type, int name) {
+		const Definition* d = Resolve(name);
+		if(d == nullptr) {
+			Log::Error("", "Cannot find symbol '%s'", m_names[name].c_str());
+		}
+		int value = d->value;
+		if(d->relocatable)
+			value += m_addresses[d->hunk];
+
+		int* word = (int*)&data[offset];
+		switch(type) {
+			case RELOCTYPE_ABS32:
+				(*word) += value;
+				if(d->relocatable)
+					(*word) += m_baseAddress;
+				break;
+			case RELOCTYPE_REL32:
+				(*word) += value - offset - 4;
+				break;
+		}
+	};
+	for(int i = 0; i < numHunks; i++) {
+		const LayoutHunk& h = m_hunks[m_order[i]];
+		int hunkAddress = m_addresses[m_order[i]];
+		for(int r = h.firstRelocation; r < h.firstRelocation + h.numRelocations; r++)
+			relocate(hunkAddress + m_relocations[r].offset, m_relocations[r].type, m_relocations[r].name);
+	}
+	for(const LayoutRelocation& jump : m_jumps)
+		relocate(jump.offset, jump.type, jump.name);
+
+	if (splittingPoint)
+	{
+		*splittingPoint = sp;
+	}
+
+	return m_transformEnabled ? m_transform.DoTransform(linked, sp, false) : false;
+}
@@ -0,0 +1,84 @@
+#pragma once
+#ifndef _HUNK_LAYOUT_H_
+#define _HUNK_LAYOUT_H_
+
+#include <unordered_map>
+#include <vector>
+
+#include "NameTable.h"
+
+class Hunk;
+class HunkList;
+class Symbol;
+class Transform;
+
+// Links orderings of a fixed set of hunks the same way as Transform::LinkAndTransform, for the
+// empirical hunk sorter. Relocations and continuations are resolved to (hunk, offset) pairs once,
+// so a relink only lays out the data and patches the relocated words into a reused hunk,
+// without copying symbols or allocating memory.
+class HunkLayout {
+	struct Definition {
+		int			hunk;			// Index of the defining hunk
+		int			value;
+		bool		relocatable;
+		bool		weak;
+		int			secondaryName;	// Name index of the symbol a weak symbol refers to, or -1
+	};
+
+	struct LayoutRelocation {
+		int			offset;
+		int			type;
+		int			name;
+	};
+
+	struct LayoutHunk {
+		const char*	data;
+		int			rawsize;
+		int			virtualsize;
+		int			alignmentBits;
+		int			alignmentOffset;
+		unsigned int	flags;
+		int			continuationName;	// -1 if none
+		int			continuationHunk;	// Index of the hunk of the continuation symbol, or -1
+		int			continuationValue;
+		int			firstRelocation;
+		int			numRelocations;
+	};
+
+	Transform&		m_transform;
+	Symbol*			m_entry;
+	int				m_baseAddress;
+	bool			m_transformEnabled;
+	Hunk*			m_detransformer;
+
+	std::vector<LayoutHunk>					m_hunks;		// The detransformer is hunk 0
+	std::vector<LayoutRelocation>			m_relocations;
+	std::unordered_map<const Hunk*, int>	m_hunkIndices;
+	std::unordered_map<int, int>			m_nameIndices;	// By NameTable ID
+	std::vector<Name>						m_names;
+	std::vector<std::vector<Definition>>	m_definitions;	// Per name
+	int										m_maxSize;
+
+	// Scratch space of a single relink
+	std::vector<int>				m_order;
+	std::vector<int>				m_positions;
+	std::vector<int>				m_addresses;
+	std::vector<LayoutRelocation>	m_jumps;
+
+	void				Build(const HunkList* hunklist);
+	int					GetNameIndex(const Name& name);
+	const Definition*	FindDefinition(int name) const;
+	const Definition*	Resolve(int name) const;
+public:
+	HunkLayout(const HunkList* hunklist, Transform& transform, Symbol* entry, int baseAddress);
+	~HunkLayout();
+
+	// Creates a hunk that LinkAndTransform can link into repeatedly
+	Hunk*	CreateHunk() const;
+
+	// Links the hunks of hunklist, which must be the hunks the layout was created from in any
+	// order, into linked and transforms it. Returns true if the transform succeeds.
+	bool	LinkAndTransform(const HunkList* hunklist, Hunk* linked, int* splittingPoint);
+};
+
+#endif
@@ -5,13 +5,15 @@
 #include <algorithm>
 
 #include "Hunk.h"
+#include "HunkGraph.h"
 #include "Log.h"
 #include "misc.h"
+#include "NameTable.h"
 #include "Symbol.h"
 
 using namespace std;
 
-HunkList::HunkList() {
+HunkList::HunkList() : m_symbolIndexValid(false), m_symbolIndexGeneration(0) {
 }
 
 HunkList::~HunkList() {
@@ -21,44 +23,97 @@ HunkList::~HunkList() {
 	}
 }
 
-Hunk*& HunkList::operator[] (unsigned idx) {
+Hunk* const & HunkList::operator[] (unsigned idx) const {
 	assert(idx < (int)m_hunks.size());
 	return m_hunks[idx];
 }
 
-Hunk* const & HunkList::operator[] (unsigned idx) const {
-	assert(idx < (int)m_hunks.size());
-	return m_hunks[idx];
+void HunkList::SetHunk(int index, Hunk* hunk) {
+	assert(index < (int)m_hunks.size());
+	m_hunks[index] = hunk;
+	InvalidateSymbolIndex();
 }
 
 void HunkList::AddHunkBack(Hunk* hunk) {
 	m_hunks.push_back(hunk);
+	if(IsSymbolIndexCurrent())
+		IndexHunk(hunk);
+	else
+		InvalidateSymbolIndex();
 }
 
 void HunkList::AddHunkFront(Hunk* hunk) {
 	m_hunks.insert(m_hunks.begin(), hunk);
+	InvalidateSymbolIndex();
 }
 
 void HunkList::InsertHunk(int index, Hunk* hunk) {
 	m_hunks.insert(m_hunks.begin() + index, hunk);
+	InvalidateSymbolIndex();
 }
 
 Hunk* HunkList::RemoveHunk(Hunk* hunk) {
 	vector<Hunk*>::iterator it = find(m_hunks.begin(), m_hunks.end(), hunk);
-	if(it != m_hunks.end())
+	if(it != m_hunks.end()) {
 		m_hunks.erase(it);
+
+		// Only symbols found through the index need a rebuild
+		if(IsSymbolIndexCurrent()) {
+			for(const auto& p : hunk->m_symbols) {
+				auto entry = m_symbolIndex.find(p.first.GetId());
+				if(entry != m_symbolIndex.end() && entry->second == p.second) {
+					InvalidateSymbolIndex();
+					break;
+				}
+			}
+		}
+	}
 	return hunk;
 }
 
 
 void HunkList::Clear() {
 	m_hunks.clear();
+	m_symbolIndex.clear();
+	m_symbolIndexValid = true;
+	m_symbolIndexGeneration = Hunk::GetSymbolGeneration();
 }
 
 void HunkList::Append(HunkList* hunklist) {
+	bool current = IsSymbolIndexCurrent();
 	for(Hunk* hunk : hunklist->m_hunks) {
-		m_hunks.push_back(new Hunk(*hunk));
+		Hunk* copy = new Hunk(*hunk);
+		m_hunks.push_back(copy);
+		if(current)
+			IndexHunk(copy);
 	}
+	if(!current)
+		InvalidateSymbolIndex();
+}
+
+bool HunkList::IsSymbolIndexCurrent() const {
+	return m_symbolIndexValid && m_symbolIndexGeneration == Hunk::GetSymbolGeneration();
+}
+
+void HunkList::IndexHunk(Hunk* hunk) const {
+	hunk->m_indexed = true;
+	for(const auto& p : hunk->m_symbols) {
+		// First non-weak symbol wins, else the last weak one
+		Symbol*& entry = m_symbolIndex[p.first.GetId()];
+		if(entry == NULL || entry->secondaryName.size() > 0)
+			entry = p.second;
+	}
+}
+
+void HunkList::UpdateSymbolIndex() const {
+	if(IsSymbolIndexCurrent())
+		return;
+
+	m_symbolIndex.clear();
+	for(Hunk* hunk : m_hunks)
+		IndexHunk(hunk);
+	m_symbolIndexValid = true;
+	m_symbolIndexGeneration = Hunk::GetSymbolGeneration();
 }
 
 bool HunkList::NeedsContinuationJump(vector<Hunk*>::const_iterator &it) const {
@@ -144,11 +199,11 @@ Hunk* HunkList::ToHunk(const char* name, int baseAddress, int* splittingPoint) c
 		if(splittingPoint && *splittingPoint == -1 && !(h->GetFlags() & HUNK_IS_CODE))
 			*splittingPoint = address;
 
-		memcpy(&newHunk->GetPtr()[address], h->GetPtr(), h->GetRawSize());
+		memcpy(&newHunk->GetPtr()[address], h->GetData(), h->GetRawSize());
 		if (NeedsContinuationJump(it)) {
 			unsigned char jumpCode[5] = {0xE9, 0x00, 0x00, 0x00, 0x00};
 			memcpy(&newHunk->GetPtr()[address+h->GetRawSize()], jumpCode, 5);
-			Relocation r = {h->GetContinuation()->name.c_str(), address+h->GetRawSize()+1, RELOCTYPE_REL32};
+			Relocation r = {h->GetContinuation()->name, address+h->GetRawSize()+1, RELOCTYPE_REL32};
 			newHunk->AddRelocation(r);
 			address += h->GetRawSize()+5;
 		} else {
@@ -193,46 +248,41 @@ Symbol* HunkList::FindUndecoratedSymbol(const char* name) const {
 }
 
 Symbol* HunkList::FindSymbol(const char* name) const {
-	Symbol* res = NULL;
-	for(Hunk* hunk : m_hunks) {
-		Symbol* s = hunk->FindSymbol(name);
-		if(s != NULL) {
-			if(s->secondaryName.size() == 0)
-				return s;
-			else
-				res = s;
-		}
-	}
+	UpdateSymbolIndex();
+	return FindSymbol(NameTable::Find(name));
+}
 
-	return res;
+Symbol* HunkList::FindSymbol(const Name& name) const {
+	return FindSymbol(name.GetId());
+}
+
+Symbol* HunkList::FindSymbol(int nameId) const {
+	UpdateSymbolIndex();
+	auto it = m_symbolIndex.find(nameId);
+	return it != m_symbolIndex.end() ? it->second : NULL;
 }
 
 void HunkList::RemoveUnreferencedHunks(vector<Hunk*> startHunks) {
-	stack<Hunk*> stak;
+	HunkGraph graph(*this);
+	stack<int> stak;
 	for(Hunk* hunk : startHunks) {
 		hunk->m_numReferences++;
-		stak.push(hunk);
+		int index = graph.GetIndex(hunk);
+		if(index != -1)
+			stak.push(index);
 	}
 
-	// Mark reachable hunks
+	// Mark reachable hunks. Weak symbols keep their own hunk, but only the hunk they refer to is followed.
 	while(stak.size() > 0) {
-		Hunk* h = stak.top();
+		int h = stak.top();
 		stak.pop();
 
-		for(Relocation& relocation : h->m_relocations) {
-			Symbol* s = FindSymbol(relocation.symbolname.c_str());
-			
-			if(s) {
-				if(s->secondaryName.size() > 0)	{	// Weak symbol
-					s->hunk->m_numReferences++;
-					s = FindSymbol(s->secondaryName.c_str());
-					if(s == NULL)
-						continue;
-				}
-				if(s->hunk->m_numReferences++ == 0) {
-					stak.push(s->hunk);
-				}
-			}
+		const HunkGraph::Edge* edges = graph.GetEdges(h);
+		for(int i = 0; i < graph.GetNumEdges(h); i++) {
+			if(edges[i].weak != -1)
+				graph.GetHunk(edges[i].weak)->m_numReferences++;
+			if(edges[i].target != -1 && graph.GetHunk(edges[i].target)->m_numReferences++ == 0)
+				stak.push(edges[i].target);
 		}
 	}
 
@@ -245,6 +295,7 @@ void HunkList::RemoveUnreferencedHunks(vector<Hunk*> startHunks) {
 			it++;
 		}
 	}
+	InvalidateSymbolIndex();
 }
 
 void HunkList::RemoveImportHunks() {
@@ -257,6 +308,7 @@ void HunkList::RemoveImportHunks() {
 			it++;
 		}
 	}
+	InvalidateSymbolIndex();
 }
 
 void HunkList::Trim() {
@@ -277,4 +329,9 @@ void HunkList::RoundFloats(int defaultBits) {
 void HunkList::MarkHunksAsLibrary() {
 	for (Hunk* hunk : m_hunks)
 		hunk->MarkHunkAsLibrary();
+}
+
+void HunkList::Unshare() {
+	for (Hunk* hunk : m_hunks)
+		hunk->Unshare();
 }
\ No newline at end of file
@@ -2,18 +2,31 @@
 #ifndef _HUNK_LIST_H_
 #define _HUNK_LIST_H_
 
+#include <unordered_map>
 #include <vector>
 
 class Hunk;
 class Symbol;
+class Name;
 class HunkList {
 	std::vector<Hunk*>	m_hunks;
+
+	// Result of FindSymbol per interned name, built on demand. Hunks added at the back are
+	// indexed incrementally; other changes to the list or its symbols invalidate the index.
+	mutable std::unordered_map<int, Symbol*>	m_symbolIndex;
+	mutable bool			m_symbolIndexValid;
+	mutable unsigned int	m_symbolIndexGeneration;
+
+	bool	IsSymbolIndexCurrent() const;
+	void	UpdateSymbolIndex() const;
+	void	IndexHunk(Hunk* hunk) const;
+	void	InvalidateSymbolIndex() { m_symbolIndexValid = false; }
 public:
 	HunkList();
 	~HunkList();
 
-	Hunk*& operator[] (unsigned idx);
 	Hunk* const & operator[] (unsigned idx) const;
+	void	SetHunk(int index, Hunk* hunk);
 
 	void	AddHunkBack(Hunk* hunk);
 	void	AddHunkFront(Hunk* hunk);
@@ -24,6 +37,8 @@ public:
 	void	InsertHunk(int index, Hunk* hunk);
 
 	Symbol* FindSymbol(const char* name) const;
+	Symbol* FindSymbol(const Name& name) const;
+	Symbol* FindSymbol(int nameId) const;		// Name interned by NameTable
 	Symbol* FindUndecoratedSymbol(const char* name) const;
 	void	RemoveUnreferencedHunks(std::vector<Hunk*> startHunks);
 
@@ -33,6 +48,7 @@ public:
 	void	Clear();
 
 	void	MarkHunksAsLibrary();
+	void	Unshare();
 
 	void	Trim();
 	void	PrintHunks();
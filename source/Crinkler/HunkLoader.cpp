@@ -1,9 +1,13 @@
 #include <cassert>
 #include "MemoryFile.h"
 #include "HunkLoader.h"
+#include "HunkList.h"
 
 HunkList* HunkLoader::LoadFromFile(const char* filename) {
 	MemoryFile mf(filename);
 
-	return Load(mf.GetPtr(), mf.GetSize(), filename);
+	HunkList* hunklist = Load(mf.GetPtr(), mf.GetSize(), filename);
+	if(hunklist)
+		hunklist->Unshare();	// The file is released on return
+	return hunklist;
 }
\ No newline at end of file
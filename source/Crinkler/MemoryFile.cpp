@@ -1,10 +1,14 @@
 #include <cstdio>
+#include <windows.h>
 
 #include "MemoryFile.h"
 
 #include "Log.h"
 
-MemoryFile::MemoryFile(const char* filename, bool abort_if_failed) {
+MemoryFile::MemoryFile(const char* filename, bool abort_if_failed, bool map) : m_mapped(false) {
+	if(map && Map(filename))
+		return;
+
 	FILE* file;
 	if(!fopen_s(&file, filename, "rb")) {
 		fseek(file, 0, SEEK_END);
@@ -26,8 +30,34 @@ MemoryFile::MemoryFile(const char* filename, bool abort_if_failed) {
 }
 
 
+bool MemoryFile::Map(const char* filename) {
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+
+	// Empty files cannot be mapped
+	DWORD filesize = GetFileSize(file, NULL);
+	HANDLE mapping = filesize != 0 && filesize != INVALID_FILE_SIZE ? CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0, NULL) : NULL;
+	CloseHandle(file);
+	if(mapping == NULL)
+		return false;
+
+	// The view keeps the mapping open
+	m_data = (char*)MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+	CloseHandle(mapping);
+	if(m_data == NULL)
+		return false;
+
+	m_size = (int)filesize;
+	m_mapped = true;
+	return true;
+}
+
 MemoryFile::~MemoryFile() {
-	delete[] m_data;
+	if(m_mapped)
+		UnmapViewOfFile(m_data);
+	else
+		delete[] m_data;
 }
 
 bool MemoryFile::Write(const char *filename) const {
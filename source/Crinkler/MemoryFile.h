@@ -1,11 +1,16 @@
 #ifndef _MEMORY_FILE_H_
 #define _MEMORY_FILE_H_
 
+// The contents of a file. Read files are zero terminated. Mapped files are mapped copy-on-write
+// and are not zero terminated, so they can only hold binary data.
 class MemoryFile {
 	char*	m_data;
 	int		m_size;
+	bool	m_mapped;
+
+	bool	Map(const char* filename);
 public:
-	MemoryFile(const char* filename, bool abort_if_failed = true);
+	MemoryFile(const char* filename, bool abort_if_failed = true, bool map = false);
 	~MemoryFile();
 
 	int		GetSize() const	{ return m_size; }
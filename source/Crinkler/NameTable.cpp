@@ -0,0 +1,54 @@
+#include "NameTable.h"
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+// The table is split into shards with a lock each, so the parallel loaders rarely wait for each other.
+// IDs are handed out across all shards.
+static const int SHARD_BITS = 6;
+
+struct Shard {
+	mutex						m_mutex;
+	unordered_map<string, int>	m_table;
+};
+
+static Shard& GetShard(const string& name) {
+	static Shard shards[1 << SHARD_BITS];
+	// The top bits of the hash pick the shard, as the table buckets depend on the low bits
+	unsigned int hash = (unsigned int)std::hash<string>()(name);
+	return shards[(hash * 0x9E3779B1u) >> (32 - SHARD_BITS)];
+}
+
+static atomic<int> s_numNames(0);
+
+Name::Name() {
+	static const Name empty = NameTable::Intern("");
+	m_entry = empty.m_entry;
+}
+
+Name::Name(const char* name) : m_entry(NameTable::Intern(name).m_entry) {
+}
+
+Name::Name(const string& name) : m_entry(NameTable::Intern(name).m_entry) {
+}
+
+Name NameTable::Intern(const string& name) {
+	Shard& shard = GetShard(name);
+	lock_guard<mutex> lock(shard.m_mutex);
+	// Elements of an unordered_map do not move when it grows
+	auto it = shard.m_table.find(name);
+	if(it == shard.m_table.end())
+		it = shard.m_table.emplace(name, s_numNames++).first;
+	return Name(&*it);
+}
+
+int NameTable::Find(const string& name) {
+	Shard& shard = GetShard(name);
+	lock_guard<mutex> lock(shard.m_mutex);
+	auto it = shard.m_table.find(name);
+	return it != shard.m_table.end() ? it->second : -1;
+}
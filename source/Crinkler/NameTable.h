@@ -0,0 +1,60 @@
+#pragma once
+#ifndef _NAME_TABLE_H_
+#define _NAME_TABLE_H_
+
+#include <string>
+#include <utility>
+
+// An interned symbol name. Copying a name copies a pointer into the name table,
+// and equal names have the same ID.
+class Name {
+	friend class NameTable;
+	const std::pair<const std::string, int>*	m_entry;
+
+	explicit Name(const std::pair<const std::string, int>* entry) : m_entry(entry) {}
+public:
+	Name();
+	explicit Name(const char* name);
+	explicit Name(const std::string& name);
+
+	const std::string&	str() const						{ return m_entry->first; }
+	const char*			c_str() const					{ return m_entry->first.c_str(); }
+	size_t				size() const					{ return m_entry->first.size(); }
+	bool				empty() const					{ return m_entry->first.empty(); }
+	int					GetId() const					{ return m_entry->second; }
+	char				operator[](size_t i) const		{ return m_entry->first[i]; }
+	operator const std::string&() const					{ return m_entry->first; }
+};
+
+inline bool operator==(const Name& a, const Name& b)			{ return a.GetId() == b.GetId(); }
+inline bool operator!=(const Name& a, const Name& b)			{ return a.GetId() != b.GetId(); }
+inline bool operator==(const Name& a, const char* b)			{ return a.str() == b; }
+inline bool operator!=(const Name& a, const char* b)			{ return a.str() != b; }
+inline bool operator==(const Name& a, const std::string& b)		{ return a.str() == b; }
+inline bool operator!=(const Name& a, const std::string& b)		{ return a.str() != b; }
+inline bool operator<(const Name& a, const Name& b)				{ return a.str() < b.str(); }
+inline std::string operator+(const std::string& a, const Name& b)	{ return a + b.str(); }
+inline std::string operator+(const Name& a, const std::string& b)	{ return a.str() + b; }
+inline std::string operator+(const char* a, const Name& b)			{ return a + b.str(); }
+inline std::string operator+(const Name& a, const char* b)			{ return a.str() + b; }
+
+// Orders names alphabetically, and allows looking them up by string without interning
+struct NameLess {
+	typedef void is_transparent;
+	bool operator()(const Name& a, const Name& b) const				{ return a.str() < b.str(); }
+	bool operator()(const Name& a, const std::string& b) const		{ return a.str() < b; }
+	bool operator()(const std::string& a, const Name& b) const		{ return a < b.str(); }
+	bool operator()(const Name& a, const char* b) const				{ return a.str().compare(b) < 0; }
+	bool operator()(const char* a, const Name& b) const				{ return b.str().compare(a) > 0; }
+};
+
+// Process-wide table of interned symbol names. Equal names always get the same ID,
+// so symbols can be indexed and looked up by a small integer instead of a string.
+// The strings are kept for the lifetime of the process. The table is thread-safe.
+class NameTable {
+public:
+	static Name	Intern(const std::string& name);	// Returns name, adding it if needed
+	static int	Find(const std::string& name);		// Returns the ID of name, or -1 if it was never interned
+};
+
+#endif
@@ -0,0 +1,112 @@
+#pragma once
+#ifndef _OBJECT_POOL_H_
+#define _OBJECT_POOL_H_
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// Memory for the many small objects of a link. While an arena exists, the object pools carve
+// their objects from blocks owned by it, and the blocks are released when it is destroyed.
+// Every object allocated from an arena must be deleted before the arena. Blocks allocated
+// outside any arena are kept for the lifetime of the process.
+class ObjectArena {
+	std::mutex			m_mutex;
+	std::vector<void*>	m_blocks;
+	ObjectArena*		m_previous;
+
+	static std::atomic<ObjectArena*>& Current() {
+		static std::atomic<ObjectArena*> current(nullptr);
+		return current;
+	}
+
+	static std::atomic<unsigned int>& Generation() {
+		static std::atomic<unsigned int> generation(0);
+		return generation;
+	}
+public:
+	ObjectArena() : m_previous(Current()) {
+		Current() = this;
+		Generation()++;
+	}
+
+	~ObjectArena() {
+		Current() = m_previous;
+		Generation()++;
+		for(void* block : m_blocks)
+			::operator delete(block);
+	}
+
+	ObjectArena(const ObjectArena&) = delete;
+	ObjectArena& operator=(const ObjectArena&) = delete;
+
+	// Changes whenever an arena is created or destroyed, which invalidates the blocks and free lists of the pools
+	static unsigned int GetGeneration() {
+		return Generation();
+	}
+
+	static void* AllocateBlock(size_t size) {
+		void* block = ::operator new(size);
+		if(ObjectArena* arena = Current()) {
+			std::lock_guard<std::mutex> lock(arena->m_mutex);
+			arena->m_blocks.push_back(block);
+		}
+		return block;
+	}
+};
+
+// Allocator for objects of one size. Objects are carved from blocks of the current ObjectArena.
+// Freed objects are reused by the thread freeing them, so only getting a new block takes a lock.
+template <size_t Size>
+class ObjectPool {
+	static const int OBJECTS_PER_BLOCK = 1024;
+
+	union Slot {
+		Slot*	next;
+		alignas(std::max_align_t) char data[Size];
+	};
+
+	struct ThreadState {
+		unsigned int	generation = 0;
+		Slot*			freeList = nullptr;
+		Slot*			block = nullptr;
+		int				blockUsed = OBJECTS_PER_BLOCK;
+	};
+
+	// The state of the thread, forgetting any blocks of an arena that is gone
+	static ThreadState& GetState() {
+		thread_local ThreadState state;
+		unsigned int generation = ObjectArena::GetGeneration();
+		if(state.generation != generation) {
+			state = ThreadState();
+			state.generation = generation;
+		}
+		return state;
+	}
+public:
+	static void* Allocate() {
+		ThreadState& state = GetState();
+		if(state.freeList) {
+			Slot* slot = state.freeList;
+			state.freeList = slot->next;
+			return slot;
+		}
+		if(state.blockUsed == OBJECTS_PER_BLOCK) {
+			state.block = (Slot*)ObjectArena::AllocateBlock(OBJECTS_PER_BLOCK * sizeof(Slot));
+			state.blockUsed = 0;
+		}
+		return &state.block[state.blockUsed++];
+	}
+
+	static void Free(void* ptr) {
+		if(ptr == nullptr)
+			return;
+		ThreadState& state = GetState();
+		Slot* slot = (Slot*)ptr;
+		slot->next = state.freeList;
+		state.freeList = slot;
+	}
+};
+
+#endif
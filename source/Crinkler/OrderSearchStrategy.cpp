@@ -0,0 +1,41 @@
+#include "OrderSearchStrategy.h"
+#include <cmath>
+#include "../Compressor/Compressor.h"
+
+// Temperatures are in bytes
+static const float ANNEAL_START_TEMPERATURE = 0.5f;
+static const float ANNEAL_END_TEMPERATURE = 0.01f;
+static const int ANNEAL_RESTART_FAILS = 1000;
+
+OrderSearchStrategy* OrderSearchStrategy::Create(OrderSearchType type) {
+	switch (type) {
+	case ORDERSEARCH_ANNEAL:
+		return new AnnealingOrderSearch(ANNEAL_START_TEMPERATURE, ANNEAL_END_TEMPERATURE, ANNEAL_RESTART_FAILS);
+	case ORDERSEARCH_GREEDY:
+	default:
+		return new GreedyOrderSearch();
+	}
+}
+
+bool GreedyOrderSearch::Accept(int size, int currentSize, float progress) {
+	return size < currentSize;
+}
+
+AnnealingOrderSearch::AnnealingOrderSearch(float startTemperature, float endTemperature, int restartFails) :
+	m_startTemperature(startTemperature), m_endTemperature(endTemperature), m_restartFails(restartFails), m_random(1)
+{
+}
+
+bool AnnealingOrderSearch::Accept(int size, int currentSize, float progress) {
+	if (size < currentSize)
+		return true;
+
+	float temperature = m_startTemperature * powf(m_endTemperature / m_startTemperature, progress);
+	float increase = (size - currentSize) / (float)(BIT_PRECISION * 8);
+	float probability = expf(-increase / temperature);
+	return std::uniform_real_distribution<float>(0.0f, 1.0f)(m_random) < probability;
+}
+
+bool AnnealingOrderSearch::Restart(int fails) {
+	return fails >= m_restartFails;
+}
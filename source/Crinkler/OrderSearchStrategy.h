@@ -0,0 +1,57 @@
+#pragma once
+#ifndef _ORDER_SEARCH_STRATEGY_H_
+#define _ORDER_SEARCH_STRATEGY_H_
+
+#include <random>
+
+enum OrderSearchType {
+	ORDERSEARCH_GREEDY, ORDERSEARCH_ANNEAL
+};
+
+static const char *OrderSearchTypeName(OrderSearchType type) {
+	switch (type) {
+	case ORDERSEARCH_GREEDY:
+		return "GREEDY";
+	case ORDERSEARCH_ANNEAL:
+		return "ANNEAL";
+	}
+	return "";
+}
+
+// Decides which of the tried section orderings the empirical hunk sorter continues from.
+class OrderSearchStrategy {
+public:
+	virtual ~OrderSearchStrategy() {}
+
+	// Whether to move from the current ordering to a tried one. Sizes are in BIT_PRECISION units,
+	// progress runs from 0 to 1 over the search.
+	virtual bool	Accept(int size, int currentSize, float progress) = 0;
+
+	// Whether to return to the best ordering found, given the number of tries since it was found
+	virtual bool	Restart(int fails) { return false; }
+
+	static OrderSearchStrategy* Create(OrderSearchType type);
+};
+
+// Only moves to orderings that are strictly smaller
+class GreedyOrderSearch : public OrderSearchStrategy {
+public:
+	bool	Accept(int size, int currentSize, float progress) override;
+};
+
+// Simulated annealing: also moves to larger orderings, with a probability that drops as the
+// temperature cools down exponentially over the search. Returns to the best ordering when the
+// search has not found a new one for a while.
+class AnnealingOrderSearch : public OrderSearchStrategy {
+	float			m_startTemperature;
+	float			m_endTemperature;
+	int				m_restartFails;
+	std::mt19937	m_random;
+public:
+	AnnealingOrderSearch(float startTemperature, float endTemperature, int restartFails);
+
+	bool	Accept(int size, int currentSize, float progress) override;
+	bool	Restart(int fails) override;
+};
+
+#endif
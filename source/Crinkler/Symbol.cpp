@@ -1,6 +1,7 @@
 #include "Symbol.h"
 #include <windows.h>
 #include <dbghelp.h>
+#include "ObjectPool.h"
 
 using namespace std;
 
@@ -8,7 +9,18 @@ Symbol::Symbol(const char* name, int value, unsigned int flags, Hunk* hunk, cons
 	name(name), value(value), flags(flags), hunk(hunk), fromLibrary(false), hunk_offset(0)
 {
 	if(miscString)
-		this->miscString = miscString;
+		this->miscString = Name(miscString);
+}
+
+void* Symbol::operator new(size_t size) {
+	return size == sizeof(Symbol) ? ObjectPool<sizeof(Symbol)>::Allocate() : ::operator new(size);
+}
+
+void Symbol::operator delete(void* ptr, size_t size) {
+	if(size == sizeof(Symbol))
+		ObjectPool<sizeof(Symbol)>::Free(ptr);
+	else
+		::operator delete(ptr);
 }
 
 std::string Symbol::GetUndecoratedName() const {
@@ -8,14 +8,15 @@ const int SYMBOL_IS_FUNCTION =		0x04;
 const int SYMBOL_IS_SECTION =		0x08;
 
 #include <string>
+#include "NameTable.h"
 
 class Hunk;
 class Symbol {
 public:
 	Symbol(const char* name, int value, unsigned int flags, Hunk* hunk, const char* miscString=0);
-	std::string		name;
-	std::string		secondaryName;	// If this is != "" the symbol is a reference to the symbol with the name secondaryName.
-	std::string		miscString;		// For holding extra textual information about the symbol e.g. a section name.
+	Name			name;
+	Name			secondaryName;	// If this is != "" the symbol is a reference to the symbol with the name secondaryName.
+	Name			miscString;		// For holding extra textual information about the symbol e.g. a section name.
 	int				value;
 	unsigned int	flags;
 	Hunk*			hunk;
@@ -25,6 +26,10 @@ public:
 
 	// Demangle the VC decorations
 	std::string GetUndecoratedName() const;
+
+	// Symbols are allocated from an ObjectPool
+	static void*	operator new(size_t size);
+	static void		operator delete(void* ptr, size_t size);
 };
 
 #endif
@@ -19,6 +19,7 @@ public:
 	bool			LinkAndTransform(HunkList* hunklist, Symbol *entry_label, int baseAddress, Hunk* &transformedHunk, Hunk** untransformedHunk, int* splittingPoint, bool verbose);
 
 	void			Disable() { m_enabled = false; }
+	bool			IsEnabled() const { return m_enabled; }
 };
 
 class IdentityTransform : public Transform {
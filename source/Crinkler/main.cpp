@@ -224,6 +224,12 @@ int main(int argc, char* argv[]) {
 							0, 100000, 100);
 	CmdParamInt hunktriesArg("ORDERTRIES", "", "number of section reordering tries", 0,
 							0, 100000, 0);
+	CmdParamInt hunkBatchArg("ORDERBATCH", "number of section orderings tried side by side", "orderings", 0,
+							1, 256, 0);
+	CmdParamInt hunkTimeArg("ORDERTIME", "time spent on section reordering, replacing ORDERTRIES", "seconds", 0,
+							1, 1000000, 0);
+	CmdParamInt beamWidthArg("BEAMWIDTH", "number of model sets searched side by side", "width", 0,
+							1, 64, 0);
 	CmdParamInt truncateFloatsArg("TRUNCATEFLOATS", "truncates floats", "bits", PARAM_ALLOW_NO_ARGUMENT_DEFAULT,
 							0, 64, 64);
 	CmdParamInt overrideAlignmentsArg("OVERRIDEALIGNMENTS", "override section alignments using align labels", "bits",  PARAM_ALLOW_NO_ARGUMENT_DEFAULT,
@@ -258,6 +264,9 @@ int main(int argc, char* argv[]) {
 						"FAST", COMPRESSION_FAST, 
 						"SLOW", COMPRESSION_SLOW,
 						"VERYSLOW", COMPRESSION_VERYSLOW, NULL);
+	CmdParamFlags hunkSearchArg("ORDERSEARCH", "section reordering search strategy", PARAM_FORBID_MULTIPLE_DEFINITIONS, ORDERSEARCH_GREEDY,
+						"GREEDY", ORDERSEARCH_GREEDY,
+						"ANNEAL", ORDERSEARCH_ANNEAL, NULL);
 	CmdParamFlags printArg("PRINT", "print", 0, 0, 
 							"LABELS", PRINT_LABELS, "IMPORTS", PRINT_IMPORTS,
 							"MODELS", PRINT_MODELS, 
@@ -276,7 +285,7 @@ int main(int argc, char* argv[]) {
 	CmdParamString filesArg("FILES", "list of filenames", "", PARAM_HIDE_IN_PARAM_LIST, 0);
 	CmdLineInterface cmdline(CRINKLER_TITLE, CMDI_PARSE_FILES);
 
-	cmdline.AddParams(&helpFlag, &crinklerFlag, &hashsizeArg, &hashtriesArg, &hunktriesArg, &noDefaultLibArg, &entryArg, &outArg, &summaryArg, &reuseFileArg, &reuseArg, &unsafeImportArg,
+	cmdline.AddParams(&helpFlag, &crinklerFlag, &hashsizeArg, &hashtriesArg, &hunktriesArg, &hunkBatchArg, &hunkTimeArg, &hunkSearchArg, &beamWidthArg, &noDefaultLibArg, &entryArg, &outArg, &summaryArg, &reuseFileArg, &reuseArg, &unsafeImportArg,
 						&subsystemArg, &largeAddressAwareArg, &truncateFloatsArg, &overrideAlignmentsArg, &unalignCodeArg, &compmodeArg, &saturateArg, &printArg, &transformArg, &libpathArg, 
 						&rangeImportArg, &replaceDllArg, &fallbackDllArg, &exportArg, &stripExportsArg, &noInitializersArg, &filesArg, &priorityArg, &showProgressArg, &recompressFlag,
 						&tinyHeader, &tinyImport,
@@ -311,13 +320,14 @@ int main(int argc, char* argv[]) {
 		subsystemArg.SetDefault(-1);
 		compmodeArg.SetDefault(-1);
 
-		cmdline2.AddParams(&crinklerFlag, &recompressFlag, &outArg, &hashsizeArg, &hashtriesArg, &subsystemArg, &largeAddressAwareArg, &compmodeArg, &saturateArg, &replaceDllArg, &summaryArg, &exportArg, &stripExportsArg, &priorityArg, &showProgressArg, &filesArg, NULL);
+		cmdline2.AddParams(&crinklerFlag, &recompressFlag, &outArg, &hashsizeArg, &hashtriesArg, &subsystemArg, &largeAddressAwareArg, &compmodeArg, &beamWidthArg, &saturateArg, &replaceDllArg, &summaryArg, &exportArg, &stripExportsArg, &priorityArg, &showProgressArg, &filesArg, NULL);
 		cmdline2.SetCmdParameters(argc, argv);
 		if(cmdline2.Parse()) {
 			crinkler.SetHashsize(hashsizeArg.GetValue());
 			crinkler.SetSubsystem((SubsystemType)subsystemArg.GetValue());
 			crinkler.SetLargeAddressAware(largeAddressAwareArg.GetValueIfPresent(-1));
 			crinkler.SetCompressionType((CompressionType)compmodeArg.GetValue());
+			crinkler.SetBeamWidth(beamWidthArg.GetValue());
 			crinkler.SetSaturate(saturateArg.GetValueIfPresent(-1));
 			crinkler.SetHashtries(hashtriesArg.GetValue());
 			crinkler.ShowProgressBar(showProgressArg.GetValue());
@@ -357,6 +367,9 @@ int main(int argc, char* argv[]) {
 				printf("Compression mode: Models inherited from original\n");
 			} else {
 				printf("Compression mode: %s\n", CompressionTypeName((CompressionType)compmodeArg.GetValue()));
+				if (beamWidthArg.GetValue() > 0) {
+					printf("Beam width: %d\n", beamWidthArg.GetValue());
+				}
 			}
 			if (saturateArg.GetNumMatches() == 0) {
 				printf("Saturate counters: Inherited from original\n");
@@ -442,8 +455,12 @@ int main(int argc, char* argv[]) {
 	crinkler.SetSubsystem((SubsystemType)subsystemArg.GetValue());
 	crinkler.SetLargeAddressAware(largeAddressAwareArg.GetValueIfPresent(0));
 	crinkler.SetCompressionType((CompressionType)compmodeArg.GetValue());
+	crinkler.SetBeamWidth(beamWidthArg.GetValue());
 	crinkler.SetHashtries(hashtriesArg.GetValue());
 	crinkler.SetHunktries(hunktriesArg.GetValue());
+	crinkler.SetHunkBatch(hunkBatchArg.GetValue());
+	crinkler.SetHunkSearch((OrderSearchType)hunkSearchArg.GetValue());
+	crinkler.SetHunkTimeLimit(hunkTimeArg.GetValue());
 	crinkler.SetSaturate(saturateArg.GetValueIfPresent(0));
 	crinkler.SetPrintFlags(printArg.GetValue());
 	crinkler.ShowProgressBar(showProgressArg.GetValue());
@@ -476,10 +493,21 @@ int main(int argc, char* argv[]) {
 	printf("Subsystem type: %s\n", subsystemArg.GetValue() == SUBSYSTEM_CONSOLE ? "CONSOLE" : "WINDOWS");
 	printf("Large address aware: %s\n", largeAddressAwareArg.GetValueIfPresent(0) ? "YES" : "NO");
 	printf("Compression mode: %s\n", CompressionTypeName((CompressionType)compmodeArg.GetValue()));
+	if (beamWidthArg.GetValue() > 0) {
+		printf("Beam width: %d\n", beamWidthArg.GetValue());
+	}
 	printf("Saturate counters: %s\n", saturateArg.GetValueIfPresent(0) ? "YES" : "NO");
 	printf("Hash size: %d MB\n", hashsizeArg.GetValue());
 	printf("Hash tries: %d\n", hashtriesArg.GetValue());
-	printf("Order tries: %d\n", hunktriesArg.GetValue());
+	if (hunkTimeArg.GetValue() > 0) {
+		printf("Order time: %d s\n", hunkTimeArg.GetValue());
+	} else {
+		printf("Order tries: %d\n", hunktriesArg.GetValue());
+	}
+	printf("Order search: %s\n", OrderSearchTypeName((OrderSearchType)hunkSearchArg.GetValue()));
+	if (hunkBatchArg.GetValue() > 0) {
+		printf("Order batch: %d\n", hunkBatchArg.GetValue());
+	}
 	if (reuseFileArg.GetNumMatches() > 0) {
 		printf("Reuse mode: %s\n", ReuseTypeName((ReuseType)reuseArg.GetValue()));
 		printf("Reuse file: %s\n", reuseFileArg.GetValue());
@@ -574,6 +602,7 @@ int main(int argc, char* argv[]) {
 	
 	// Load files
 	{
+		vector<string> filepaths;
 		while(filesArg.HasNext()) {
 			const char* filename = filesArg.GetValue();
 			filesArg.Next();
@@ -584,10 +613,10 @@ int main(int argc, char* argv[]) {
 			} else {
 				printf("Loading %s...\n", filename);
 				fflush(stdout);
-				string filepath = *res.begin();
-				crinkler.Load(filepath.c_str());
+				filepaths.push_back(*res.begin());
 			}
 		}
+		crinkler.Load(filepaths);
 		if (!noDefaultLibArg.GetValue()) {
 			crinkler.AddRuntimeLibrary();
 		}